@@ -117,7 +117,8 @@ void vapi_test04(int fd)
     int err_code;
     uint32_t stime = _get_mtime();
 
-    err_code = vapi_core_invoke( fd, api_id_test04, NULL, 0 );
+    // a notification, which needs no acknowledgement
+    err_code = vapi_core_invoke_oneway( fd, api_id_test04, NULL, 0 );
     LOG_MSG("vapi_test04(%d): err_code=%d, %u msec.\n", fd, err_code, _get_mtime() - stime);
 }
 
@@ -31,11 +31,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //=============================================================================
 #include "vapi_core_local.h"
 #include "vapi_core.h"
+#include "vapi_core_trace.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -43,6 +45,28 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <arpa/inet.h>
 #include <errno.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC (0x0001U)
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB (0x0004U)
+#endif
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE (0x01)
+#endif
+#ifndef SPLICE_F_MORE
+#define SPLICE_F_MORE (0x04)
+#endif
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ (1031)
+#endif
 
 
 //=============================================================================
@@ -55,40 +79,651 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 typedef struct
 {
-    int32_t api_id;
-    uint32_t arg_len;
-    int err_code, errsv;
-} _vapi_core_hdr_t;
+    int32_t topic;
+    vapi_core_event_handler_t handler;
+    void *p_cookie;
+} _vapi_core_subscription_t;
+
+#define _VAPI_CORE_EVENT_PENDING_MAX (1024)
+
+/* An event received while a synchronous call waits for its reply. */
+typedef struct __vapi_core_pending_t
+{
+    struct __vapi_core_pending_t *p_next;
+    uint32_t len;
+    uint8_t body[];
+} _vapi_core_pending_t;
+
+typedef struct __vapi_core_call_t _vapi_core_call_t;
+typedef struct __vapi_core_extent_t _vapi_core_extent_t;
+
+/* A free range of the argument region. */
+struct __vapi_core_extent_t
+{
+    uint32_t off, len;
+    _vapi_core_extent_t *p_next;
+};
+
+/* The header of a block of vapi_core_alloc(), which precedes the returned address. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t len;         /* including this header */
+    uint8_t pad[_VAPI_CORE_SHM_ALIGN - 8];
+} _vapi_core_block_t;
+
+#define _VAPI_CORE_BLOCK_MAGIC (0x5641424b) /* "VABK" */
+
+/* A request issued by vapi_core_invoke_async(). */
+struct __vapi_core_call_t
+{
+    _vapi_core_hdr_t hdr;
+    void *p_arg;
+    vapi_core_completion_t callback;
+    void *p_cookie;
+    uint32_t sent;                        /* bytes of the header and the arguments */
+    _vapi_core_call_t *p_next;
+#ifdef VAPI_CORE_TRACE
+    uint32_t seq;
+#endif
+};
 
 typedef struct
 {
-    int sock;
+    int sock;                             /* -1 while calling a sub of this process directly */
+    uint16_t port;
+    void *p_local;                        /* the sub of this process called directly */
+
+    /* negotiated by _VAPI_CORE_API_ID_HELLO */
+    uint32_t transport;                   /* VAPI_CORE_TRANSPORT_* of "sock" */
+    uint32_t version;                     /* of the sub */
+    uint32_t transports;                  /* _VAPI_CORE_TRANSPORT_* offered by the sub */
+    uint32_t max_arg_len;                 /* the largest arguments the sub admits, 0 if no limit */
+
+    int pass_fd;                          /* sent with the arguments of the next call by SCM_RIGHTS, -1 if none */
+    int broken;                           /* a send or receive failed amid a call, so out of step with the sub */
+
+    /* pipe of the large arguments spliced to the socket, -1 until needed */
+    int pipe_fd[2];
+    int splice_off;                       /* not supported by the kernel or the socket */
+    _vapi_core_subscription_t subs[_VAPI_CORE_TOPIC_MAX];
+    int sub_num;
+    _vapi_core_ring_hdr_t *p_ring;
+    size_t ring_len;
+    uint32_t req_id;
+
+    /* events held until the synchronous call completes, oldest first, so that
+       their handlers may call the sub again */
+    _vapi_core_pending_t *p_ev_head, *p_ev_tail;
+    uint32_t ev_num;
+    int dispatching;                      /* handlers running, which must not close the descriptor */
+
+    /* outstanding calls of vapi_core_invoke_async(), oldest first */
+    _vapi_core_call_t *p_call_head, *p_call_tail;
+    _vapi_core_call_t *p_send;            /* the first call not sent completely */
+
+    /* the frame being received by vapi_core_process() */
+    _vapi_core_hdr_t rx_hdr;
+    uint32_t rx_len;
+    _vapi_core_call_t *p_rx_call;         /* the reply goes to its arguments */
+    uint8_t *p_rx_buf;                    /* the event body */
+
+    /* argument region of vapi_core_alloc(), mapped by the sub too. Not locked,
+       the descriptor is used by one thread at a time */
+    uint8_t *p_shm;
+    _vapi_core_extent_t *p_shm_free;      /* sorted by the offset */
+#ifdef VAPI_CORE_TRACE
+    uint16_t trace_conn;
+    uint32_t trace_seq;
+#endif
 } _vapi_core_t;
 
 
 //=============================================================================
-// Local Function/Variable Implementations
+// Local Function/Variable Prototypes
 //=============================================================================
+static int32_t _vapi_core_invoke(_vapi_core_t *p_fd, int32_t api_id, void* p_arg, uint32_t arg_len);
+static int _vapi_core_need_socket(_vapi_core_t *p_fd);
 
 
 //=============================================================================
-// Global Function/Variable Implementations
+// Local Function/Variable Implementations
 //=============================================================================
-int32_t vapi_core_open(uint16_t dstport)
+static int _vapi_core_ring_map(_vapi_core_t *p_fd, const char *p_name, uint32_t size)
+{
+    int line = 0, errsv = 0;
+    int shm_fd = -1;
+    size_t map_len = sizeof(_vapi_core_ring_hdr_t) + size;
+    void *p_map;
+
+    shm_fd = shm_open(p_name, O_RDONLY, 0);
+    if( shm_fd == -1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    p_map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, shm_fd, 0);
+    if( p_map == MAP_FAILED ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    close(shm_fd);
+
+    if( ((_vapi_core_ring_hdr_t*)p_map)->magic != _VAPI_CORE_RING_MAGIC  ||
+        ((_vapi_core_ring_hdr_t*)p_map)->size != size ){
+        munmap(p_map, map_len);
+        line = __LINE__; goto _err_end_;
+    }
+
+    p_fd->p_ring = (_vapi_core_ring_hdr_t*)p_map;
+    p_fd->ring_len = map_len;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( shm_fd >= 0 ) close(shm_fd);
+
+    return -1;
+}
+
+/*
+  maps the argument region by a memfd, which is passed to the sub over the
+  unix socket. It is on hugepages if they are reserved in vm.nr_hugepages.
+*/
+static int _vapi_core_shm_memfd(_vapi_core_shm_attach_t *p_arg, void **pp_map)
+{
+#ifdef SYS_memfd_create
+    static const unsigned int flags[] = { MFD_CLOEXEC | MFD_HUGETLB, MFD_CLOEXEC };
+    unsigned int i;
+    int shm_fd;
+
+    for(i=0; i<sizeof(flags)/sizeof(flags[0]); ++i){
+        shm_fd = syscall(SYS_memfd_create, "vapi_core_shm", flags[i]);
+        if( shm_fd == -1 ) continue;
+
+        if( ftruncate(shm_fd, p_arg->size) == 0 ){
+            // the hugepages are reserved here, not at the first touch
+            *pp_map = mmap(NULL, p_arg->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+            if( *pp_map != MAP_FAILED ){
+                if( !(flags[i] & MFD_HUGETLB) ) madvise(*pp_map, p_arg->size, MADV_HUGEPAGE);
+                p_arg->flags = _VAPI_CORE_SHM_FD;
+                return shm_fd;
+            }
+        }
+        close(shm_fd);
+    }
+#endif
+
+    return -1;
+}
+
+/* maps the argument region on regular pages by a POSIX shared memory */
+static int _vapi_core_shm_regular(_vapi_core_shm_attach_t *p_arg, void **pp_map)
+{
+    static volatile uint32_t serial = 0;
+    int shm_fd, errsv;
+
+    snprintf(p_arg->name, sizeof(p_arg->name), _VAPI_CORE_SHM_PREFIX "%d.%u", (int)getpid(), __sync_add_and_fetch(&serial, 1));
+    p_arg->flags = 0;
+
+    shm_fd = shm_open(p_arg->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if( shm_fd == -1 ) return -1;
+
+    if( ftruncate(shm_fd, p_arg->size) == 0 ){
+        *pp_map = mmap(NULL, p_arg->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if( *pp_map != MAP_FAILED ){
+            // huge if the kernel enables THP for tmpfs
+            madvise(*pp_map, p_arg->size, MADV_HUGEPAGE);
+            return shm_fd;
+        }
+    }
+
+    errsv = errno;
+    close(shm_fd);
+    shm_unlink(p_arg->name);
+    errno = errsv;
+
+    return -1;
+}
+
+/* creates the argument region, and lets the sub map it */
+static int _vapi_core_shm_create(_vapi_core_t *p_fd)
+{
+    int line = 0, errsv = 0;
+    int shm_fd = -1;
+    void *p_map = MAP_FAILED;
+    _vapi_core_shm_attach_t arg;
+
+    // the sub maps it for the connection, unless it refused by the negotiation
+    if( _vapi_core_need_socket(p_fd) != 0 ) return -1;
+    if( !(p_fd->transports & _VAPI_CORE_TRANSPORT_SHM) ){ errno = ENOTSUP; return -1; }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.size = _VAPI_CORE_SHM_SIZE;
+
+    p_fd->p_shm_free = calloc(1, sizeof(_vapi_core_extent_t));
+    if( !p_fd->p_shm_free ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+    p_fd->p_shm_free->len = arg.size;
+
+    // the memfd goes with the argument over the unix socket, so that no name is exposed
+    if( p_fd->transport == VAPI_CORE_TRANSPORT_UNIX ) shm_fd = _vapi_core_shm_memfd(&arg, &p_map);
+    if( shm_fd >= 0 ){
+        p_fd->pass_fd = shm_fd;
+        if( _vapi_core_invoke(p_fd, _VAPI_CORE_API_ID_SHM_ATTACH, &arg, sizeof(arg)) != 0 ){
+            munmap(p_map, arg.size);
+            close(shm_fd);
+            p_map = MAP_FAILED;
+            shm_fd = -1;
+        }
+        p_fd->pass_fd = -1;
+    }
+
+    if( shm_fd == -1 ){
+        shm_fd = _vapi_core_shm_regular(&arg, &p_map);
+        if( shm_fd == -1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+        if( _vapi_core_invoke(p_fd, _VAPI_CORE_API_ID_SHM_ATTACH, &arg, sizeof(arg)) != 0 ){
+            line = __LINE__; errsv = errno; goto _err_end_;
+        }
+    }
+
+    // both sides have mapped it, so that it goes away with them
+    close(shm_fd);
+    if( !(arg.flags & _VAPI_CORE_SHM_FD) ) shm_unlink(arg.name);
+    p_fd->p_shm = (uint8_t*)p_map;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_map != MAP_FAILED ) munmap(p_map, arg.size);
+    if( shm_fd >= 0 ){
+        close(shm_fd);
+        shm_unlink(arg.name);
+    }
+    if( p_fd->p_shm_free ){ free(p_fd->p_shm_free); p_fd->p_shm_free = NULL; }
+    errno = errsv;
+
+    return -1;
+}
+
+static void _vapi_core_shm_destroy(_vapi_core_t *p_fd)
+{
+    _vapi_core_extent_t *p_ext;
+
+    while( (p_ext = p_fd->p_shm_free) ){
+        p_fd->p_shm_free = p_ext->p_next;
+        free(p_ext);
+    }
+    if( p_fd->p_shm ){
+        munmap(p_fd->p_shm, _VAPI_CORE_SHM_SIZE);
+        p_fd->p_shm = NULL;
+    }
+}
+
+/* marks the header to pass the arguments by the offset if they are in the argument region */
+static void _vapi_core_shm_ref(_vapi_core_t *p_fd, _vapi_core_hdr_t *p_hdr, void *p_arg)
+{
+    uintptr_t off;
+
+    if( !p_fd->p_shm  ||  !p_hdr->arg_len  ||  (uint8_t*)p_arg < p_fd->p_shm ) return;
+
+    off = (uint8_t*)p_arg - p_fd->p_shm;
+    if( off >= _VAPI_CORE_SHM_SIZE  ||  p_hdr->arg_len > _VAPI_CORE_SHM_SIZE - off ) return;
+
+    p_hdr->flags |= _VAPI_CORE_HDR_SHM;
+    p_hdr->shm_off = (uint32_t)off;
+}
+
+/* dispatches the body of an event to the handler of its topic */
+static int _vapi_core_event_dispatch(_vapi_core_t *p_fd, uint8_t *p_body, uint32_t body_len)
+{
+    int line = 0, i;
+    uint8_t *p_copy = NULL;
+    const void *p_data;
+    _vapi_core_event_t *p_ev;
+
+    if( body_len < sizeof(_vapi_core_event_t) ){ line = __LINE__; goto _err_end_; }
+
+    p_ev = (_vapi_core_event_t*)p_body;
+    if( p_ev->flags & _VAPI_CORE_EVENT_RING ){
+        p_copy = malloc( p_ev->len ? p_ev->len : 1 );
+        if( !p_copy ){ line = __LINE__; goto _err_end_; }
+        if( !p_fd->p_ring  ||  _vapi_core_ring_read(p_fd->p_ring, p_ev->ring_pos, p_copy, p_ev->len) != 0 ){
+            ERR_MSG("the event of topic=%d was overwritten in the ring.\n", p_ev->topic);
+            goto _end_;
+        }
+        p_data = p_copy;
+    } else {
+        if( p_ev->len != body_len - sizeof(*p_ev) ){ line = __LINE__; goto _err_end_; }
+        p_data = p_ev + 1;
+    }
+
+    for(i=0; i<p_fd->sub_num; ++i){
+        if( p_fd->subs[i].topic == p_ev->topic ){
+            p_fd->subs[i].handler(p_ev->topic, p_data, p_ev->len, p_fd->subs[i].p_cookie);
+            break;
+        }
+    }
+
+  _end_:
+    if( p_copy ) free(p_copy);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    if( p_copy ) free(p_copy);
+
+    return -1;
+}
+
+/* receives the body of an event whose header is already received, and queues it */
+static int _vapi_core_event(_vapi_core_t *p_fd, const _vapi_core_hdr_t *p_hdr)
+{
+    int line = 0, errsv = 0;
+    ssize_t size = -1;
+    _vapi_core_pending_t *p_ev = NULL;
+
+    if( p_hdr->arg_len < sizeof(_vapi_core_event_t) ){ line = __LINE__; goto _err_end_; }
+
+    p_ev = malloc( sizeof(*p_ev) + p_hdr->arg_len );
+    if( !p_ev ){ line = __LINE__; goto _err_end_; }
+    p_ev->p_next = NULL;
+    p_ev->len = p_hdr->arg_len;
+
+    size = _vapi_core_recv( p_fd->sock, p_ev->body, p_hdr->arg_len, 0 );
+    if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    else if( size != p_hdr->arg_len ){ line = __LINE__; goto _err_end_; }
+
+    // a handler which never lets the call complete, dropped like a slow subscriber of the sub
+    if( p_fd->ev_num >= _VAPI_CORE_EVENT_PENDING_MAX ){
+        ERR_MSG("an event of topic=%d was dropped, %u are pending.\n", ((_vapi_core_event_t*)p_ev->body)->topic, p_fd->ev_num);
+        free(p_ev);
+        return 0;
+    }
+
+    if( p_fd->p_ev_tail ) p_fd->p_ev_tail->p_next = p_ev;
+    else p_fd->p_ev_head = p_ev;
+    p_fd->p_ev_tail = p_ev;
+    p_fd->ev_num++;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_ev ) free(p_ev);
+
+    return -1;
+}
+
+/* dispatches the queued events one by one, so that a handler calling the sub
+   again dispatches the rest in order */
+static void _vapi_core_event_flush(_vapi_core_t *p_fd)
+{
+    _vapi_core_pending_t *p_ev;
+
+    while( (p_ev = p_fd->p_ev_head) ){
+        p_fd->p_ev_head = p_ev->p_next;
+        if( !p_fd->p_ev_head ) p_fd->p_ev_tail = NULL;
+        p_fd->ev_num--;
+
+        p_fd->dispatching++;
+        _vapi_core_event_dispatch(p_fd, p_ev->body, p_ev->len);
+        p_fd->dispatching--;
+        free(p_ev);
+    }
+}
+
+/* sends the queued calls as far as the socket accepts without blocking */
+static int _vapi_core_flush(_vapi_core_t *p_fd)
+{
+    _vapi_core_call_t *p_call;
+    struct iovec iov[2];
+    struct msghdr msg;
+    uint32_t total;
+    ssize_t size;
+
+    while( (p_call = p_fd->p_send) ){
+        total = sizeof(p_call->hdr) + _vapi_core_body_len(&p_call->hdr);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if( p_call->sent < sizeof(p_call->hdr) ){
+            iov[0].iov_base = (uint8_t*)&p_call->hdr + p_call->sent;
+            iov[0].iov_len = sizeof(p_call->hdr) - p_call->sent;
+            iov[1].iov_base = p_call->p_arg;
+            iov[1].iov_len = total - sizeof(p_call->hdr);
+            msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+        } else {
+            iov[0].iov_base = (uint8_t*)p_call->p_arg + (p_call->sent - sizeof(p_call->hdr));
+            iov[0].iov_len = total - p_call->sent;
+            msg.msg_iovlen = 1;
+        }
+
+        size = sendmsg(p_fd->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if( size < 0 ){
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN  ||  errno == EWOULDBLOCK ) break;
+            return -1;
+        }
+
+        p_call->sent += size;
+        if( p_call->sent == total ){
+            _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_SENT, p_fd->trace_conn, p_call->seq,
+                             p_call->hdr.api_id, p_call->hdr.arg_len);
+            p_fd->p_send = p_call->p_next;
+        }
+    }
+
+    return 0;
+}
+
+/* takes the call out of the outstanding list by the request ID of its reply */
+static _vapi_core_call_t* _vapi_core_call_take(_vapi_core_t *p_fd, uint32_t req_id)
+{
+    _vapi_core_call_t **pp, *p_prev = NULL, *p_call;
+
+    for(pp = &p_fd->p_call_head; *pp; p_prev = *pp, pp = &(*pp)->p_next){
+        p_call = *pp;
+        if( p_call->hdr.req_id != req_id ) continue;
+
+        // a reply never overtakes its request
+        if( p_call->sent != sizeof(p_call->hdr) + _vapi_core_body_len(&p_call->hdr) ) return NULL;
+
+        *pp = p_call->p_next;
+        if( p_fd->p_call_tail == p_call ) p_fd->p_call_tail = p_prev;
+        return p_call;
+    }
+
+    return NULL;
+}
+
+/* completes all the outstanding calls with "errsv", the descriptor may be gone after this */
+static void _vapi_core_call_cancel(int32_t fd, _vapi_core_t *p_fd, int errsv)
+{
+    _vapi_core_call_t *p_call, *p_list;
+
+    p_list = p_fd->p_call_head;
+    if( p_fd->p_rx_call ){
+        p_fd->p_rx_call->p_next = p_list;
+        p_list = p_fd->p_rx_call;
+    }
+    p_fd->p_call_head = p_fd->p_call_tail = p_fd->p_send = p_fd->p_rx_call = NULL;
+    if( p_fd->p_rx_buf ){ free(p_fd->p_rx_buf); p_fd->p_rx_buf = NULL; }
+    p_fd->rx_len = 0;
+
+    while( (p_call = p_list) ){
+        p_list = p_call->p_next;
+        errno = errsv;
+        if( p_call->callback ) p_call->callback(fd, -1, p_call->p_arg, 0, p_call->p_cookie);
+        free(p_call);
+    }
+}
+
+static void _vapi_core_pipe_close(_vapi_core_t *p_fd)
+{
+    if( p_fd->pipe_fd[0] >= 0 ) close(p_fd->pipe_fd[0]);
+    if( p_fd->pipe_fd[1] >= 0 ) close(p_fd->pipe_fd[1]);
+    p_fd->pipe_fd[0] = p_fd->pipe_fd[1] = -1;
+}
+
+static int _vapi_core_pipe_open(_vapi_core_t *p_fd)
+{
+    if( syscall(SYS_pipe2, p_fd->pipe_fd, O_CLOEXEC) != 0 ){
+        p_fd->pipe_fd[0] = p_fd->pipe_fd[1] = -1;
+        return -1;
+    }
+
+    // fewer system calls per argument, if pipe-max-size allows
+    fcntl(p_fd->pipe_fd[1], F_SETPIPE_SZ, _VAPI_CORE_SPLICE_PIPE_SIZE);
+
+    return 0;
+}
+
+/*
+  sends the arguments of a synchronous call, the large ones by mapping their
+  pages into the pipe and splicing them to the unix socket, which saves the
+  caller copying them into the socket buffer. The socket refers to the pages
+  until the sub reads them, which it does before replying, so that they are
+  the caller's again when the call returns. Over TCP the caller does the
+  receive of the loopback as well, and saves nothing.
+  On failure the pipe is dropped, and the rest goes by send(), from then on
+  if the kernel or the socket does not support it.
+*/
+static ssize_t _vapi_core_send_splice(_vapi_core_t *p_fd, const void *p_buf, size_t len)
+{
+    struct iovec iov;
+    ssize_t size, moved = 0, n = 0;
+    size_t sum = 0;
+    int errsv = 0;        /* of the failed vmsplice(2) or splice(2), 0 if it moved nothing */
+
+    // smaller ones are copied faster than their pages are pinned
+    if( p_fd->splice_off  ||  p_fd->transport != VAPI_CORE_TRANSPORT_UNIX  ||  len < _VAPI_CORE_SPLICE_MIN )
+      return _vapi_core_send(p_fd->sock, p_buf, len, MSG_NOSIGNAL);
+    if( p_fd->pipe_fd[0] == -1  &&  _vapi_core_pipe_open(p_fd) != 0 ){
+        p_fd->splice_off = 1;
+        return _vapi_core_send(p_fd->sock, p_buf, len, MSG_NOSIGNAL);
+    }
+
+    while( sum < len ){
+        iov.iov_base = (uint8_t*)p_buf + sum;
+        iov.iov_len = len - sum;
+        size = syscall(SYS_vmsplice, p_fd->pipe_fd[1], &iov, 1, 0);
+        if( size < 0  &&  errno == EINTR ) continue;
+        if( size <= 0 ){ errsv = size < 0 ? errno : 0; break; }
+
+        for(moved = 0; moved < size; moved += n){
+            n = syscall(SYS_splice, p_fd->pipe_fd[0], NULL, p_fd->sock, NULL, size - moved,
+                        SPLICE_F_MOVE | (sum + size < len ? SPLICE_F_MORE : 0));
+            if( n < 0  &&  errno == EINTR ){ n = 0; continue; }
+            if( n <= 0 ){ errsv = n < 0 ? errno : 0; break; }
+        }
+        sum += moved;
+        if( moved < size ) break;
+    }
+    if( sum == len ) return sum;
+
+    // what is left in the pipe is sent again from the arguments
+    if( errsv == EINVAL  ||  errsv == ENOSYS  ||  errsv == EPERM  ||  errsv == EOPNOTSUPP ){
+        DBG_MSG("no splice. errsv=%d\n", errsv);
+        p_fd->splice_off = 1;
+    }
+    _vapi_core_pipe_close(p_fd);
+    size = _vapi_core_send(p_fd->sock, (uint8_t*)p_buf + sum, len - sum, MSG_NOSIGNAL);
+
+    return size < 0 ? size : (ssize_t)(sum + size);
+}
+
+/*
+  moves the descriptor from TCP to the unix socket offered by "p_hello", once
+  the sub confirms that it accepted the connection by the nonce given over TCP,
+  which another process bound to the name does not know. It stays on TCP
+  otherwise.
+*/
+static int _vapi_core_move_unix(_vapi_core_t *p_fd, _vapi_core_hello_t *p_hello)
+{
+    int line = 0, errsv = 0;
+    struct sockaddr_un un;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int tcp_sock = p_fd->sock;
+    uint64_t nonce = p_hello->nonce;
+
+    // the TCP port names the connection in the traces of both sides
+    if( getsockname(tcp_sock, (struct sockaddr*)&addr, &len) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    p_fd->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( p_fd->sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    p_hello->unix_name[ sizeof(p_hello->unix_name) - 1 ] = '\0';
+    strncpy(un.sun_path + 1, p_hello->unix_name, sizeof(un.sun_path) - 2);
+    len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(un.sun_path + 1);
+    if( connect(p_fd->sock, (struct sockaddr*)&un, len) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    // refused by "max_conn" of the sub, if it closes the connection instead
+    memset(p_hello, 0, sizeof(*p_hello));
+    p_hello->version = _VAPI_CORE_VERSION;
+    p_hello->transports = _VAPI_CORE_TRANSPORT_UNIX | _VAPI_CORE_TRANSPORT_SHM;
+    p_hello->conn = ntohs(addr.sin_port);
+    if( _vapi_core_invoke(p_fd, _VAPI_CORE_API_ID_HELLO, p_hello, sizeof(*p_hello)) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    if( !nonce  ||  p_hello->nonce != nonce ){ line = __LINE__; errsv = EACCES; goto _err_end_; }
+
+    close(tcp_sock);
+    p_fd->transport = VAPI_CORE_TRANSPORT_UNIX;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_fd->sock >= 0 ) close(p_fd->sock);
+    p_fd->sock = tcp_sock;
+
+    return -1;
+}
+
+/* asks the sub what it supports over the new TCP connection, and moves to the fastest transport of both sides */
+static int _vapi_core_negotiate(_vapi_core_t *p_fd)
+{
+    _vapi_core_hello_t hello;
+
+    p_fd->transport = VAPI_CORE_TRANSPORT_TCP;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.version = _VAPI_CORE_VERSION;
+    hello.transports = _VAPI_CORE_TRANSPORT_UNIX | _VAPI_CORE_TRANSPORT_SHM;
+    if( _vapi_core_invoke(p_fd, _VAPI_CORE_API_ID_HELLO, &hello, sizeof(hello)) != 0 ) return -1;
+
+    p_fd->version = hello.version;
+    p_fd->transports = hello.transports;
+    p_fd->max_arg_len = hello.max_arg_len;
+
+    if( hello.transports & _VAPI_CORE_TRANSPORT_UNIX ) _vapi_core_move_unix(p_fd, &hello);
+
+    return 0;
+}
+
+/*
+  connects to the sub listening on "port" over TCP, retrying every second
+  until it listens if "retry", then moves to the transport negotiated with it
+*/
+static int _vapi_core_connect(_vapi_core_t *p_fd, int retry)
 {
     int err_code = 0, line = 0, errsv = 0;
-    _vapi_core_t *p_fd = NULL;
     struct sockaddr_in addr;
     int opt;
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port   = htons(dstport);
+    addr.sin_port   = htons(p_fd->port);
     addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 
-    p_fd = calloc( 1, sizeof(_vapi_core_t) );
-    if( !p_fd ){ line = __LINE__; goto _err_end_; }
-
     p_fd->sock = socket(AF_INET, SOCK_STREAM, 0);
     if( p_fd->sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
 
@@ -97,96 +732,765 @@ int32_t vapi_core_open(uint16_t dstport)
     if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
 
     while( (err_code = connect(p_fd->sock, (struct sockaddr*)&addr, sizeof(addr)) ) == -1 ){
+        if( !retry ){ line = __LINE__; errsv = errno; goto _err_end_; }
         LOG_MSG("connecting ...\n");
         sleep(1);
     }
 
-    return (int32_t)p_fd;
+#ifdef VAPI_CORE_TRACE
+    {
+        socklen_t socklen = sizeof(addr);
+        if( getsockname(p_fd->sock, (struct sockaddr*)&addr, &socklen) == 0 )
+          p_fd->trace_conn = ntohs(addr.sin_port);
+    }
+#endif
+
+    err_code = _vapi_core_negotiate(p_fd);
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    return 0;
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( errsv ) ERR_MSG("errsv=%d\n", errsv);
     if( err_code ) ERR_MSG("err_code=%d\n", err_code);
 
-    if( p_fd && (p_fd->sock > 0) ) close(p_fd->sock);
-    if( p_fd ) free( p_fd );
-    
+    if( p_fd->sock >= 0 ){ close(p_fd->sock); p_fd->sock = -1; }
+    errno = errsv;
+
     return -1;
 }
 
-int32_t vapi_core_close(int32_t fd)
+/* moves a descriptor calling a sub of this process directly onto the socket, for what needs it */
+static int _vapi_core_need_socket(_vapi_core_t *p_fd)
 {
-    int err_code = 0, line = 0, errsv = 0;
-    _vapi_core_t *p_fd = NULL;
-
-    if( fd == 0  ||  fd == -1 ){ line = __LINE__; goto _err_end_; }
-    p_fd = (_vapi_core_t*)fd;
+    void *p_local = p_fd->p_local;
 
-    err_code = close( p_fd->sock );
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    if( !p_local ) return 0;
 
-    free( p_fd );
+    // the direct calls have returned already, as they are synchronous,
+    // and the negotiation goes through the socket
+    p_fd->p_local = NULL;
+    if( _vapi_core_connect(p_fd, 1) != 0 ){
+        p_fd->p_local = p_local;
+        return -1;
+    }
+    _vapi_core_sub_local_close(p_local);
 
     return 0;
+}
 
-  _err_end_:
-    if( line ) ERR_MSG("line=%d\n", line);
-    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
-    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+static int _vapi_core_subscribe(_vapi_core_t *p_fd, int32_t api_id, int32_t topic, uint32_t flags)
+{
+    _vapi_core_subscribe_t arg;
 
-    return -1;
+    // the events come over the socket
+    if( _vapi_core_need_socket(p_fd) != 0 ) return -1;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.topic = topic;
+    arg.flags = flags;
+    if( _vapi_core_invoke( p_fd, api_id, &arg, sizeof(arg) ) != 0 ) return -1;
+
+    if( (arg.flags & _VAPI_CORE_SUBSCRIBE_RING)  &&  !p_fd->p_ring ){
+        arg.ring_name[ sizeof(arg.ring_name) - 1 ] = '\0';
+        if( _vapi_core_ring_map(p_fd, arg.ring_name, arg.ring_size) != 0 ){
+            // fall back to receiving the payloads over the socket
+            return _vapi_core_subscribe(p_fd, api_id, topic, 0);
+        }
+    }
+
+    return 0;
 }
 
-int32_t vapi_core_invoke(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len)
+
+static int32_t _vapi_core_call(_vapi_core_t *p_fd, int32_t api_id, void* p_arg, uint32_t arg_len)
 {
     int err_code = 0, line = 0, errsv = 0;
-    _vapi_core_t *p_fd = NULL;
     ssize_t size = -1;
     _vapi_core_hdr_t hdr;
+    uint32_t flags;
+    int in_step = 1;      /* 0 from the header sent until the reply is received */
+#ifdef VAPI_CORE_TRACE
+    uint32_t seq = p_fd->trace_seq++;
+#endif
+
+    if( p_fd->p_local ){
+        if( _vapi_core_sub_local_invoke(p_fd->p_local, api_id, p_arg, arg_len, 0) == 0 ) return 0;
+        // the sub has been closed
+        if( errno == ECONNRESET ) p_fd->broken = 1;
+        return -1;
+    }
     
+    // the replies of the non-blocking calls would be mixed up
+    if( p_fd->p_call_head  ||  p_fd->rx_len ){ line = __LINE__; errsv = EBUSY; goto _err_end_; }
 
-    if( fd == 0  ||  fd == -1 ){ line = __LINE__; goto _err_end_; }
-    p_fd = (_vapi_core_t*)fd;
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_SEND, p_fd->trace_conn, seq, api_id, arg_len);
 
     // send header
     memset(&hdr, 0, sizeof(hdr));
     hdr.api_id = api_id;
     hdr.arg_len = arg_len;
+    hdr.req_id = ++p_fd->req_id;
+    hdr.version = _VAPI_CORE_VERSION;
+    _vapi_core_shm_ref(p_fd, &hdr, p_arg);
+    flags = hdr.flags;
+
+    // the sub would only discard them, except the control requests which it never counts
+    if( api_id >= 0  &&  p_fd->max_arg_len  &&  _vapi_core_body_len(&hdr) > p_fd->max_arg_len ){ line = __LINE__; errsv = ENOBUFS; goto _err_end_; }
+    in_step = 0;
     size = _vapi_core_send( p_fd->sock, &hdr, sizeof(hdr), MSG_NOSIGNAL );
     if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
     else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
 
-    // send data
-    if( hdr.arg_len ){
-        size = _vapi_core_send( p_fd->sock, p_arg, hdr.arg_len, MSG_NOSIGNAL );
+    // send data, unless the sub reads it from the argument region
+    if( _vapi_core_body_len(&hdr) ){
+        if( p_fd->pass_fd >= 0 ) size = _vapi_core_send_fd( p_fd->sock, p_arg, hdr.arg_len, p_fd->pass_fd );
+        else size = _vapi_core_send_splice( p_fd, p_arg, hdr.arg_len );
         if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
         else if( size != hdr.arg_len ){ line = __LINE__; goto _err_end_; }
     }
 
-    // recv header
-    size = _vapi_core_recv( p_fd->sock, &hdr, sizeof(hdr), 0 );
-    if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
-    else if( size == 0 ){ line = __LINE__; goto _err_end_; }
-    else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_SENT, p_fd->trace_conn, seq, api_id, arg_len);
 
-    // recv data
-    if( hdr.arg_len ){
-        size = _vapi_core_recv( p_fd->sock, p_arg, hdr.arg_len, 0 );
+    // recv header, queueing the events arrived before the acknowledgement
+    while( 1 ){
+        size = _vapi_core_recv( p_fd->sock, &hdr, sizeof(hdr), 0 );
         if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
         else if( size == 0 ){ line = __LINE__; goto _err_end_; }
-        else if( size != hdr.arg_len ){ line = __LINE__; goto _err_end_; }
+        else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
+
+        if( hdr.api_id != _VAPI_CORE_API_ID_EVENT ) break;
+        if( _vapi_core_event(p_fd, &hdr) != 0 ){ line = __LINE__; goto _err_end_; }
     }
 
-    if( hdr.err_code != 0 ){ line = __LINE__; errsv = hdr.errsv; goto _err_end_; }
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_REPLY, p_fd->trace_conn, seq, api_id, hdr.arg_len);
 
-    return 0;
+    if( hdr.flags != flags ){ line = __LINE__; errsv = EPROTO; goto _err_end_; }
+
+    // recv data, unless the sub updated it in the argument region
+    if( _vapi_core_body_len(&hdr) ){
+        size = _vapi_core_recv( p_fd->sock, p_arg, hdr.arg_len, 0 );
+        if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+        else if( size == 0 ){ line = __LINE__; goto _err_end_; }
+        else if( size != hdr.arg_len ){ line = __LINE__; goto _err_end_; }
+    }
+
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_DONE, p_fd->trace_conn, seq, api_id, hdr.arg_len);
+    in_step = 1;
+
+    if( hdr.err_code != 0 ){ line = __LINE__; errsv = hdr.errsv; goto _err_end_; }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( !in_step ) p_fd->broken = 1;
+    if( errsv ) errno = errsv;
+    return -1;
+}
+
+
+/* calls the sub, and then the handlers of the events which arrived meanwhile */
+static int32_t _vapi_core_invoke(_vapi_core_t *p_fd, int32_t api_id, void* p_arg, uint32_t arg_len)
+{
+    int32_t ret;
+    int errsv;
+
+    ret = _vapi_core_call(p_fd, api_id, p_arg, arg_len);
+    errsv = errno;
+
+    _vapi_core_event_flush(p_fd);
+
+    errno = errsv;
+    return ret;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int32_t _vapi_core_open(uint16_t dstport, int retry)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    int32_t fd;
+
+    p_fd = calloc( 1, sizeof(_vapi_core_t) );
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
+    p_fd->sock = -1;
+    p_fd->port = dstport;
+    p_fd->pipe_fd[0] = p_fd->pipe_fd[1] = -1;
+    p_fd->pass_fd = -1;
+
+    // a sub of this process is called directly until the socket is needed
+    p_fd->p_local = _vapi_core_sub_local_connect(dstport);
+    p_fd->transport = VAPI_CORE_TRANSPORT_LOCAL;
+    if( !p_fd->p_local ){
+        err_code = _vapi_core_connect(p_fd, retry);
+        if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    }
+
+    fd = _vapi_core_handle_alloc(_VAPI_CORE_HANDLE_HOST, p_fd);
+    if( fd == -1 ){ line = __LINE__; goto _err_end_; }
+
+    return fd;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_fd && (p_fd->sock > 0) ) close(p_fd->sock);
+    if( p_fd && p_fd->p_local ) _vapi_core_sub_local_close(p_fd->p_local);
+    if( p_fd ) free( p_fd );
+
+    if( errsv ) errno = errsv;
+    return -1;
+}
+
+int32_t vapi_core_open(uint16_t dstport)
+{
+    return _vapi_core_open(dstport, 1);
+}
+
+int32_t vapi_core_close(int32_t fd)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    _vapi_core_pending_t *p_ev;
+
+    // the call which dispatches the event still uses the descriptor
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( p_fd  &&  p_fd->dispatching ){ line = __LINE__; errsv = EBUSY; goto _err_end_; }
+
+    p_fd = _vapi_core_handle_free(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
+
+    _vapi_core_call_cancel(fd, p_fd, ECANCELED);
+
+    while( (p_ev = p_fd->p_ev_head) ){
+        p_fd->p_ev_head = p_ev->p_next;
+        free(p_ev);
+    }
+
+    if( p_fd->p_local ){
+        _vapi_core_sub_local_close(p_fd->p_local);
+    } else {
+        err_code = close( p_fd->sock );
+        if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    }
+
+    if( p_fd->p_ring ) munmap( p_fd->p_ring, p_fd->ring_len );
+    _vapi_core_shm_destroy(p_fd);
+    _vapi_core_pipe_close(p_fd);
+    free( p_fd );
+
+    return 0;
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( errsv ) ERR_MSG("errsv=%d\n", errsv);
     if( err_code ) ERR_MSG("err_code=%d\n", err_code);
 
+    if( errsv ) errno = errsv;
+    return -1;
+}
+
+int32_t vapi_core_invoke(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len)
+{
+    _vapi_core_t *p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+
+    if( !p_fd ){
+        ERR_MSG("invalid descriptor(%d).\n", fd);
+        return -1;
+    }
+
+    return _vapi_core_invoke(p_fd, api_id, p_arg, arg_len);
+}
+
+int32_t vapi_core_invoke_oneway(int32_t fd, int32_t api_id, const void* p_arg, uint32_t arg_len)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    _vapi_core_hdr_t hdr;
+    ssize_t size;
+#ifdef VAPI_CORE_TRACE
+    uint32_t seq;
+#endif
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+    if( arg_len  &&  !p_arg ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+
+    if( p_fd->p_local ) return _vapi_core_sub_local_invoke(p_fd->p_local, api_id, (void*)p_arg, arg_len, _VAPI_CORE_HDR_ONEWAY);
+
+    // it would be sent in the middle of a queued call
+    if( p_fd->p_send ){ line = __LINE__; errsv = EBUSY; goto _err_end_; }
+
+#ifdef VAPI_CORE_TRACE
+    seq = p_fd->trace_seq++;
+#endif
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_SEND, p_fd->trace_conn, seq, api_id, arg_len);
+
+    // the header and the arguments go out in one segment
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.api_id = api_id;
+    hdr.arg_len = arg_len;
+    hdr.req_id = ++p_fd->req_id;
+    hdr.flags = _VAPI_CORE_HDR_ONEWAY;
+    hdr.version = _VAPI_CORE_VERSION;
+    if( p_fd->max_arg_len  &&  arg_len > p_fd->max_arg_len ){ line = __LINE__; errsv = ENOBUFS; goto _err_end_; }
+    size = _vapi_core_send( p_fd->sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | (arg_len ? MSG_MORE : 0) );
+    if( size < 0 ){ line = __LINE__; errsv = errno; p_fd->broken = 1; goto _err_end_; }
+    else if( size != sizeof(hdr) ){ line = __LINE__; p_fd->broken = 1; goto _err_end_; }
+
+    if( arg_len ){
+        size = _vapi_core_send( p_fd->sock, p_arg, arg_len, MSG_NOSIGNAL );
+        if( size < 0 ){ line = __LINE__; errsv = errno; p_fd->broken = 1; goto _err_end_; }
+        else if( size != arg_len ){ line = __LINE__; p_fd->broken = 1; goto _err_end_; }
+    }
+
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_SENT, p_fd->trace_conn, seq, api_id, arg_len);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( errsv ) errno = errsv;
+    return -1;
+}
+
+int32_t vapi_core_barrier(int32_t fd)
+{
+    _vapi_core_t *p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    uint32_t failed = 0;
+
+    if( !p_fd ){
+        ERR_MSG("invalid descriptor(%d).\n", fd);
+        errno = EBADF;
+        return -1;
+    }
+
+    if( _vapi_core_invoke(p_fd, _VAPI_CORE_API_ID_BARRIER, &failed, sizeof(failed)) != 0 ) return -1;
+
+    return (int32_t)failed;
+}
+
+int32_t vapi_core_subscribe(int32_t fd, int32_t topic, vapi_core_event_handler_t handler, const void *p_cookie)
+{
+    int line = 0, i;
+    _vapi_core_t *p_fd = NULL;
+
+    if( !handler ){ line = __LINE__; goto _err_end_; }
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
+
+    for(i=0; i<p_fd->sub_num; ++i)
+      if( p_fd->subs[i].topic == topic ) break;
+    if( i == _VAPI_CORE_TOPIC_MAX ){ line = __LINE__; goto _err_end_; }
+
+    // register before asking, as events may arrive before the acknowledgement
+    p_fd->subs[i].topic = topic;
+    p_fd->subs[i].handler = handler;
+    p_fd->subs[i].p_cookie = (void*)p_cookie;
+    if( i == p_fd->sub_num ) p_fd->sub_num++;
+
+    if( _vapi_core_subscribe(p_fd, _VAPI_CORE_API_ID_SUBSCRIBE, topic, _VAPI_CORE_SUBSCRIBE_RING) != 0 ){
+        p_fd->subs[i] = p_fd->subs[ --p_fd->sub_num ];
+        line = __LINE__; goto _err_end_;
+    }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
     return -1;
 }
 
+int32_t vapi_core_unsubscribe(int32_t fd, int32_t topic)
+{
+    int line = 0, i;
+    _vapi_core_t *p_fd = NULL;
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
 
+    if( _vapi_core_subscribe(p_fd, _VAPI_CORE_API_ID_UNSUBSCRIBE, topic, 0) != 0 ){ line = __LINE__; goto _err_end_; }
+
+    for(i=0; i<p_fd->sub_num; ++i){
+        if( p_fd->subs[i].topic == topic ){
+            p_fd->subs[i] = p_fd->subs[ --p_fd->sub_num ];
+            break;
+        }
+    }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    return -1;
+}
+
+int32_t vapi_core_dispatch_event(int32_t fd, int32_t timeout_ms)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    ssize_t size = -1;
+    _vapi_core_hdr_t hdr;
+    struct pollfd pfd;
+    int num = 0;
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
+
+    // vapi_core_process() dispatches the events of the non-blocking calls
+    if( p_fd->p_call_head  ||  p_fd->rx_len ){ line = __LINE__; errsv = EBUSY; goto _err_end_; }
+    if( _vapi_core_need_socket(p_fd) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    pfd.fd = p_fd->sock;
+    pfd.events = POLLIN;
+
+    while( 1 ){
+        pfd.revents = 0;
+        err_code = poll( &pfd, 1, num ? 0 : timeout_ms );
+        if( err_code < 0 ){
+            if( errno == EINTR ) continue;
+            line = __LINE__; errsv = errno; goto _err_end_;
+        }
+        if( err_code == 0 ) break;
+        err_code = 0;
+
+        size = _vapi_core_recv( p_fd->sock, &hdr, sizeof(hdr), 0 );
+        if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+        else if( size == 0 ){ line = __LINE__; goto _err_end_; }
+        else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
+
+        // nothing but events can arrive while no request is outstanding
+        if( hdr.api_id != _VAPI_CORE_API_ID_EVENT ){ line = __LINE__; goto _err_end_; }
+        if( _vapi_core_event(p_fd, &hdr) != 0 ){ line = __LINE__; goto _err_end_; }
+        num++;
+    }
+
+    _vapi_core_event_flush(p_fd);
+
+    return num;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_fd ) _vapi_core_event_flush(p_fd);
+
+    return -1;
+}
+
+int32_t vapi_core_invoke_async(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len,
+                               vapi_core_completion_t callback, const void *p_cookie)
+{
+    return vapi_core_invoke_async_flags(fd, api_id, p_arg, arg_len, 0, callback, p_cookie);
+}
+
+int32_t vapi_core_invoke_async_flags(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len, uint32_t flags,
+                                     vapi_core_completion_t callback, const void *p_cookie)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    _vapi_core_call_t *p_call = NULL;
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+    if( arg_len  &&  !p_arg ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+    if( flags & ~VAPI_CORE_INVOKE_UNORDERED ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+    if( _vapi_core_need_socket(p_fd) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    p_call = calloc(1, sizeof(_vapi_core_call_t));
+    if( !p_call ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+
+    p_call->hdr.api_id = api_id;
+    p_call->hdr.arg_len = arg_len;
+    p_call->hdr.req_id = ++p_fd->req_id;
+    p_call->hdr.version = _VAPI_CORE_VERSION;
+    if( flags & VAPI_CORE_INVOKE_UNORDERED ) p_call->hdr.flags |= _VAPI_CORE_HDR_UNORDERED;
+    _vapi_core_shm_ref(p_fd, &p_call->hdr, p_arg);
+    if( p_fd->max_arg_len  &&  _vapi_core_body_len(&p_call->hdr) > p_fd->max_arg_len ){
+        free(p_call);
+        line = __LINE__; errsv = ENOBUFS; goto _err_end_;
+    }
+    p_call->p_arg = p_arg;
+    p_call->callback = callback;
+    p_call->p_cookie = (void*)p_cookie;
+#ifdef VAPI_CORE_TRACE
+    p_call->seq = p_fd->trace_seq++;
+#endif
+
+    if( p_fd->p_call_tail ) p_fd->p_call_tail->p_next = p_call;
+    else p_fd->p_call_head = p_call;
+    p_fd->p_call_tail = p_call;
+    if( !p_fd->p_send ) p_fd->p_send = p_call;
+
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_SEND, p_fd->trace_conn, p_call->seq, api_id, arg_len);
+
+    if( _vapi_core_flush(p_fd) != 0 ){
+        // reported to the callbacks by the next vapi_core_process()
+        ERR_MSG("errsv=%d\n", errno);
+        shutdown(p_fd->sock, SHUT_RDWR);
+    }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    errno = errsv;
+    return -1;
+}
+
+int _vapi_core_broken(int32_t fd)
+{
+    _vapi_core_t *p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+
+    return !p_fd  ||  p_fd->broken;
+}
+
+int32_t vapi_core_get_pollfd(int32_t fd, int *p_sock, short *p_events)
+{
+    _vapi_core_t *p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+
+    if( !p_fd  ||  !p_sock  ||  !p_events ){
+        ERR_MSG("invalid descriptor(%d).\n", fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if( _vapi_core_need_socket(p_fd) != 0 ) return -1;
+
+    *p_sock = p_fd->sock;
+    *p_events = POLLIN | (p_fd->p_send ? POLLOUT : 0);
+
+    return 0;
+}
+
+int32_t vapi_core_get_transport(int32_t fd, uint32_t *p_transport)
+{
+    _vapi_core_t *p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+
+    if( !p_fd  ||  !p_transport ){
+        ERR_MSG("invalid descriptor(%d).\n", fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    *p_transport = p_fd->transport | (p_fd->p_shm ? VAPI_CORE_TRANSPORT_SHM : 0);
+
+    return 0;
+}
+
+int32_t vapi_core_process(int32_t fd)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    _vapi_core_call_t *p_call;
+    uint32_t want, total;
+    uint8_t *p_dst;
+    ssize_t size;
+    int num = 0;
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ ERR_MSG("invalid descriptor(%d).\n", fd); errno = EBADF; return -1; }
+
+    // nothing is outstanding on a direct descriptor
+    if( p_fd->p_local ) return 0;
+
+    if( _vapi_core_flush(p_fd) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    while( 1 ){
+        // the header, and then the body into the arguments of the call or the event buffer
+        total = sizeof(p_fd->rx_hdr) + _vapi_core_body_len(&p_fd->rx_hdr);
+        if( p_fd->rx_len < sizeof(p_fd->rx_hdr) ){
+            p_dst = (uint8_t*)&p_fd->rx_hdr + p_fd->rx_len;
+            want = sizeof(p_fd->rx_hdr) - p_fd->rx_len;
+        } else {
+            p_dst = (p_fd->p_rx_call ? (uint8_t*)p_fd->p_rx_call->p_arg : p_fd->p_rx_buf);
+            p_dst += p_fd->rx_len - sizeof(p_fd->rx_hdr);
+            want = total - p_fd->rx_len;
+        }
+
+        if( want ){
+            size = recv(p_fd->sock, p_dst, want, MSG_DONTWAIT);
+            if( size < 0 ){
+                if( errno == EINTR ) continue;
+                if( errno == EAGAIN  ||  errno == EWOULDBLOCK ) break;
+                line = __LINE__; errsv = errno; goto _err_end_;
+            }
+            if( size == 0 ){ line = __LINE__; errsv = ECONNRESET; goto _err_end_; }
+            p_fd->rx_len += size;
+            if( p_fd->rx_len < sizeof(p_fd->rx_hdr) ) continue;
+        }
+
+        if( !p_fd->p_rx_call  &&  !p_fd->p_rx_buf ){
+            // the header has just been received
+            if( p_fd->rx_hdr.api_id == _VAPI_CORE_API_ID_EVENT ){
+                if( p_fd->rx_hdr.arg_len < sizeof(_vapi_core_event_t)  ||  p_fd->rx_hdr.flags ){ line = __LINE__; errsv = EPROTO; goto _err_end_; }
+                p_fd->p_rx_buf = malloc(p_fd->rx_hdr.arg_len);
+                if( !p_fd->p_rx_buf ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+            } else {
+                p_call = _vapi_core_call_take(p_fd, p_fd->rx_hdr.req_id);
+                if( !p_call ){ line = __LINE__; errsv = EPROTO; goto _err_end_; }
+                p_fd->p_rx_call = p_call;
+                if( p_fd->rx_hdr.arg_len > p_call->hdr.arg_len  ||  p_fd->rx_hdr.flags != p_call->hdr.flags ){
+                    line = __LINE__; errsv = EPROTO; goto _err_end_;
+                }
+                _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_REPLY, p_fd->trace_conn, p_call->seq,
+                                 p_call->hdr.api_id, p_fd->rx_hdr.arg_len);
+            }
+            continue;
+        }
+
+        if( p_fd->rx_len < total ) continue;
+
+        // the frame has been received completely
+        p_fd->rx_len = 0;
+        if( p_fd->p_rx_buf ){
+            uint8_t *p_body = p_fd->p_rx_buf;
+            int err_code;
+
+            p_fd->p_rx_buf = NULL;
+            err_code = _vapi_core_event_dispatch(p_fd, p_body, p_fd->rx_hdr.arg_len);
+            free(p_body);
+            if( err_code != 0 ){ line = __LINE__; errsv = EPROTO; goto _err_end_; }
+        } else {
+            p_call = p_fd->p_rx_call;
+            p_fd->p_rx_call = NULL;
+
+            _VAPI_CORE_TRACE(VAPI_CORE_TRACE_HOST_DONE, p_fd->trace_conn, p_call->seq,
+                             p_call->hdr.api_id, p_fd->rx_hdr.arg_len);
+
+            errno = p_fd->rx_hdr.errsv;
+            if( p_call->callback ){
+                p_call->callback(fd, p_fd->rx_hdr.err_code, p_call->p_arg, p_fd->rx_hdr.arg_len, p_call->p_cookie);
+            }
+            free(p_call);
+            num++;
+        }
+
+        // the handlers may have closed the descriptor
+        if( _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST) != p_fd ) return num;
+    }
+
+    return num;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    // the stream can not be resynchronized
+    shutdown(p_fd->sock, SHUT_RDWR);
+    _vapi_core_call_cancel(fd, p_fd, errsv);
+
+    errno = errsv;
+    return -1;
+}
+
+void* vapi_core_alloc(int32_t fd, uint32_t size)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    _vapi_core_extent_t **pp, *p_ext;
+    _vapi_core_block_t *p_blk;
+    uint32_t len;
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+    if( size == 0  ||  size > _VAPI_CORE_SHM_SIZE - sizeof(_vapi_core_block_t) ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+
+    if( !p_fd->p_shm  &&  _vapi_core_shm_create(p_fd) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    // first fit
+    len = sizeof(_vapi_core_block_t) + ((size + _VAPI_CORE_SHM_ALIGN - 1) & ~(_VAPI_CORE_SHM_ALIGN - 1));
+    for(pp = &p_fd->p_shm_free; *pp; pp = &(*pp)->p_next)
+      if( (*pp)->len >= len ) break;
+    if( !*pp ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+
+    p_ext = *pp;
+    p_blk = (_vapi_core_block_t*)(p_fd->p_shm + p_ext->off);
+    p_ext->off += len;
+    p_ext->len -= len;
+    if( p_ext->len == 0 ){
+        *pp = p_ext->p_next;
+        free(p_ext);
+    }
+
+    p_blk->magic = _VAPI_CORE_BLOCK_MAGIC;
+    p_blk->len = len;
+
+    return p_blk + 1;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    errno = errsv;
+    return NULL;
+}
+
+int32_t vapi_core_free(int32_t fd, void *p_buf)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_t *p_fd = NULL;
+    _vapi_core_extent_t **pp, *p_prev = NULL, *p_ext;
+    _vapi_core_block_t *p_blk;
+    uint32_t off, len;
+
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_HOST);
+    if( !p_fd ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+
+    p_blk = (_vapi_core_block_t*)p_buf - 1;
+    if( !p_fd->p_shm  ||  (uint8_t*)p_blk < p_fd->p_shm  ||
+        (uint8_t*)p_blk >= p_fd->p_shm + _VAPI_CORE_SHM_SIZE ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+    if( p_blk->magic != _VAPI_CORE_BLOCK_MAGIC ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+
+    off = (uint8_t*)p_blk - p_fd->p_shm;
+    len = p_blk->len;
+    p_blk->magic = 0;
+
+    // back into the sorted list, merged with the neighbors
+    for(pp = &p_fd->p_shm_free; *pp  &&  (*pp)->off < off; p_prev = *pp, pp = &(*pp)->p_next);
+
+    if( p_prev  &&  p_prev->off + p_prev->len == off ){
+        p_prev->len += len;
+        if( *pp  &&  p_prev->off + p_prev->len == (*pp)->off ){
+            p_ext = *pp;
+            p_prev->len += p_ext->len;
+            p_prev->p_next = p_ext->p_next;
+            free(p_ext);
+        }
+    } else if( *pp  &&  off + len == (*pp)->off ){
+        (*pp)->off = off;
+        (*pp)->len += len;
+    } else {
+        p_ext = malloc(sizeof(_vapi_core_extent_t));
+        if( !p_ext ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; } /* the block is leaked */
+        p_ext->off = off;
+        p_ext->len = len;
+        p_ext->p_next = *pp;
+        *pp = p_ext;
+    }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    errno = errsv;
+    return -1;
+}
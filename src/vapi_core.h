@@ -44,6 +44,57 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //=============================================================================
 // Macro/Type/Enumeration/Structure Definitions
 //=============================================================================
+#define VAPI_CORE_INVOKE_UNORDERED (0x00000001) /* flags of vapi_core_invoke_async_flags() */
+
+/* transports of vapi_core_get_transport() */
+#define VAPI_CORE_TRANSPORT_TCP    (0x00000001) /* the local TCP connection */
+#define VAPI_CORE_TRANSPORT_UNIX   (0x00000002) /* a unix socket negotiated over TCP */
+#define VAPI_CORE_TRANSPORT_LOCAL  (0x00000004) /* the handler called directly in this process */
+#define VAPI_CORE_TRANSPORT_SHM    (0x00000010) /* the region of vapi_core_alloc() in use as well */
+
+/*!
+  \brief
+  "vapi_core_event_handler_t" is the type of handler function to be
+  called when an event published by the sub process is received.
+
+  \param[in] topic
+  The topic of the event.
+
+  \param[in] p_data
+  The pointer to the payload, valid only during the call.
+
+  \param[in] len
+  The length of the payload.
+
+  \param[in,out] p_cookie
+  The pointer to the user data.
+*/
+typedef void (*vapi_core_event_handler_t)(int32_t topic, const void* p_data, uint32_t len, void *p_cookie);
+
+/*!
+  \brief
+  "vapi_core_completion_t" is the type of callback function to be called
+  from vapi_core_process() when a call of vapi_core_invoke_async() completes.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] err_code
+  0 for success, the value returned by the handler of the sub process for
+  handling error, or -1 if the call failed or was cancelled by
+  vapi_core_close(). errno tells the reason.
+
+  \param[in,out] p_arg
+  The pointer to the arguments given to vapi_core_invoke_async(), which hold
+  the acknowledgement now.
+
+  \param[in] arg_len
+  The length of the acknowledged arguments.
+
+  \param[in,out] p_cookie
+  The pointer to the user data.
+*/
+typedef void (*vapi_core_completion_t)(int32_t fd, int32_t err_code, void *p_arg, uint32_t arg_len, void *p_cookie);
 
 //=============================================================================
 // Global Function/Variable Prototypes
@@ -54,6 +105,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
   "vapi_core_open()" establish a local TCP connection with the sub process
   listening on the port number specified by "dstport".
   It can be several times called with the same "dstport".
+  The sub is asked what it supports over the connection, and the descriptor
+  moves to its unix socket if offered. The sub must be built with this
+  version of the library, as the wire format of the earlier ones differs.
   
   \param[in] dstport
   The destination port number listened by the sub process.
@@ -87,7 +141,7 @@ int32_t vapi_core_close(int32_t fd);
   The descriptor.
 
   \param[in] api_id
-  The API function ID to be executed.
+  The API function ID to be executed. Negative values are reserved.
 
   \param[in,out] p_arg
   The pointer to the arguments.
@@ -100,4 +154,292 @@ int32_t vapi_core_close(int32_t fd);
 */
 int32_t vapi_core_invoke(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len);
 
+
+/*!
+  \brief
+  "vapi_core_invoke_oneway()" requests executing a API function specified by
+  the "api_id" to the sub module without waiting for it. It returns as soon
+  as the request is handed to the socket, and the sub module sends nothing
+  back, so that a notification costs no round trip. The arguments are always
+  sent over the socket, even in vapi_core_alloc() memory, and can be reused
+  at once. The requests of a descriptor are still handled in order.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] api_id
+  The API function ID to be executed. Negative values are reserved.
+
+  \param[in] p_arg
+  The pointer to the arguments, which are not updated.
+
+  \param[in] arg_len
+  The length of the arguments.
+
+  \return
+  0 for success, and -1 for error, which does not tell whether the handler
+  succeeded. It fails with EBUSY while a call of vapi_core_invoke_async() is
+  being sent.
+*/
+int32_t vapi_core_invoke_oneway(int32_t fd, int32_t api_id, const void* p_arg, uint32_t arg_len);
+
+
+/*!
+  \brief
+  "vapi_core_barrier()" waits until the sub module has handled all the
+  requests sent by vapi_core_invoke_oneway() before. A handler which deferred
+  its request by vapi_core_sub_defer() counts as handled when it returns.
+
+  \param[in] fd
+  The descriptor.
+
+  \return
+  The number of the one-way requests whose handler failed since the previous
+  barrier of the descriptor, and -1 for error.
+*/
+int32_t vapi_core_barrier(int32_t fd);
+
+
+/*!
+  \brief
+  "vapi_core_subscribe()" subscribes the events of the "topic" published by
+  the sub process over the existing connection.
+  Events are delivered to "handler" from vapi_core_dispatch_event(), or from
+  vapi_core_invoke() once it has received its acknowledgement: the events
+  arriving while it waits are held until then, so that the handler may call
+  the sub over the same descriptor. The handler must not close the
+  descriptor, and vapi_core_close() fails with EBUSY if it tries.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] topic
+  The topic to be subscribed.
+
+  \param[in] handler
+  The handler function to be called when an event is received.
+
+  \param[in] p_cookie
+  The pointer to the user data.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_subscribe(int32_t fd, int32_t topic, vapi_core_event_handler_t handler, const void *p_cookie);
+
+
+/*!
+  \brief
+  "vapi_core_unsubscribe()" stops subscribing the events of the "topic".
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] topic
+  The topic to be unsubscribed.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_unsubscribe(int32_t fd, int32_t topic);
+
+
+/*!
+  \brief
+  "vapi_core_dispatch_event()" waits for events up to "timeout_ms" and calls
+  the subscribed handlers for all the events received.
+  It must not be called concurrently with vapi_core_invoke() on the same
+  descriptor.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] timeout_ms
+  The timeout in milliseconds. 0 for no wait, and -1 for infinity.
+
+  \return
+  The number of dispatched events, and -1 for error.
+*/
+int32_t vapi_core_dispatch_event(int32_t fd, int32_t timeout_ms);
+
+
+/*!
+  \brief
+  "vapi_core_invoke_async()" requests executing a API function specified by
+  the "api_id" to the sub module without blocking. Any number of calls can be
+  outstanding on a descriptor, and "callback" is called from
+  vapi_core_process() when the acknowledgement arrives, in the order the sub
+  module completes them.
+  vapi_core_invoke() and vapi_core_dispatch_event() fail with EBUSY on the
+  descriptor while calls are outstanding.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] api_id
+  The API function ID to be executed. Negative values are reserved.
+
+  \param[in,out] p_arg
+  The pointer to the arguments, which must stay valid until "callback" is
+  called. The acknowledgement is written into it.
+
+  \param[in] arg_len
+  The length of the arguments.
+
+  \param[in] callback
+  The callback function to be called on completion. It can be NULL.
+
+  \param[in] p_cookie
+  The pointer to the user data.
+
+  \return
+  0 for success, and -1 for error. Errors of the connection after the call
+  was queued are reported to "callback".
+*/
+int32_t vapi_core_invoke_async(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len,
+                               vapi_core_completion_t callback, const void *p_cookie);
+
+
+/*!
+  \brief
+  "vapi_core_invoke_async_flags()" is the same as vapi_core_invoke_async()
+  but takes the flags of the call.
+  With VAPI_CORE_INVOKE_UNORDERED, the call is independent of the others on
+  the descriptor: the sub module may run its handler concurrently with the
+  following requests on its workers (see "worker_num" of
+  vapi_core_sub_attr_t), and acknowledges it as soon as it completes.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] api_id
+  The API function ID to be executed. Negative values are reserved.
+
+  \param[in,out] p_arg
+  The pointer to the arguments, which must stay valid until "callback" is
+  called. The acknowledgement is written into it.
+
+  \param[in] arg_len
+  The length of the arguments.
+
+  \param[in] flags
+  0, or VAPI_CORE_INVOKE_UNORDERED.
+
+  \param[in] callback
+  The callback function to be called on completion. It can be NULL.
+
+  \param[in] p_cookie
+  The pointer to the user data.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_invoke_async_flags(int32_t fd, int32_t api_id, void* p_arg, uint32_t arg_len, uint32_t flags,
+                                     vapi_core_completion_t callback, const void *p_cookie);
+
+
+/*!
+  \brief
+  "vapi_core_get_pollfd()" gets the socket of the descriptor and the events
+  to wait for it in poll(2) or epoll(7), so that the descriptor can be driven
+  by an event loop. The events change by vapi_core_invoke_async() and
+  vapi_core_process(), so get them again after calling them.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[out] p_sock
+  The pointer of the socket to be waited for. Never read or write it.
+
+  \param[out] p_events
+  The pointer of the events, POLLIN and POLLOUT if requests are left to
+  be sent.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_get_pollfd(int32_t fd, int *p_sock, short *p_events);
+
+
+/*!
+  \brief
+  "vapi_core_get_transport()" gets the transport negotiated by
+  vapi_core_open(), which may change when the descriptor first needs the
+  socket or the argument region.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[out] p_transport
+  The pointer of VAPI_CORE_TRANSPORT_TCP, VAPI_CORE_TRANSPORT_UNIX or
+  VAPI_CORE_TRANSPORT_LOCAL, with VAPI_CORE_TRANSPORT_SHM if the arguments
+  allocated by vapi_core_alloc() are passed in the shared region.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_get_transport(int32_t fd, uint32_t *p_transport);
+
+
+/*!
+  \brief
+  "vapi_core_process()" advances the non-blocking calls of the descriptor
+  without blocking, when its socket becomes ready. It sends the requests
+  as far as the socket accepts them, receives the acknowledgements and
+  the events which have arrived, and calls the completion callbacks and the
+  event handlers. The callbacks may issue new calls or close the descriptor.
+
+  \param[in] fd
+  The descriptor.
+
+  \return
+  The number of completed calls, and -1 for error. On error, the connection
+  is shut down and all the outstanding calls are completed with error.
+*/
+int32_t vapi_core_process(int32_t fd);
+
+
+/*!
+  \brief
+  "vapi_core_alloc()" allocates a buffer for the arguments in the memory
+  region shared with the sub process of the descriptor. vapi_core_invoke()
+  and vapi_core_invoke_async() pass such arguments by their offset, and the
+  handler of the sub process reads and writes the same pages, so that they
+  are never copied. The region of 64MB is created by the first call, which
+  must not be made while non-blocking calls are outstanding. Like the other
+  calls on the descriptor, it is not thread-safe: the free list of the
+  region is not locked, and a descriptor shared by threads needs a lock of
+  the caller around vapi_core_alloc() and vapi_core_free() as well.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] size
+  The size of the buffer.
+
+  \return
+  The pointer to the buffer, aligned to 64 bytes. If error happened, or the
+  region is exhausted, NULL will return, and the arguments can be allocated
+  by malloc() instead.
+*/
+void* vapi_core_alloc(int32_t fd, uint32_t size);
+
+
+/*!
+  \brief
+  "vapi_core_free()" frees the buffer allocated by vapi_core_alloc(). The
+  buffers are released by vapi_core_close() as well. It is not thread-safe,
+  as vapi_core_alloc().
+
+  \param[in] fd
+  The descriptor given to vapi_core_alloc().
+
+  \param[in] p_buf
+  The pointer to the buffer.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_free(int32_t fd, void *p_buf);
+
 #endif // _VAPI_CORE_H_
@@ -0,0 +1,313 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_local.h"
+#include "vapi_core.h"
+#include "vapi_core_sub.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_BENCH][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_BENCH][ERR][%s] " fmt, __FUNCTION__, ##args)
+
+#define BENCH_MIN_NS     (200*1000*1000ULL) /* measured per benchmark and size */
+#define BENCH_SOCK_BUF   (1024*1024)        /* of the socketpair, to hold the largest frame */
+#define BENCH_API_ID     (1)
+
+/* keeps the compiler from dropping the work on "p" */
+#define BENCH_USE(p)     __asm__ __volatile__("" : : "r"(p) : "memory")
+
+typedef void (*bench_func_t)(uint64_t num, uint32_t size);
+
+typedef struct
+{
+    const char *p_name;
+    bench_func_t func;
+    int sized;            /* run over bench_sizes[], or once */
+} bench_t;
+
+/* the payload sizes, all of which fit in the socket buffers at once */
+static const uint32_t bench_sizes[] = { 0, 64, 1024, 16*1024, 64*1024 };
+
+static volatile uint64_t bench_allocs, bench_alloc_bytes;
+
+static int32_t bench_sub = -1;
+static int32_t bench_local = -1;   /* calls the sub directly, without sockets */
+static int32_t bench_shm = -1;     /* has the argument region of vapi_core_alloc() */
+static int bench_sv[2] = { -1, -1 };
+static uint8_t *p_bench_buf;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+/*
+  counts the allocations of the library and of the bench itself, by
+  interposing the allocator of glibc, as the allocations per call are what
+  a regression of the library often adds.
+*/
+extern void* __libc_malloc(size_t len);
+extern void* __libc_calloc(size_t num, size_t len);
+extern void* __libc_realloc(void *p, size_t len);
+
+void* malloc(size_t len)
+{
+    __sync_add_and_fetch(&bench_allocs, 1);
+    __sync_add_and_fetch(&bench_alloc_bytes, len);
+    return __libc_malloc(len);
+}
+
+void* calloc(size_t num, size_t len)
+{
+    __sync_add_and_fetch(&bench_allocs, 1);
+    __sync_add_and_fetch(&bench_alloc_bytes, num * len);
+    return __libc_calloc(num, len);
+}
+
+void* realloc(void *p, size_t len)
+{
+    __sync_add_and_fetch(&bench_allocs, 1);
+    __sync_add_and_fetch(&bench_alloc_bytes, len);
+    return __libc_realloc(p, len);
+}
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_handler(int32_t api_id, void *p_arg, uint32_t arg_len, void *p_cookie)
+{
+    (void)api_id; (void)p_arg; (void)arg_len; (void)p_cookie;
+
+    return 0;
+}
+
+/* builds a request header as the host does, and checks it as the sub does */
+static void bench_hdr(uint64_t num, uint32_t size)
+{
+    _vapi_core_hdr_t hdr;
+    uint64_t i, sum = 0;
+
+    for(i=0; i<num; ++i){
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.api_id = BENCH_API_ID;
+        hdr.arg_len = size;
+        hdr.req_id = (uint32_t)i;
+        hdr.version = _VAPI_CORE_VERSION;
+        BENCH_USE(&hdr);
+
+        if( hdr.api_id < 0 ) continue;
+        sum += _vapi_core_body_len(&hdr) + (hdr.flags & (_VAPI_CORE_HDR_ONEWAY | _VAPI_CORE_HDR_UNORDERED));
+    }
+    BENCH_USE(sum);
+}
+
+/* looks the descriptor up, as every call does */
+static void bench_handle(uint64_t num, uint32_t size)
+{
+    uint64_t i;
+    void *p_fd;
+
+    (void)size;
+
+    for(i=0; i<num; ++i){
+        p_fd = _vapi_core_handle_get(bench_local, _VAPI_CORE_HANDLE_HOST);
+        BENCH_USE(p_fd);
+    }
+}
+
+/* the whole call to the handler of a sub of this process, with no system call */
+static void bench_invoke(uint64_t num, uint32_t size)
+{
+    uint64_t i;
+
+    for(i=0; i<num; ++i)
+      if( vapi_core_invoke(bench_local, BENCH_API_ID, p_bench_buf, size) != 0 ) ERR_MSG("failed to invoke.\n");
+}
+
+/* as bench_invoke(), with the copy of the arguments a one-way request takes */
+static void bench_oneway(uint64_t num, uint32_t size)
+{
+    uint64_t i;
+
+    for(i=0; i<num; ++i)
+      if( vapi_core_invoke_oneway(bench_local, BENCH_API_ID, p_bench_buf, size) != 0 ) ERR_MSG("failed to invoke.\n");
+    if( vapi_core_barrier(bench_local) != 0 ) ERR_MSG("one-way requests failed.\n");
+}
+
+/* takes and returns a buffer of the argument region */
+static void bench_alloc(uint64_t num, uint32_t size)
+{
+    uint64_t i;
+    void *p_buf;
+
+    for(i=0; i<num; ++i){
+        p_buf = vapi_core_alloc(bench_shm, size ? size : 1);
+        if( !p_buf ){ ERR_MSG("failed to alloc.\n"); return; }
+        vapi_core_free(bench_shm, p_buf);
+    }
+}
+
+/* sends a frame and receives it back by the loops of the library, over a socketpair */
+static void bench_sendrecv(uint64_t num, uint32_t size)
+{
+    _vapi_core_hdr_t hdr;
+    uint64_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.api_id = BENCH_API_ID;
+    hdr.arg_len = size;
+
+    for(i=0; i<num; ++i){
+        if( _vapi_core_send(bench_sv[0], &hdr, sizeof(hdr), MSG_NOSIGNAL | (size ? MSG_MORE : 0)) != sizeof(hdr)  ||
+            (size  &&  _vapi_core_send(bench_sv[0], p_bench_buf, size, MSG_NOSIGNAL) != size) ){
+            ERR_MSG("failed to send.\n");
+            return;
+        }
+        if( _vapi_core_recv(bench_sv[1], &hdr, sizeof(hdr), 0) != sizeof(hdr)  ||
+            (size  &&  _vapi_core_recv(bench_sv[1], p_bench_buf, size, 0) != size) ){
+            ERR_MSG("failed to recv.\n");
+            return;
+        }
+    }
+}
+
+static const bench_t bench_list[] = {
+    { "hdr",      bench_hdr,      0 },
+    { "handle",   bench_handle,   0 },
+    { "invoke",   bench_invoke,   1 },
+    { "oneway",   bench_oneway,   1 },
+    { "alloc",    bench_alloc,    1 },
+    { "sendrecv", bench_sendrecv, 1 },
+};
+
+/* doubles the iterations until they take BENCH_MIN_NS, and reports the last run */
+static void bench_measure(const bench_t *p_bench, uint32_t size)
+{
+    uint64_t num = 16, t0, ns, allocs, bytes;
+
+    while( 1 ){
+        allocs = bench_allocs;
+        bytes = bench_alloc_bytes;
+        t0 = bench_now();
+        p_bench->func(num, size);
+        ns = bench_now() - t0;
+        allocs = bench_allocs - allocs;
+        bytes = bench_alloc_bytes - bytes;
+        if( ns >= BENCH_MIN_NS ) break;
+        num *= 2;
+    }
+
+    if( p_bench->sized ) printf("%-10s %10u", p_bench->p_name, size);
+    else printf("%-10s %10s", p_bench->p_name, "-");
+    printf(" %12.1f %10.1f %10.3f %12llu\n", (double)ns / num, (double)bytes / num, (double)allocs / num,
+           (unsigned long long)num);
+}
+
+static int bench_setup(void)
+{
+    uint16_t port;
+    int opt = BENCH_SOCK_BUF;
+
+    p_bench_buf = malloc(bench_sizes[ sizeof(bench_sizes) / sizeof(bench_sizes[0]) - 1 ]);
+    if( !p_bench_buf ){ ERR_MSG("failed to malloc.\n"); return -1; }
+    memset(p_bench_buf, 1, bench_sizes[ sizeof(bench_sizes) / sizeof(bench_sizes[0]) - 1 ]);
+
+    bench_sub = vapi_core_sub_open(0, bench_handler, NULL);
+    if( bench_sub == -1  ||  vapi_core_sub_get_port(bench_sub, &port) != 0 ){ ERR_MSG("failed to open the sub.\n"); return -1; }
+
+    bench_local = vapi_core_open(port);
+    bench_shm = vapi_core_open(port);
+    if( bench_local == -1  ||  bench_shm == -1 ){ ERR_MSG("failed to open.\n"); return -1; }
+
+    // the region is created by the first vapi_core_alloc(), over the socket
+    bench_alloc(1, 1);
+
+    if( socketpair(AF_UNIX, SOCK_STREAM, 0, bench_sv) != 0 ){ ERR_MSG("failed to create a socketpair.\n"); return -1; }
+    setsockopt(bench_sv[0], SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+    setsockopt(bench_sv[1], SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+
+    return 0;
+}
+
+static void bench_teardown(void)
+{
+    if( bench_sv[0] >= 0 ) close(bench_sv[0]);
+    if( bench_sv[1] >= 0 ) close(bench_sv[1]);
+    if( bench_shm != -1 ) vapi_core_close(bench_shm);
+    if( bench_local != -1 ) vapi_core_close(bench_local);
+    if( bench_sub != -1 ) vapi_core_sub_close(bench_sub);
+    if( p_bench_buf ) free(p_bench_buf);
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int main(int argc, char *argv[])
+{
+    const char *p_filter = argc >= 2 ? argv[1] : NULL;
+    size_t i, j;
+
+    if( bench_setup() != 0 ){
+        bench_teardown();
+        return 1;
+    }
+
+    // "sendrecv" is the only one making system calls
+    printf("%-10s %10s %12s %10s %10s %12s\n", "bench", "size", "ns/op", "B/op", "allocs/op", "iterations");
+    for(i=0; i<sizeof(bench_list)/sizeof(bench_list[0]); ++i){
+        if( p_filter  &&  strcmp(p_filter, bench_list[i].p_name) != 0 ) continue;
+
+        if( !bench_list[i].sized ){
+            bench_measure(&bench_list[i], 0);
+            continue;
+        }
+        for(j=0; j<sizeof(bench_sizes)/sizeof(bench_sizes[0]); ++j) bench_measure(&bench_list[i], bench_sizes[j]);
+    }
+
+    bench_teardown();
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+#ifndef _VAPI_CORE_CAPTURE_H_
+#define _VAPI_CORE_CAPTURE_H_
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include <stdint.h>
+
+//=============================================================================
+// Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define VAPI_CORE_CAPTURE_MAGIC   (0x56415043) /* "VAPC" */
+#define VAPI_CORE_CAPTURE_VERSION (1)
+
+/* vapi_core_capture_rec_t.flags */
+#define VAPI_CORE_CAPTURE_REC_PAYLOAD   (0x00000001) /* "arg_len" bytes of the arguments follow */
+#define VAPI_CORE_CAPTURE_REC_UNORDERED (0x00000002) /* invoked with VAPI_CORE_INVOKE_UNORDERED */
+#define VAPI_CORE_CAPTURE_REC_ONEWAY    (0x00000004) /* invoked by vapi_core_invoke_oneway() */
+
+/*!
+  \brief
+  The header of a capture file written by vapi_core_sub_capture_start(),
+  followed by the records in the order the requests were handled.
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t flags;      /* VAPI_CORE_SUB_CAPTURE_* given to vapi_core_sub_capture_start() */
+    uint32_t reserved;
+    uint64_t start_sec;  /* the wall clock time the capture started, for information */
+} vapi_core_capture_hdr_t;
+
+/*!
+  \brief
+  A record of a request, written when its handler completed. The requests
+  of a connection share "conn", so that a replay reproduces the concurrency
+  of the connections.
+*/
+typedef struct
+{
+    uint64_t ts_ns;      /* the request arrived, since the start of the capture */
+    uint64_t lat_ns;     /* from the arrival to the completion of the handler */
+    int32_t api_id;
+    uint32_t arg_len;
+    uint32_t conn;       /* the number of the connection in the capture */
+    uint32_t flags;      /* VAPI_CORE_CAPTURE_REC_* */
+    int32_t err_code;    /* returned by the handler */
+    uint32_t reserved;
+} vapi_core_capture_rec_t;
+
+#endif // _VAPI_CORE_CAPTURE_H_
@@ -0,0 +1,192 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_local.h"
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define _VAPI_CORE_COPY_X86
+#endif
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stdout, "[VAPI_CORE_COPY][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_COPY][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+typedef void (*_vapi_core_copy_func_t)(void *p_dst, const void *p_src, size_t len);
+
+typedef struct
+{
+    const char *name;
+    _vapi_core_copy_func_t func;
+} _vapi_core_copy_kernel_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+#ifdef _VAPI_CORE_COPY_X86
+/*
+  The kernels align the destination to the vector, stream 4 vectors per
+  iteration around the cache, and copy the head and the tail by memcpy().
+  sfence orders the streaming stores before the following stores, such as
+  the reply header or the ring head published to the other process.
+*/
+__attribute__((target("sse2")))
+static void _vapi_core_copy_sse2(void *p_dst, const void *p_src, size_t len)
+{
+    uint8_t *d = p_dst;
+    const uint8_t *s = p_src;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+    if( head > len ) head = len;
+    memcpy(d, s, head);
+    d += head; s += head; len -= head;
+
+    for(; len >= 64; d += 64, s += 64, len -= 64){
+        __m128i v0 = _mm_loadu_si128((const __m128i*)s + 0);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)s + 1);
+        __m128i v2 = _mm_loadu_si128((const __m128i*)s + 2);
+        __m128i v3 = _mm_loadu_si128((const __m128i*)s + 3);
+        _mm_stream_si128((__m128i*)d + 0, v0);
+        _mm_stream_si128((__m128i*)d + 1, v1);
+        _mm_stream_si128((__m128i*)d + 2, v2);
+        _mm_stream_si128((__m128i*)d + 3, v3);
+    }
+    _mm_sfence();
+
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx2")))
+static void _vapi_core_copy_avx2(void *p_dst, const void *p_src, size_t len)
+{
+    uint8_t *d = p_dst;
+    const uint8_t *s = p_src;
+    size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+
+    if( head > len ) head = len;
+    memcpy(d, s, head);
+    d += head; s += head; len -= head;
+
+    for(; len >= 128; d += 128, s += 128, len -= 128){
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)s + 0);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)s + 1);
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)s + 2);
+        __m256i v3 = _mm256_loadu_si256((const __m256i*)s + 3);
+        _mm256_stream_si256((__m256i*)d + 0, v0);
+        _mm256_stream_si256((__m256i*)d + 1, v1);
+        _mm256_stream_si256((__m256i*)d + 2, v2);
+        _mm256_stream_si256((__m256i*)d + 3, v3);
+    }
+    _mm_sfence();
+    _mm256_zeroupper();
+
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f")))
+static void _vapi_core_copy_avx512(void *p_dst, const void *p_src, size_t len)
+{
+    uint8_t *d = p_dst;
+    const uint8_t *s = p_src;
+    size_t head = (64 - ((uintptr_t)d & 63)) & 63;
+
+    if( head > len ) head = len;
+    memcpy(d, s, head);
+    d += head; s += head; len -= head;
+
+    for(; len >= 256; d += 256, s += 256, len -= 256){
+        __m512i v0 = _mm512_loadu_si512((const void*)(s +   0));
+        __m512i v1 = _mm512_loadu_si512((const void*)(s +  64));
+        __m512i v2 = _mm512_loadu_si512((const void*)(s + 128));
+        __m512i v3 = _mm512_loadu_si512((const void*)(s + 192));
+        _mm512_stream_si512((void*)(d +   0), v0);
+        _mm512_stream_si512((void*)(d +  64), v1);
+        _mm512_stream_si512((void*)(d + 128), v2);
+        _mm512_stream_si512((void*)(d + 192), v3);
+    }
+    _mm_sfence();
+    _mm256_zeroupper();
+
+    memcpy(d, s, len);
+}
+
+static const _vapi_core_copy_kernel_t _vapi_core_copy_avx512_kernel = { "avx512", _vapi_core_copy_avx512 };
+static const _vapi_core_copy_kernel_t _vapi_core_copy_avx2_kernel   = { "avx2",   _vapi_core_copy_avx2 };
+static const _vapi_core_copy_kernel_t _vapi_core_copy_sse2_kernel   = { "sse2",   _vapi_core_copy_sse2 };
+#endif
+
+/* no streaming stores on the other architectures */
+static void _vapi_core_copy_memcpy(void *p_dst, const void *p_src, size_t len)
+{
+    memcpy(p_dst, p_src, len);
+}
+
+static const _vapi_core_copy_kernel_t _vapi_core_copy_memcpy_kernel = { "memcpy", _vapi_core_copy_memcpy };
+
+static const _vapi_core_copy_kernel_t *_vapi_core_copy_kernel = NULL;
+
+/* the widest kernel the CPU supports */
+static const _vapi_core_copy_kernel_t* _vapi_core_copy_select(void)
+{
+#ifdef _VAPI_CORE_COPY_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx512f") ) return &_vapi_core_copy_avx512_kernel;
+    if( __builtin_cpu_supports("avx2") ) return &_vapi_core_copy_avx2_kernel;
+    if( __builtin_cpu_supports("sse2") ) return &_vapi_core_copy_sse2_kernel;
+#endif
+
+    return &_vapi_core_copy_memcpy_kernel;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+void _vapi_core_copy_nt(void *p_dst, const void *p_src, size_t len)
+{
+    // selected once, and the same kernel by any racing thread
+    if( !_vapi_core_copy_kernel ) _vapi_core_copy_kernel = _vapi_core_copy_select();
+    _vapi_core_copy_kernel->func(p_dst, p_src, len);
+}
+
+const char* _vapi_core_copy_nt_name(void)
+{
+    if( !_vapi_core_copy_kernel ) _vapi_core_copy_kernel = _vapi_core_copy_select();
+    return _vapi_core_copy_kernel->name;
+}
@@ -0,0 +1,158 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_local.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_COPY_BENCH][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_COPY_BENCH][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#define BENCH_SIZE_MIN   (16*1024)
+#define BENCH_SIZE_MAX   (64*1024*1024)
+#define BENCH_BYTES      (1024ULL*1024*1024)  /* copied per size and kernel */
+#define BENCH_LINE       (64)
+
+typedef void (*bench_copy_t)(void *p_dst, const void *p_src, size_t len);
+
+typedef struct
+{
+    double copy_ns, scan_ns;  /* per copy */
+} bench_result_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static void bench_memcpy(void *p_dst, const void *p_src, size_t len)
+{
+    memcpy(p_dst, p_src, len);
+}
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* reads a line of each cache line, as a handler revisiting its working set */
+static uint64_t bench_scan(const uint8_t *p_ws, size_t ws_len)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for(i=0; i<ws_len; i+=BENCH_LINE) sum += *(const volatile uint64_t*)(p_ws + i);
+    return sum;
+}
+
+static void bench_run(bench_copy_t copy, uint8_t *p_dst, const uint8_t *p_src, size_t len,
+                      const uint8_t *p_ws, size_t ws_len, bench_result_t *p_result)
+{
+    uint64_t i, num, t0, t1, t2, copy_ns = 0, scan_ns = 0;
+
+    num = BENCH_BYTES / len;
+    if( num < 8 ) num = 8;
+
+    bench_scan(p_ws, ws_len);
+    for(i=0; i<num; ++i){
+        t0 = bench_now();
+        copy(p_dst, p_src, len);
+        t1 = bench_now();
+        bench_scan(p_ws, ws_len);
+        t2 = bench_now();
+        copy_ns += t1 - t0;
+        scan_ns += t2 - t1;
+    }
+
+    p_result->copy_ns = (double)copy_ns / num;
+    p_result->scan_ns = (double)scan_ns / num;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int main(int argc, char *argv[])
+{
+    size_t ws_len, len, crossover = 0;
+    uint8_t *p_src, *p_dst, *p_ws;
+    bench_result_t r_mem, r_nt;
+
+    ws_len = (size_t)(argc >= 2 ? atoi(argv[1]) : 1024) * 1024;
+
+    p_src = malloc(BENCH_SIZE_MAX);
+    p_dst = malloc(BENCH_SIZE_MAX);
+    p_ws = malloc(ws_len);
+    if( !p_src  ||  !p_dst  ||  !p_ws ){ ERR_MSG("failed to malloc.\n"); return 1; }
+    memset(p_src, 1, BENCH_SIZE_MAX);
+    memset(p_dst, 2, BENCH_SIZE_MAX);
+    memset(p_ws, 3, ws_len);
+
+    printf("kernel: %s, working set: %zu KB, threshold: %d KB\n",
+           _vapi_core_copy_nt_name(), ws_len / 1024, _VAPI_CORE_COPY_NT_MIN / 1024);
+    printf("%10s | %12s %12s | %12s %12s | %s\n", "size(KB)",
+           "memcpy GB/s", "scan us", "stream GB/s", "scan us", "faster");
+
+    for(len = BENCH_SIZE_MIN; len <= BENCH_SIZE_MAX; len *= 2){
+        bench_run(bench_memcpy, p_dst, p_src, len, p_ws, ws_len, &r_mem);
+        bench_run(_vapi_core_copy_nt, p_dst, p_src, len, p_ws, ws_len, &r_nt);
+
+        // the copy and the working set it leaves behind, together
+        if( r_nt.copy_ns + r_nt.scan_ns < r_mem.copy_ns + r_mem.scan_ns ){
+            if( !crossover ) crossover = len;
+        } else {
+            crossover = 0;
+        }
+
+        printf("%10zu | %12.2f %12.1f | %12.2f %12.1f | %s\n", len / 1024,
+               len / r_mem.copy_ns, r_mem.scan_ns / 1000, len / r_nt.copy_ns, r_nt.scan_ns / 1000,
+               crossover ? "stream" : "memcpy");
+    }
+
+    if( crossover ) printf("crossover: %zu KB\n", crossover / 1024);
+    else printf("crossover: none\n");
+
+    free(p_ws);
+    free(p_dst);
+    free(p_src);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_local.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stdout, "[VAPI_CORE_HANDLE][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_HANDLE][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#define _VAPI_CORE_HANDLE_NONE (0xffffffff)
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static pthread_mutex_t _vapi_core_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t _vapi_core_handle_free_head = _VAPI_CORE_HANDLE_NONE; /* FIFO, to delay reuse */
+static uint32_t _vapi_core_handle_free_tail = _VAPI_CORE_HANDLE_NONE;
+
+static inline _vapi_core_handle_entry_t* _vapi_core_handle_entry(uint32_t idx)
+{
+    return &_vapi_core_handle_slabs[ idx >> _VAPI_CORE_HANDLE_SLAB_SHIFT ][ idx & _VAPI_CORE_HANDLE_SLAB_MASK ];
+}
+
+/* must be called with _vapi_core_handle_lock held */
+static int _vapi_core_handle_grow(void)
+{
+    _vapi_core_handle_entry_t *p_slab;
+    uint32_t i, base = _vapi_core_handle_num;
+
+    if( base >= _VAPI_CORE_HANDLE_MAX ) return -1;
+
+    p_slab = calloc( _VAPI_CORE_HANDLE_SLAB_LEN, sizeof(_vapi_core_handle_entry_t) );
+    if( !p_slab ) return -1;
+
+    for(i=0; i<_VAPI_CORE_HANDLE_SLAB_LEN; ++i)
+      p_slab[i].next_free = (i + 1 < _VAPI_CORE_HANDLE_SLAB_LEN) ? base + i + 1 : _VAPI_CORE_HANDLE_NONE;
+
+    // slabs are never freed, so lookups need no lock
+    _vapi_core_handle_slabs[ base >> _VAPI_CORE_HANDLE_SLAB_SHIFT ] = p_slab;
+    __sync_synchronize();
+    _vapi_core_handle_num = base + _VAPI_CORE_HANDLE_SLAB_LEN;
+
+    _vapi_core_handle_free_head = base;
+    _vapi_core_handle_free_tail = base + _VAPI_CORE_HANDLE_SLAB_LEN - 1;
+
+    return 0;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+_vapi_core_handle_entry_t *_vapi_core_handle_slabs[ _VAPI_CORE_HANDLE_MAX >> _VAPI_CORE_HANDLE_SLAB_SHIFT ];
+volatile uint32_t _vapi_core_handle_num = 0;
+
+int32_t _vapi_core_handle_alloc(uint32_t type, void *p_obj)
+{
+    _vapi_core_handle_entry_t *p_entry;
+    uint32_t idx, gen;
+
+    pthread_mutex_lock(&_vapi_core_handle_lock);
+
+    if( _vapi_core_handle_free_head == _VAPI_CORE_HANDLE_NONE  &&  _vapi_core_handle_grow() != 0 ){
+        pthread_mutex_unlock(&_vapi_core_handle_lock);
+        ERR_MSG("no more handles.\n");
+        return -1;
+    }
+
+    idx = _vapi_core_handle_free_head;
+    p_entry = _vapi_core_handle_entry(idx);
+    _vapi_core_handle_free_head = p_entry->next_free;
+    if( _vapi_core_handle_free_head == _VAPI_CORE_HANDLE_NONE ) _vapi_core_handle_free_tail = _VAPI_CORE_HANDLE_NONE;
+
+    // generation 0 is skipped, so that no handle becomes 0
+    gen = (p_entry->tag >> 8) & _VAPI_CORE_HANDLE_GEN_MASK;
+    if( gen == 0 ) gen = 1;
+
+    p_entry->p_obj = p_obj;
+    __sync_synchronize();
+    p_entry->tag = (gen << 8) | type;
+
+    pthread_mutex_unlock(&_vapi_core_handle_lock);
+
+    return (int32_t)((gen << _VAPI_CORE_HANDLE_GEN_SHIFT) | idx);
+}
+
+void* _vapi_core_handle_free(int32_t handle, uint32_t type)
+{
+    _vapi_core_handle_entry_t *p_entry;
+    uint32_t idx = (uint32_t)handle & _VAPI_CORE_HANDLE_IDX_MASK;
+    uint32_t gen;
+    void *p_obj;
+
+    pthread_mutex_lock(&_vapi_core_handle_lock);
+
+    p_obj = _vapi_core_handle_get(handle, type);
+    if( !p_obj ){
+        pthread_mutex_unlock(&_vapi_core_handle_lock);
+        return NULL;
+    }
+
+    // bump the generation, which makes the stale handle fail to look up
+    p_entry = _vapi_core_handle_entry(idx);
+    gen = ((p_entry->tag >> 8) + 1) & _VAPI_CORE_HANDLE_GEN_MASK;
+    p_entry->tag = gen << 8;
+    p_entry->p_obj = NULL;
+
+    p_entry->next_free = _VAPI_CORE_HANDLE_NONE;
+    if( _vapi_core_handle_free_tail == _VAPI_CORE_HANDLE_NONE ){
+        _vapi_core_handle_free_head = idx;
+    } else {
+        _vapi_core_handle_entry(_vapi_core_handle_free_tail)->next_free = idx;
+    }
+    _vapi_core_handle_free_tail = idx;
+
+    pthread_mutex_unlock(&_vapi_core_handle_lock);
+
+    return p_obj;
+}
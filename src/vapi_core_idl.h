@@ -0,0 +1,201 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+/*!
+  \file
+  "vapi_core_idl.h" generates the code of the APIs from an interface
+  definition file, by the C preprocessor at compile time.
+
+  The definition file lists the APIs with their fixed-layout arguments:
+
+  \code
+  // my_api.def
+  VAPI_API(get_temp, 1,
+           VAPI_FIELD(uint32_t, sensor)
+           VAPI_FIELD(int32_t, milli_celsius))
+  VAPI_API(set_name, 2,
+           VAPI_FIELD(uint32_t, id)
+           VAPI_ARRAY(char, name, 32))
+  VAPI_API_RAW(put_blob, 3)
+  \endcode
+
+  and it is expanded by including this header after naming the interface:
+
+  \code
+  #define VAPI_IDL_NAME my
+  #define VAPI_IDL_FILE "my_api.def"
+  #include "vapi_core_idl.h"
+  \endcode
+
+  which generates for each API "name" of the interface "NAME":
+
+  - "NAME_api_id_name", the api_id of the enum "NAME_api_id_e".
+  - "NAME_name_t", the structure of the arguments, which are both in and out.
+  - "NAME_name(fd, p_arg)", the host stub calling vapi_core_invoke().
+  - "NAME_name_async(fd, p_arg, callback, p_cookie)", the host stub calling
+    vapi_core_invoke_async().
+  - "NAME_name_handler(p_arg, p_cookie)", the prototype of the handler to be
+    implemented by the sub process.
+  - "NAME_dispatch()", the vapi_core_sub_handler_t of the sub process which
+    checks the length against the size known at compile time, and calls the
+    handler with the received buffer as the structure without copying it.
+
+  An API declared by VAPI_API_RAW() has arguments of any length laid out by
+  the caller, so that it has no structure: its host stubs take "(p_arg,
+  arg_len)" after "fd", and its handler "(p_arg, arg_len, p_cookie)".
+
+  The structures are laid out by the C ABI, which both sides share as the
+  connection is local. Every API needs at least one field, and a duplicated
+  api_id is a compile error of the dispatcher. All the generated functions
+  are "static inline", so the header can be included by both sides and by
+  several files.
+*/
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core.h"
+
+#include <stdint.h>
+#include <errno.h>
+
+//=============================================================================
+// Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#if !defined(VAPI_IDL_NAME)  ||  !defined(VAPI_IDL_FILE)
+#error "VAPI_IDL_NAME and VAPI_IDL_FILE must be defined before including vapi_core_idl.h"
+#endif
+
+#define _VAPI_IDL_CAT_(a, b)     a##b
+#define _VAPI_IDL_CAT(a, b)      _VAPI_IDL_CAT_(a, b)
+#define _VAPI_IDL_ID(name)       _VAPI_IDL_CAT(VAPI_IDL_NAME, _VAPI_IDL_CAT(_api_id_, name))
+#define _VAPI_IDL_TYPE(name)     _VAPI_IDL_CAT(VAPI_IDL_NAME, _VAPI_IDL_CAT(_, _VAPI_IDL_CAT(name, _t)))
+#define _VAPI_IDL_FUNC(name, sfx) _VAPI_IDL_CAT(VAPI_IDL_NAME, _VAPI_IDL_CAT(_, _VAPI_IDL_CAT(name, sfx)))
+
+/* api_id */
+#define VAPI_FIELD(type, field)
+#define VAPI_ARRAY(type, field, num)
+#define VAPI_API(name, id, fields) _VAPI_IDL_ID(name) = (id),
+#define VAPI_API_RAW(name, id)     _VAPI_IDL_ID(name) = (id),
+enum _VAPI_IDL_CAT(VAPI_IDL_NAME, _api_id_e)
+{
+#include VAPI_IDL_FILE
+};
+#undef VAPI_API
+#undef VAPI_API_RAW
+#undef VAPI_FIELD
+#undef VAPI_ARRAY
+
+/* arguments */
+#define VAPI_FIELD(type, field)      type field;
+#define VAPI_ARRAY(type, field, num) type field[num];
+#define VAPI_API(name, id, fields) typedef struct { fields } _VAPI_IDL_TYPE(name);
+#define VAPI_API_RAW(name, id)
+#include VAPI_IDL_FILE
+#undef VAPI_API
+#undef VAPI_API_RAW
+#undef VAPI_FIELD
+#undef VAPI_ARRAY
+
+//=============================================================================
+// Global Function/Variable Prototypes
+//=============================================================================
+#define VAPI_FIELD(type, field)
+#define VAPI_ARRAY(type, field, num)
+
+/* handlers, implemented by the sub process */
+#define VAPI_API(name, id, fields) \
+    int _VAPI_IDL_FUNC(name, _handler)(_VAPI_IDL_TYPE(name) *p_arg, void *p_cookie);
+#define VAPI_API_RAW(name, id) \
+    int _VAPI_IDL_FUNC(name, _handler)(void *p_arg, uint32_t arg_len, void *p_cookie);
+#include VAPI_IDL_FILE
+#undef VAPI_API
+#undef VAPI_API_RAW
+
+//=============================================================================
+// Inline Function Implementations
+//=============================================================================
+
+/* host stubs */
+#define VAPI_API(name, id, fields) \
+    static inline int32_t _VAPI_IDL_FUNC(name, )(int32_t fd, _VAPI_IDL_TYPE(name) *p_arg) \
+    { \
+        return vapi_core_invoke(fd, _VAPI_IDL_ID(name), p_arg, sizeof(*p_arg)); \
+    } \
+    static inline int32_t _VAPI_IDL_FUNC(name, _async)(int32_t fd, _VAPI_IDL_TYPE(name) *p_arg, \
+                                                      vapi_core_completion_t callback, const void *p_cookie) \
+    { \
+        return vapi_core_invoke_async(fd, _VAPI_IDL_ID(name), p_arg, sizeof(*p_arg), callback, p_cookie); \
+    }
+#define VAPI_API_RAW(name, id) \
+    static inline int32_t _VAPI_IDL_FUNC(name, )(int32_t fd, void *p_arg, uint32_t arg_len) \
+    { \
+        return vapi_core_invoke(fd, _VAPI_IDL_ID(name), p_arg, arg_len); \
+    } \
+    static inline int32_t _VAPI_IDL_FUNC(name, _async)(int32_t fd, void *p_arg, uint32_t arg_len, \
+                                                      vapi_core_completion_t callback, const void *p_cookie) \
+    { \
+        return vapi_core_invoke_async(fd, _VAPI_IDL_ID(name), p_arg, arg_len, callback, p_cookie); \
+    }
+#include VAPI_IDL_FILE
+#undef VAPI_API
+#undef VAPI_API_RAW
+
+/* sub dispatcher */
+#define VAPI_API(name, id, fields) \
+      case (id): \
+        if( arg_len != sizeof(_VAPI_IDL_TYPE(name)) ) break; \
+        return _VAPI_IDL_FUNC(name, _handler)((_VAPI_IDL_TYPE(name)*)p_arg, p_cookie);
+#define VAPI_API_RAW(name, id) \
+      case (id): \
+        return _VAPI_IDL_FUNC(name, _handler)(p_arg, arg_len, p_cookie);
+
+static inline int _VAPI_IDL_CAT(VAPI_IDL_NAME, _dispatch)(int32_t api_id, void *p_arg, uint32_t arg_len, void *p_cookie)
+{
+    switch( api_id ){
+#include VAPI_IDL_FILE
+      default:
+        errno = ENOSYS;
+        return -1;
+    }
+
+    errno = EINVAL; /* unexpected length */
+    return -1;
+}
+#undef VAPI_API
+#undef VAPI_API_RAW
+
+#undef VAPI_FIELD
+#undef VAPI_ARRAY
+#undef _VAPI_IDL_CAT_
+#undef _VAPI_IDL_CAT
+#undef _VAPI_IDL_ID
+#undef _VAPI_IDL_TYPE
+#undef _VAPI_IDL_FUNC
+#undef VAPI_IDL_NAME
+#undef VAPI_IDL_FILE
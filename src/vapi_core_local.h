@@ -33,16 +33,195 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // Includes
 //=============================================================================
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 //=============================================================================
 // Macro/Type/Enumeration/Structure Definitions
 //=============================================================================
 
+/* Negative api_id values are reserved for the library's control messages. */
+#define _VAPI_CORE_API_ID_SUBSCRIBE   (-2)
+#define _VAPI_CORE_API_ID_UNSUBSCRIBE (-3)
+#define _VAPI_CORE_API_ID_EVENT       (-4)
+#define _VAPI_CORE_API_ID_PING        (-5)
+#define _VAPI_CORE_API_ID_SHM_ATTACH  (-6)
+#define _VAPI_CORE_API_ID_BARRIER     (-7) /* replies the number of the failed one-way requests */
+#define _VAPI_CORE_API_ID_HELLO       (-8) /* negotiates the transport */
+
+/*
+  _vapi_core_hdr_t.version and _vapi_core_hello_t.version of this library.
+  The header of version 1 is twice as long as that of the library before it,
+  which it cannot talk to: the host and the sub must be of the same version.
+*/
+#define _VAPI_CORE_VERSION            (1)
+
+#define _VAPI_CORE_TOPIC_MAX          (32)
+#define _VAPI_CORE_RING_NAME_LEN      (32)
+#define _VAPI_CORE_RING_MAGIC         (0x56415052) /* "VAPR" */
+
+/* _vapi_core_subscribe_t.flags */
+#define _VAPI_CORE_SUBSCRIBE_RING     (0x00000001)
+
+/* _vapi_core_event_t.flags */
+#define _VAPI_CORE_EVENT_RING         (0x00000001)
+
+/* _vapi_core_hdr_t.flags */
+#define _VAPI_CORE_HDR_SHM            (0x00000001) /* the arguments are at "shm_off" of the region */
+#define _VAPI_CORE_HDR_UNORDERED      (0x00000002) /* may be handled concurrently, and replied out of order */
+#define _VAPI_CORE_HDR_ONEWAY         (0x00000004) /* never replied */
+#define _VAPI_CORE_HDR_LOCAL          (0x00000008) /* the arguments are of the caller in the same process, never sent */
+#define _VAPI_CORE_HDR_SOCKET_MASK    (_VAPI_CORE_HDR_SHM | _VAPI_CORE_HDR_UNORDERED | _VAPI_CORE_HDR_ONEWAY) /* valid over a socket */
+
+#define _VAPI_CORE_SHM_SIZE           (64*1024*1024) /* argument region per connection */
+#define _VAPI_CORE_SHM_ALIGN          (64)
+#define _VAPI_CORE_HUGE_PAGE_SIZE     (2*1024*1024)
+#define _VAPI_CORE_COPY_NT_MIN        (1024*1024)  /* streamed around the cache, by vapi_core_copy_bench */
+#define _VAPI_CORE_SPLICE_MIN         (1024*1024)  /* arguments spliced to a unix socket by vmsplice(2) */
+#define _VAPI_CORE_SPLICE_PIPE_SIZE   (1024*1024)  /* of the pipe, per vmsplice(2) */
+
+/* _vapi_core_hello_t.transports, besides TCP which every sub accepts */
+#define _VAPI_CORE_TRANSPORT_UNIX     (0x00000001) /* the abstract unix socket of "unix_name" */
+#define _VAPI_CORE_TRANSPORT_SHM      (0x00000002) /* the argument region of _VAPI_CORE_API_ID_SHM_ATTACH */
+
+/* _vapi_core_shm_attach_t.flags */
+#define _VAPI_CORE_SHM_FD             (0x00000002) /* a memfd passed by SCM_RIGHTS with the argument, over unix */
+#define _VAPI_CORE_SHM_PREFIX         "/vapi_core_shm." /* of "name" of shm_open(3) otherwise */
+
+typedef struct
+{
+    int32_t api_id;
+    uint32_t arg_len;
+    int err_code, errsv;
+    uint32_t req_id;      /* echoed back by the reply, 0 for events */
+    uint32_t flags;       /* _VAPI_CORE_HDR_*, echoed back by the reply */
+    uint32_t shm_off;     /* offset of the arguments if _VAPI_CORE_HDR_SHM */
+    uint32_t version;     /* _VAPI_CORE_VERSION of the sender */
+} _vapi_core_hdr_t;
+
+/*
+  argument of _VAPI_CORE_API_ID_HELLO, sent by vapi_core_open() over TCP.
+  The host moves to the fastest transport both sides support, and sends it
+  again over the new one with "conn" to confirm that it was accepted. The sub
+  answers it with the "nonce" given to that TCP connection, so that the host
+  knows the unix socket is of the same sub.
+*/
+typedef struct
+{
+    uint32_t version;     /* in: of the host, out: of the sub */
+    uint32_t transports;  /* in: supported by the host, out: offered by the sub */
+    uint32_t max_arg_len; /* out: the largest arguments the sub admits, 0 if no limit */
+    uint32_t features;    /* 0, for the optional features of the later versions */
+    uint32_t conn;        /* in: the TCP port of the host moving from, which names it in traces */
+    uint32_t reserved;
+    uint64_t nonce;       /* out: random over TCP if unix is offered, the same once over unix */
+    char unix_name[_VAPI_CORE_RING_NAME_LEN]; /* out: without the leading '\0' of the abstract name */
+} _vapi_core_hello_t;
+
+/* argument of _VAPI_CORE_API_ID_SHM_ATTACH */
+typedef struct
+{
+    uint32_t size;
+    uint32_t flags;
+    char name[_VAPI_CORE_RING_NAME_LEN];
+} _vapi_core_shm_attach_t;
+
+/* argument of _VAPI_CORE_API_ID_SUBSCRIBE/_VAPI_CORE_API_ID_UNSUBSCRIBE */
+typedef struct
+{
+    int32_t topic;
+    uint32_t flags;                          /* in: ring acceptable, out: ring granted */
+    uint32_t ring_size;                      /* out */
+    char ring_name[_VAPI_CORE_RING_NAME_LEN]; /* out */
+} _vapi_core_subscribe_t;
+
+/* body of _VAPI_CORE_API_ID_EVENT, followed by the payload unless it is in the ring */
+typedef struct
+{
+    int32_t topic;
+    uint32_t len;
+    uint64_t ring_pos;
+    uint32_t flags;
+    uint32_t reserved;
+} _vapi_core_event_t;
+
+/*
+  Broadcast ring shared between the sub and same-host subscribers.
+  The publisher advances "head" before writing a payload, so a reader which
+  copied a payload at "pos" can detect that it was overwritten meanwhile by
+  checking "head - pos > size" after the copy.
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t size;          /* size of the data area following this header */
+    volatile uint64_t head; /* total bytes ever reserved */
+    uint8_t pad[48];
+} _vapi_core_ring_hdr_t;
+
+/*
+  Descriptors are handles into a slab table instead of casted pointers.
+  A handle is "generation << 16 | index", so that it is always positive, and
+  a stale handle is rejected by comparing the generation of the entry.
+*/
+#define _VAPI_CORE_HANDLE_GEN_SHIFT   (16)
+#define _VAPI_CORE_HANDLE_GEN_MASK    (0x7fff)
+#define _VAPI_CORE_HANDLE_IDX_MASK    (0xffff)
+#define _VAPI_CORE_HANDLE_MAX         (_VAPI_CORE_HANDLE_IDX_MASK + 1)
+#define _VAPI_CORE_HANDLE_SLAB_SHIFT  (8)
+#define _VAPI_CORE_HANDLE_SLAB_LEN    (1 << _VAPI_CORE_HANDLE_SLAB_SHIFT)
+#define _VAPI_CORE_HANDLE_SLAB_MASK   (_VAPI_CORE_HANDLE_SLAB_LEN - 1)
+
+enum
+{
+    _VAPI_CORE_HANDLE_HOST = 1,
+    _VAPI_CORE_HANDLE_SUB,
+    _VAPI_CORE_HANDLE_POOL,
+    _VAPI_CORE_HANDLE_TOKEN,
+};
+
+typedef struct
+{
+    void *p_obj;
+    volatile uint32_t tag;   /* generation << 8 | type */
+    uint32_t next_free;
+} _vapi_core_handle_entry_t;
+
 //=============================================================================
 // Local Function/Variable Prototypes
 //=============================================================================
+extern _vapi_core_handle_entry_t *_vapi_core_handle_slabs[];
+extern volatile uint32_t _vapi_core_handle_num;
+
+int32_t _vapi_core_handle_alloc(uint32_t type, void *p_obj);
+void* _vapi_core_handle_free(int32_t handle, uint32_t type);
+
+/* vapi_core_open(), which fails at once if the sub is not listening unless "retry" */
+int32_t _vapi_core_open(uint16_t dstport, int retry);
+
+/* whether a failed call left the descriptor out of step with its sub, unlike an error replied by the sub */
+int _vapi_core_broken(int32_t fd);
+
+/* direct calls to a sub of the same process, which vapi_core_open() finds by the port */
+void* _vapi_core_sub_local_connect(uint16_t port);
+int32_t _vapi_core_sub_local_invoke(void *p_conn, int32_t api_id, void *p_arg, uint32_t arg_len, uint32_t flags);
+void _vapi_core_sub_local_close(void *p_conn);
+
+/* streaming copy by the widest kernel of the CPU */
+void _vapi_core_copy_nt(void *p_dst, const void *p_src, size_t len);
+const char* _vapi_core_copy_nt_name(void);
+
+/* stage stamps of vapi_core_trace.h, compiled out unless VAPI_CORE_TRACE */
+#ifdef VAPI_CORE_TRACE
+extern volatile int _vapi_core_trace_enabled;
+void _vapi_core_trace_record(uint8_t stage, uint16_t conn, uint32_t seq, int32_t api_id, uint32_t arg_len);
+#define _VAPI_CORE_TRACE(stage, conn, seq, api_id, arg_len) \
+    do{ if( _vapi_core_trace_enabled ) _vapi_core_trace_record(stage, conn, seq, api_id, arg_len); }while(0)
+#else
+#define _VAPI_CORE_TRACE(stage, conn, seq, api_id, arg_len)
+#endif
 
 //=============================================================================
 // Local Inline Function Implementations
@@ -73,4 +252,120 @@ static inline ssize_t _vapi_core_recv(int sockfd, void *buf, size_t len, int fla
     return sum;
 }
 
+/* sends "buf" with the descriptor "fd" attached to its first byte by SCM_RIGHTS */
+static inline ssize_t _vapi_core_send_fd(int sockfd, const void *buf, size_t len, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *p_cmsg;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    ssize_t size;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(ctrl, 0, sizeof(ctrl));
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    p_cmsg = CMSG_FIRSTHDR(&msg);
+    p_cmsg->cmsg_level = SOL_SOCKET;
+    p_cmsg->cmsg_type = SCM_RIGHTS;
+    p_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(p_cmsg), &fd, sizeof(int));
+
+    size = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if( size < 0  ||  (size_t)size == len ) return size;
+
+    // the descriptor went with the first part
+    size = _vapi_core_send(sockfd, (uint8_t*)buf + size, len - size, MSG_NOSIGNAL);
+    return size < 0 ? size : (ssize_t)len;
+}
+
+/*
+  receives "buf" and the descriptor attached to it by SCM_RIGHTS into "p_fd",
+  which is -1 if none came. The descriptors beyond the first are closed.
+*/
+static inline ssize_t _vapi_core_recv_fd(int sockfd, void *buf, size_t len, int *p_fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *p_cmsg;
+    char ctrl[CMSG_SPACE(sizeof(int) * 4)];
+    ssize_t size = 0;
+    size_t sum;
+    int fd, i, n;
+
+    *p_fd = -1;
+    for(sum=0; sum<len; sum+=(size_t)size){
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (uint8_t*)buf + sum;
+        iov.iov_len = len - sum;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        size = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+        if( size < 0  ||  size == 0 ) break;
+
+        for(p_cmsg = CMSG_FIRSTHDR(&msg); p_cmsg; p_cmsg = CMSG_NXTHDR(&msg, p_cmsg)){
+            if( p_cmsg->cmsg_level != SOL_SOCKET  ||  p_cmsg->cmsg_type != SCM_RIGHTS ) continue;
+            n = (p_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(i=0; i<n; ++i){
+                memcpy(&fd, CMSG_DATA(p_cmsg) + i * sizeof(int), sizeof(int));
+                if( *p_fd == -1 ) *p_fd = fd;
+                else close(fd);
+            }
+        }
+    }
+    if( sum == len ) return (ssize_t)sum;
+
+    if( *p_fd >= 0 ){ close(*p_fd); *p_fd = -1; }
+    return size;
+}
+
+/* copies the payload, around the cache if it is large enough to evict the working set */
+static inline void _vapi_core_copy(void *p_dst, const void *p_src, size_t len)
+{
+    if( len < _VAPI_CORE_COPY_NT_MIN ) memcpy(p_dst, p_src, len);
+    else _vapi_core_copy_nt(p_dst, p_src, len);
+}
+
+/* the length of the body following the header on the stream */
+static inline uint32_t _vapi_core_body_len(const _vapi_core_hdr_t *p_hdr)
+{
+    return (p_hdr->flags & (_VAPI_CORE_HDR_SHM | _VAPI_CORE_HDR_LOCAL)) ? 0 : p_hdr->arg_len;
+}
+
+static inline void* _vapi_core_handle_get(int32_t handle, uint32_t type)
+{
+    uint32_t idx = (uint32_t)handle & _VAPI_CORE_HANDLE_IDX_MASK;
+    uint32_t gen = (uint32_t)handle >> _VAPI_CORE_HANDLE_GEN_SHIFT;
+    _vapi_core_handle_entry_t *p_entry;
+
+    if( handle <= 0  ||  idx >= _vapi_core_handle_num ) return NULL;
+
+    p_entry = &_vapi_core_handle_slabs[ idx >> _VAPI_CORE_HANDLE_SLAB_SHIFT ][ idx & _VAPI_CORE_HANDLE_SLAB_MASK ];
+    if( p_entry->tag != ((gen << 8) | type) ) return NULL;
+
+    return p_entry->p_obj;
+}
+
+static inline int _vapi_core_ring_read(const _vapi_core_ring_hdr_t *p_ring, uint64_t pos, void *buf, uint32_t len)
+{
+    const uint8_t *p_data = (const uint8_t*)(p_ring + 1);
+
+    if( len > p_ring->size  ||  (pos % p_ring->size) + len > p_ring->size ) return -1;
+    if( p_ring->head - pos > p_ring->size ) return -1;
+
+    _vapi_core_copy(buf, p_data + (pos % p_ring->size), len);
+    __sync_synchronize();
+
+    if( p_ring->head - pos > p_ring->size ) return -1; /* overwritten while copying */
+
+    return 0;
+}
+
 #endif // _VAPI_CORE_LOCAL_H_
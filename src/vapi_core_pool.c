@@ -0,0 +1,688 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_local.h"
+#include "vapi_core.h"
+#include "vapi_core_pool.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stdout, "[VAPI_CORE_POOL][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_POOL][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#define _VAPI_CORE_POOL_CHECK_MS (1000)  /* health-check connections idle longer than this */
+#define _VAPI_CORE_POOL_IDLE_MS  (10000) /* close surplus connections idle longer than this */
+
+enum
+{
+    _VAPI_CORE_POOL_SLOT_FREE = 0,
+    _VAPI_CORE_POOL_SLOT_IDLE,
+    _VAPI_CORE_POOL_SLOT_BUSY,
+};
+
+typedef struct
+{
+    int32_t fd;
+    int state;
+    uint64_t last_ms;                   /* last used */
+    uint64_t check_ms;                  /* last known to be alive */
+} _vapi_core_pool_slot_t;
+
+/* A connection of VAPI_CORE_POOL_PER_THREAD, kept by a thread until it exits. */
+typedef struct __vapi_core_pool_bind_t
+{
+    struct __vapi_core_pool_t *p_pool;
+    uint32_t idx;
+    pthread_t owner;
+    struct __vapi_core_pool_bind_t *p_next;
+} _vapi_core_pool_bind_t;
+
+typedef struct __vapi_core_pool_t
+{
+    struct __vapi_core_pool_t *p_next;
+    int ref;
+    int32_t handle;
+    uint16_t dstport;
+    uint32_t min_num, max_num, flags;
+    pthread_key_t key;                  /* for VAPI_CORE_POOL_PER_THREAD */
+    _vapi_core_pool_bind_t *p_bind;     /* the bindings of the key, under _vapi_core_pool_list_lock */
+
+    pthread_t check_thrd;               /* health-checks the idle connections */
+    int check_alive;
+
+    pthread_mutex_t lock;               /* protects the followings */
+    pthread_cond_t  cond;
+    pthread_cond_t  check_cond;         /* wakes the checker to exit */
+    uint32_t total_num;                 /* connected or being connected */
+    uint32_t idle_num;
+    uint32_t *p_idle;                   /* LIFO of idle slots, the oldest at the bottom */
+    _vapi_core_pool_slot_t slots[];
+} _vapi_core_pool_t;
+
+static pthread_mutex_t _vapi_core_pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static _vapi_core_pool_t *_vapi_core_pool_list = NULL;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static uint64_t _vapi_core_pool_mtime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int _vapi_core_pool_ping(int32_t fd)
+{
+    return vapi_core_invoke(fd, _VAPI_CORE_API_ID_PING, NULL, 0);
+}
+
+/* connects the slot, and warms it up by a round trip */
+static int _vapi_core_pool_connect(_vapi_core_pool_t *p_pool, uint32_t idx)
+{
+    int32_t fd;
+
+    // never wait for a sub which is down, the callers would hang
+    fd = _vapi_core_open(p_pool->dstport, 0);
+    if( fd == -1 ) return -1;
+
+    if( _vapi_core_pool_ping(fd) != 0 ){
+        vapi_core_close(fd);
+        return -1;
+    }
+
+    p_pool->slots[idx].fd = fd;
+    p_pool->slots[idx].last_ms = p_pool->slots[idx].check_ms = _vapi_core_pool_mtime();
+
+    return 0;
+}
+
+/* pings the slot taken out of the pool, and reconnects it if broken */
+static int _vapi_core_pool_check(_vapi_core_pool_t *p_pool, uint32_t idx)
+{
+    if( _vapi_core_pool_ping(p_pool->slots[idx].fd) == 0 ){
+        p_pool->slots[idx].check_ms = _vapi_core_pool_mtime();
+        return 0;
+    }
+
+    LOG_MSG("reconnecting a broken connection to port=%u.\n", p_pool->dstport);
+    vapi_core_close(p_pool->slots[idx].fd);
+
+    return _vapi_core_pool_connect(p_pool, idx);
+}
+
+/* must be called with p_pool->lock held, keeps the idle slots sorted by the last use */
+static void _vapi_core_pool_idle_put(_vapi_core_pool_t *p_pool, uint32_t idx)
+{
+    uint32_t i = p_pool->idle_num++;
+
+    while( i > 0  &&  p_pool->slots[ p_pool->p_idle[i-1] ].last_ms > p_pool->slots[idx].last_ms ){
+        p_pool->p_idle[i] = p_pool->p_idle[i-1];
+        i--;
+    }
+    p_pool->p_idle[i] = idx;
+    p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_IDLE;
+}
+
+/* must be called with p_pool->lock held */
+static void _vapi_core_pool_idle_take(_vapi_core_pool_t *p_pool, uint32_t i)
+{
+    p_pool->slots[ p_pool->p_idle[i] ].state = _VAPI_CORE_POOL_SLOT_BUSY;
+    p_pool->idle_num--;
+    memmove(&p_pool->p_idle[i], &p_pool->p_idle[i+1], (p_pool->idle_num - i) * sizeof(uint32_t));
+}
+
+static void _vapi_core_pool_discard(_vapi_core_pool_t *p_pool, uint32_t idx)
+{
+    pthread_mutex_lock(&p_pool->lock);
+    p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_FREE;
+    p_pool->total_num--;
+    pthread_cond_signal(&p_pool->cond);
+    pthread_mutex_unlock(&p_pool->lock);
+}
+
+/* takes a connection, waiting for one to be released if "wait", or fails with EBUSY */
+static int _vapi_core_pool_acquire(_vapi_core_pool_t *p_pool, uint32_t *p_idx, int wait)
+{
+    uint32_t idx;
+    int stale;
+
+    pthread_mutex_lock(&p_pool->lock);
+
+    while( 1 ){
+        // reuse the most recently used connection, whose buffers are warm
+        if( p_pool->idle_num ){
+            idx = p_pool->p_idle[ p_pool->idle_num - 1 ];
+            _vapi_core_pool_idle_take(p_pool, p_pool->idle_num - 1);
+            stale = _vapi_core_pool_mtime() - p_pool->slots[idx].check_ms > _VAPI_CORE_POOL_CHECK_MS;
+            pthread_mutex_unlock(&p_pool->lock);
+
+            if( stale  &&  _vapi_core_pool_check(p_pool, idx) != 0 ){
+                _vapi_core_pool_discard(p_pool, idx);
+                return -1;
+            }
+            *p_idx = idx;
+            return 0;
+        }
+
+        // grow
+        if( p_pool->total_num < p_pool->max_num ){
+            for(idx=0; idx<p_pool->max_num; ++idx)
+              if( p_pool->slots[idx].state == _VAPI_CORE_POOL_SLOT_FREE ) break;
+            p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_BUSY;
+            p_pool->total_num++;
+            pthread_mutex_unlock(&p_pool->lock);
+
+            if( _vapi_core_pool_connect(p_pool, idx) != 0 ){
+                _vapi_core_pool_discard(p_pool, idx);
+                return -1;
+            }
+            *p_idx = idx;
+            return 0;
+        }
+
+        if( !wait ){
+            pthread_mutex_unlock(&p_pool->lock);
+            errno = EBUSY;
+            return -1;
+        }
+
+        pthread_cond_wait(&p_pool->cond, &p_pool->lock);
+    }
+}
+
+/* whether the call of "err_code" lost the connection, rather than being answered with an error */
+static int _vapi_core_pool_lost(int32_t fd, int32_t err_code)
+{
+    return err_code != 0  &&  _vapi_core_broken(fd);
+}
+
+static void _vapi_core_pool_release(_vapi_core_pool_t *p_pool, uint32_t idx, int32_t err_code)
+{
+    _vapi_core_pool_slot_t *p_slot = &p_pool->slots[idx];
+    int32_t close_fd = -1;
+    uint64_t now = _vapi_core_pool_mtime();
+    int lost = _vapi_core_pool_lost(p_slot->fd, err_code);
+
+    pthread_mutex_lock(&p_pool->lock);
+
+    if( lost ){
+        close_fd = p_slot->fd;
+        p_slot->state = _VAPI_CORE_POOL_SLOT_FREE;
+        p_pool->total_num--;
+    } else {
+        p_slot->last_ms = p_slot->check_ms = now;
+        _vapi_core_pool_idle_put(p_pool, idx);
+
+        // shrink by the oldest idle connection
+        p_slot = &p_pool->slots[ p_pool->p_idle[0] ];
+        if( p_pool->total_num > p_pool->min_num  &&  now - p_slot->last_ms > _VAPI_CORE_POOL_IDLE_MS ){
+            close_fd = p_slot->fd;
+            _vapi_core_pool_idle_take(p_pool, 0);
+            p_slot->state = _VAPI_CORE_POOL_SLOT_FREE;
+            p_pool->total_num--;
+        }
+    }
+
+    pthread_cond_signal(&p_pool->cond);
+    pthread_mutex_unlock(&p_pool->lock);
+
+    if( close_fd != -1 ) vapi_core_close(close_fd);
+}
+
+/* must be called with _vapi_core_pool_list_lock held */
+static int _vapi_core_pool_unlink(_vapi_core_pool_t *p_pool, _vapi_core_pool_bind_t *p_bind)
+{
+    _vapi_core_pool_bind_t **pp;
+
+    for(pp = &p_pool->p_bind; *pp; pp = &(*pp)->p_next){
+        if( *pp == p_bind  &&  pthread_equal(p_bind->owner, pthread_self()) ){
+            *pp = p_bind->p_next;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* the destructor of the key, run by an exiting thread */
+static void _vapi_core_pool_unbind(void *p_arg)
+{
+    _vapi_core_pool_t *p_pool;
+
+    // a closed pool is out of the list and has released the binding already,
+    // so that "p_arg" is dereferenced only once found in a live pool
+    pthread_mutex_lock(&_vapi_core_pool_list_lock);
+    for(p_pool = _vapi_core_pool_list; p_pool; p_pool = p_pool->p_next){
+        if( (p_pool->flags & VAPI_CORE_POOL_PER_THREAD)  &&  _vapi_core_pool_unlink(p_pool, p_arg) == 0 ){
+            _vapi_core_pool_release(p_pool, ((_vapi_core_pool_bind_t*)p_arg)->idx, 0);
+            free(p_arg);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+}
+
+/* gives the connection of the thread back to the pool, which failed by "err_code" */
+static void _vapi_core_pool_unbind_err(_vapi_core_pool_t *p_pool, _vapi_core_pool_bind_t *p_bind, int32_t err_code)
+{
+    pthread_setspecific(p_pool->key, NULL);
+
+    pthread_mutex_lock(&_vapi_core_pool_list_lock);
+    _vapi_core_pool_unlink(p_pool, p_bind);
+    pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+
+    _vapi_core_pool_release(p_pool, p_bind->idx, err_code);
+    free(p_bind);
+}
+
+static _vapi_core_pool_bind_t* _vapi_core_pool_bind(_vapi_core_pool_t *p_pool)
+{
+    _vapi_core_pool_bind_t *p_bind;
+
+    p_bind = pthread_getspecific(p_pool->key);
+    if( p_bind ) return p_bind;
+
+    p_bind = malloc( sizeof(*p_bind) );
+    if( !p_bind ) return NULL;
+
+    // the threads holding the connections keep them until they exit
+    p_bind->p_pool = p_pool;
+    p_bind->owner = pthread_self();
+    if( _vapi_core_pool_acquire(p_pool, &p_bind->idx, 0) != 0 ){
+        free(p_bind);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_vapi_core_pool_list_lock);
+    p_bind->p_next = p_pool->p_bind;
+    p_pool->p_bind = p_bind;
+    pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+
+    pthread_setspecific(p_pool->key, p_bind);
+
+    return p_bind;
+}
+
+/* one round of the checker, with p_pool->lock held */
+static void _vapi_core_pool_check_round(_vapi_core_pool_t *p_pool)
+{
+    uint32_t i, idx;
+    uint64_t now;
+    int32_t close_fd;
+    int err_code;
+
+    while( p_pool->check_alive ){
+        now = _vapi_core_pool_mtime();
+
+        // shrink by the oldest idle connection, even without any call
+        idx = p_pool->idle_num ? p_pool->p_idle[0] : 0;
+        if( p_pool->idle_num  &&  p_pool->total_num > p_pool->min_num  &&  now - p_pool->slots[idx].last_ms > _VAPI_CORE_POOL_IDLE_MS ){
+            close_fd = p_pool->slots[idx].fd;
+            _vapi_core_pool_idle_take(p_pool, 0);
+            p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_FREE;
+            p_pool->total_num--;
+            pthread_mutex_unlock(&p_pool->lock);
+            vapi_core_close(close_fd);
+            pthread_mutex_lock(&p_pool->lock);
+            continue;
+        }
+
+        // ping an idle connection not known to be alive recently
+        for(i=0; i<p_pool->idle_num; ++i)
+          if( now - p_pool->slots[ p_pool->p_idle[i] ].check_ms > _VAPI_CORE_POOL_CHECK_MS ) break;
+        if( i < p_pool->idle_num ){
+            idx = p_pool->p_idle[i];
+            _vapi_core_pool_idle_take(p_pool, i);
+            pthread_mutex_unlock(&p_pool->lock);
+
+            err_code = _vapi_core_pool_check(p_pool, idx);
+
+            pthread_mutex_lock(&p_pool->lock);
+            if( err_code == 0 ){
+                _vapi_core_pool_idle_put(p_pool, idx);
+            } else {
+                p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_FREE;
+                p_pool->total_num--;
+            }
+            pthread_cond_signal(&p_pool->cond);
+            continue;
+        }
+
+        // refill up to "min_num", lost by the broken connections
+        if( p_pool->total_num < p_pool->min_num ){
+            for(idx=0; idx<p_pool->max_num; ++idx)
+              if( p_pool->slots[idx].state == _VAPI_CORE_POOL_SLOT_FREE ) break;
+            p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_BUSY;
+            p_pool->total_num++;
+            pthread_mutex_unlock(&p_pool->lock);
+
+            err_code = _vapi_core_pool_connect(p_pool, idx);
+
+            pthread_mutex_lock(&p_pool->lock);
+            if( err_code == 0 ){
+                _vapi_core_pool_idle_put(p_pool, idx);
+                pthread_cond_signal(&p_pool->cond);
+                continue;
+            }
+            p_pool->slots[idx].state = _VAPI_CORE_POOL_SLOT_FREE;
+            p_pool->total_num--;
+        }
+        break;
+    }
+}
+
+static void* _vapi_core_pool_check_thread(_vapi_core_pool_t *p_pool)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&p_pool->lock);
+    while( p_pool->check_alive ){
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += _VAPI_CORE_POOL_CHECK_MS / 1000;
+        pthread_cond_timedwait(&p_pool->check_cond, &p_pool->lock, &ts);
+
+        _vapi_core_pool_check_round(p_pool);
+    }
+    pthread_mutex_unlock(&p_pool->lock);
+
+    return NULL;
+}
+
+static void _vapi_core_pool_free(_vapi_core_pool_t *p_pool)
+{
+    _vapi_core_pool_bind_t *p_bind;
+    uint32_t i;
+
+    if( p_pool->check_alive ){
+        pthread_mutex_lock(&p_pool->lock);
+        p_pool->check_alive = 0;
+        pthread_cond_signal(&p_pool->check_cond);
+        pthread_mutex_unlock(&p_pool->lock);
+        pthread_join(p_pool->check_thrd, NULL);
+    }
+
+    // the pool is out of the list, so that no thread exiting now touches the bindings
+    if( p_pool->flags & VAPI_CORE_POOL_PER_THREAD ) pthread_key_delete(p_pool->key);
+    while( (p_bind = p_pool->p_bind) ){
+        p_pool->p_bind = p_bind->p_next;
+        free(p_bind);
+    }
+
+    for(i=0; i<p_pool->max_num; ++i)
+      if( p_pool->slots[i].state != _VAPI_CORE_POOL_SLOT_FREE ) vapi_core_close(p_pool->slots[i].fd);
+
+    pthread_mutex_destroy(&p_pool->lock);
+    pthread_cond_destroy(&p_pool->cond);
+    pthread_cond_destroy(&p_pool->check_cond);
+    if( p_pool->p_idle ) free(p_pool->p_idle);
+    free(p_pool);
+}
+
+/* must be called with _vapi_core_pool_list_lock held */
+static _vapi_core_pool_t* _vapi_core_pool_find(uint16_t dstport)
+{
+    _vapi_core_pool_t *p_pool;
+
+    for(p_pool = _vapi_core_pool_list; p_pool; p_pool = p_pool->p_next)
+      if( p_pool->dstport == dstport ) return p_pool;
+
+    return NULL;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int32_t vapi_core_pool_open(uint16_t dstport, uint32_t min_num, uint32_t max_num, uint32_t flags)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    _vapi_core_pool_t *p_pool = NULL, *p_other;
+    pthread_condattr_t attr;
+    uint32_t i;
+    int32_t handle;
+
+    if( max_num == 0  ||  min_num > max_num ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+
+    pthread_mutex_lock(&_vapi_core_pool_list_lock);
+    p_other = _vapi_core_pool_find(dstport);
+    if( p_other ){
+        p_other->ref++;
+        handle = p_other->handle;
+        pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+        return handle;
+    }
+    pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+
+    p_pool = calloc( 1, sizeof(_vapi_core_pool_t) + max_num * sizeof(_vapi_core_pool_slot_t) );
+    if( !p_pool ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+
+    p_pool->ref = 1;
+    p_pool->dstport = dstport;
+    p_pool->min_num = min_num;
+    p_pool->max_num = max_num;
+    p_pool->flags = flags;
+    pthread_mutex_init(&p_pool->lock, NULL);
+    pthread_cond_init(&p_pool->cond, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&p_pool->check_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    p_pool->p_idle = calloc( max_num, sizeof(uint32_t) );
+    if( !p_pool->p_idle ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+
+    if( flags & VAPI_CORE_POOL_PER_THREAD ){
+        err_code = pthread_key_create(&p_pool->key, _vapi_core_pool_unbind);
+        if( err_code!=0 ){
+            p_pool->flags &= ~VAPI_CORE_POOL_PER_THREAD;
+            line = __LINE__; errsv = err_code; goto _err_end_;
+        }
+    }
+
+    // warm up, out of the list lock as the round trips may take long
+    for(i=0; i<min_num; ++i){
+        if( _vapi_core_pool_connect(p_pool, i) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+        p_pool->total_num++;
+        _vapi_core_pool_idle_put(p_pool, i);
+    }
+
+    p_pool->check_alive = 1;
+    err_code = pthread_create( &p_pool->check_thrd, NULL, (void*)_vapi_core_pool_check_thread, (void*)p_pool );
+    if( err_code!=0 ){ p_pool->check_alive = 0; line = __LINE__; errsv = err_code; goto _err_end_; }
+
+    pthread_mutex_lock(&_vapi_core_pool_list_lock);
+
+    // opened by another thread meanwhile
+    p_other = _vapi_core_pool_find(dstport);
+    if( p_other ){
+        p_other->ref++;
+        handle = p_other->handle;
+        pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+        _vapi_core_pool_free(p_pool);
+        return handle;
+    }
+
+    p_pool->handle = _vapi_core_handle_alloc(_VAPI_CORE_HANDLE_POOL, p_pool);
+    if( p_pool->handle == -1 ){ pthread_mutex_unlock(&_vapi_core_pool_list_lock); line = __LINE__; goto _err_end_; }
+
+    p_pool->p_next = _vapi_core_pool_list;
+    _vapi_core_pool_list = p_pool;
+    handle = p_pool->handle;
+
+    pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+
+    return handle;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_pool ) _vapi_core_pool_free(p_pool);
+
+    if( errsv ) errno = errsv;
+    return -1;
+}
+
+int32_t vapi_core_pool_close(int32_t pool)
+{
+    int line = 0;
+    _vapi_core_pool_t *p_pool = NULL, **pp;
+
+    pthread_mutex_lock(&_vapi_core_pool_list_lock);
+    p_pool = _vapi_core_handle_get(pool, _VAPI_CORE_HANDLE_POOL);
+    if( !p_pool ){ pthread_mutex_unlock(&_vapi_core_pool_list_lock); line = __LINE__; goto _err_end_; }
+    if( --p_pool->ref > 0 ){
+        pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+        return 0;
+    }
+    _vapi_core_handle_free(pool, _VAPI_CORE_HANDLE_POOL);
+    for(pp = &_vapi_core_pool_list; *pp; pp = &(*pp)->p_next){
+        if( *pp == p_pool ){ *pp = p_pool->p_next; break; }
+    }
+    pthread_mutex_unlock(&_vapi_core_pool_list_lock);
+
+    _vapi_core_pool_free(p_pool);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    return -1;
+}
+
+int32_t vapi_core_pool_get(int32_t pool)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_pool_t *p_pool = NULL;
+    _vapi_core_pool_bind_t *p_bind;
+    uint32_t idx;
+
+    p_pool = _vapi_core_handle_get(pool, _VAPI_CORE_HANDLE_POOL);
+    if( !p_pool ){ line = __LINE__; goto _err_end_; }
+
+    if( p_pool->flags & VAPI_CORE_POOL_PER_THREAD ){
+        p_bind = _vapi_core_pool_bind(p_pool);
+        if( !p_bind ){ line = __LINE__; errsv = errno; goto _err_end_; }
+        idx = p_bind->idx;
+    } else {
+        if( _vapi_core_pool_acquire(p_pool, &idx, 1) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    }
+
+    return p_pool->slots[idx].fd;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( errsv ) errno = errsv;
+    return -1;
+}
+
+int32_t vapi_core_pool_put(int32_t pool, int32_t fd, int32_t err_code)
+{
+    int line = 0;
+    _vapi_core_pool_t *p_pool = NULL;
+    _vapi_core_pool_bind_t *p_bind;
+    uint32_t idx;
+
+    p_pool = _vapi_core_handle_get(pool, _VAPI_CORE_HANDLE_POOL);
+    if( !p_pool ){ line = __LINE__; goto _err_end_; }
+
+    if( p_pool->flags & VAPI_CORE_POOL_PER_THREAD ){
+        p_bind = pthread_getspecific(p_pool->key);
+        if( !p_bind  ||  p_pool->slots[p_bind->idx].fd != fd ){ line = __LINE__; goto _err_end_; }
+        if( _vapi_core_pool_lost(fd, err_code) ) _vapi_core_pool_unbind_err(p_pool, p_bind, err_code);
+        return 0;
+    }
+
+    for(idx=0; idx<p_pool->max_num; ++idx)
+      if( p_pool->slots[idx].state == _VAPI_CORE_POOL_SLOT_BUSY  &&  p_pool->slots[idx].fd == fd ) break;
+    if( idx == p_pool->max_num ){ line = __LINE__; goto _err_end_; }
+
+    _vapi_core_pool_release(p_pool, idx, err_code);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    return -1;
+}
+
+int32_t vapi_core_pool_invoke(int32_t pool, int32_t api_id, void* p_arg, uint32_t arg_len)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    _vapi_core_pool_t *p_pool = NULL;
+    _vapi_core_pool_bind_t *p_bind;
+    uint32_t idx;
+
+    p_pool = _vapi_core_handle_get(pool, _VAPI_CORE_HANDLE_POOL);
+    if( !p_pool ){ line = __LINE__; goto _err_end_; }
+
+    if( p_pool->flags & VAPI_CORE_POOL_PER_THREAD ){
+        p_bind = _vapi_core_pool_bind(p_pool);
+        if( !p_bind ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+        err_code = vapi_core_invoke(p_pool->slots[p_bind->idx].fd, api_id, p_arg, arg_len);
+        if( _vapi_core_pool_lost(p_pool->slots[p_bind->idx].fd, err_code) ) _vapi_core_pool_unbind_err(p_pool, p_bind, err_code);
+    } else {
+        if( _vapi_core_pool_acquire(p_pool, &idx, 1) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+        err_code = vapi_core_invoke(p_pool->slots[idx].fd, api_id, p_arg, arg_len);
+        _vapi_core_pool_release(p_pool, idx, err_code);
+    }
+
+    return err_code;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( errsv ) errno = errsv;
+    return -1;
+}
@@ -0,0 +1,163 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+#ifndef _VAPI_CORE_POOL_H_
+#define _VAPI_CORE_POOL_H_
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include <stdint.h>
+
+//=============================================================================
+// Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+
+/*!
+  \brief
+  If set to "flags" of vapi_core_pool_open(), each thread keeps using the
+  same connection until it exits, instead of borrowing one per call.
+  A thread finding all the connections kept by the others fails with EBUSY
+  instead of waiting, as they are given back only when those threads exit.
+*/
+#define VAPI_CORE_POOL_PER_THREAD (0x00000001)
+
+
+//=============================================================================
+// Global Function/Variable Prototypes
+//=============================================================================
+
+/*!
+  \brief
+  "vapi_core_pool_open()" creates a pool of connections to the sub process
+  listening on "dstport", and establishes "min_num" connections in advance.
+  Each of them is warmed up by a round trip, so that the first call costs as
+  much as the following ones. The pool grows up to "max_num" connections on
+  demand, and shrinks back to "min_num" when connections stay idle.
+  A thread of the pool pings the connections idle for a second, reconnects
+  the broken ones and keeps "min_num" of them while the sub is up.
+  Unlike vapi_core_open(), it never waits for the sub process: it fails if
+  the sub is not listening, and so does a call needing a new connection.
+  If a pool for "dstport" is already opened, it is shared and the other
+  parameters are ignored.
+
+  \param[in] dstport
+  The destination port number listened by the sub process.
+
+  \param[in] min_num
+  The number of connections to be kept.
+
+  \param[in] max_num
+  The maximum number of connections. Callers wait if all are in use, except
+  with VAPI_CORE_POOL_PER_THREAD.
+
+  \param[in] flags
+  0 or VAPI_CORE_POOL_PER_THREAD.
+
+  \return
+  It returns a pool descriptor. If error happened, -1 will return.
+*/
+int32_t vapi_core_pool_open(uint16_t dstport, uint32_t min_num, uint32_t max_num, uint32_t flags);
+
+
+/*!
+  \brief
+  "vapi_core_pool_close()" releases the pool. The connections are closed
+  when the last user of the pool releases it, including those still kept by
+  threads with VAPI_CORE_POOL_PER_THREAD.
+  The connections got by vapi_core_pool_get() must be put back before.
+
+  \param[in] pool
+  The pool descriptor.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_pool_close(int32_t pool);
+
+
+/*!
+  \brief
+  "vapi_core_pool_get()" borrows a connection from the pool. Connections idle
+  for a while are health-checked before being handed out.
+
+  \param[in] pool
+  The pool descriptor.
+
+  \return
+  It returns a descriptor available for vapi_core_invoke(). If error
+  happened, -1 will return.
+*/
+int32_t vapi_core_pool_get(int32_t pool);
+
+
+/*!
+  \brief
+  "vapi_core_pool_put()" gives back the connection got by vapi_core_pool_get().
+
+  \param[in] pool
+  The pool descriptor.
+
+  \param[in] fd
+  The descriptor got by vapi_core_pool_get().
+
+  \param[in] err_code
+  The result of the last vapi_core_invoke() on the connection. If not 0 by a
+  failure of the connection itself, it is discarded as out of sync. An error
+  replied by the sub, such as that of its handler or of its admission
+  limits, keeps the connection in the pool.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_pool_put(int32_t pool, int32_t fd, int32_t err_code);
+
+
+/*!
+  \brief
+  "vapi_core_pool_invoke()" is the same as vapi_core_invoke() except that it
+  runs on a connection of the pool.
+
+  \param[in] pool
+  The pool descriptor.
+
+  \param[in] api_id
+  The API function ID to be executed.
+
+  \param[in,out] p_arg
+  The pointer to the arguments.
+
+  \param[in] arg_len
+  The length of the arguments.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_pool_invoke(int32_t pool, int32_t api_id, void* p_arg, uint32_t arg_len);
+
+#endif // _VAPI_CORE_POOL_H_
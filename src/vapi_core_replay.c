@@ -0,0 +1,517 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core.h"
+#include "vapi_core_capture.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_REPLAY][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_REPLAY][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#define REPLAY_DRAIN_MS (10*1000) /* waits for the outstanding replies at most */
+
+/* a recorded request, and its replay */
+typedef struct
+{
+    vapi_core_capture_rec_t rec;
+    uint8_t *p_payload;
+    uint8_t *p_arg;
+    uint64_t send_ns;     /* when it was due, so that a late send counts in the latency */
+    uint64_t lat_ns;
+    int32_t err_code;
+} replay_req_t;
+
+typedef struct
+{
+    replay_req_t *p_reqs;
+    size_t num, cap;
+} replay_file_t;
+
+/* the requests of a recorded connection, replayed by a thread over a connection */
+typedef struct
+{
+    uint32_t conn;
+    replay_req_t **pp_reqs;
+    size_t num, cap;
+    size_t done;
+    int error;
+    pthread_t thrd;
+} replay_conn_t;
+
+typedef struct
+{
+    int32_t api_id;
+    uint64_t *p_a, *p_b;  /* latencies */
+    size_t a_num, b_num, cap_a, cap_b;
+    size_t a_failed, b_failed;
+} replay_stat_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static uint16_t replay_port;
+static double replay_speed = 1.0;
+static int replay_transport;    /* compares with the recorded latencies, which exclude the transport */
+static uint64_t replay_start_ns;
+
+static uint64_t replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int load_file(const char *p_path, replay_file_t *p_file_out)
+{
+    int line = 0;
+    FILE *p_file = NULL;
+    vapi_core_capture_hdr_t hdr;
+    replay_req_t *p_req;
+
+    memset(p_file_out, 0, sizeof(*p_file_out));
+
+    p_file = fopen(p_path, "rb");
+    if( !p_file ){ line = __LINE__; goto _err_end_; }
+
+    if( fread(&hdr, sizeof(hdr), 1, p_file) != 1 ){ line = __LINE__; goto _err_end_; }
+    if( hdr.magic != VAPI_CORE_CAPTURE_MAGIC  ||  hdr.version != VAPI_CORE_CAPTURE_VERSION  ||
+        hdr.rec_size != sizeof(vapi_core_capture_rec_t) ){ line = __LINE__; goto _err_end_; }
+
+    while( 1 ){
+        if( p_file_out->num == p_file_out->cap ){
+            replay_req_t *p_new;
+            p_file_out->cap = p_file_out->cap ? p_file_out->cap * 2 : 4096;
+            p_new = realloc(p_file_out->p_reqs, p_file_out->cap * sizeof(replay_req_t));
+            if( !p_new ){ line = __LINE__; goto _err_end_; }
+            p_file_out->p_reqs = p_new;
+        }
+        p_req = &p_file_out->p_reqs[ p_file_out->num ];
+        memset(p_req, 0, sizeof(*p_req));
+
+        // a record cut by a crash of the sub is dropped
+        if( fread(&p_req->rec, sizeof(p_req->rec), 1, p_file) != 1 ) break;
+        if( p_req->rec.flags & VAPI_CORE_CAPTURE_REC_PAYLOAD ){
+            p_req->p_payload = malloc(p_req->rec.arg_len);
+            if( !p_req->p_payload ){ line = __LINE__; goto _err_end_; }
+            if( fread(p_req->p_payload, p_req->rec.arg_len, 1, p_file) != 1 ){ free(p_req->p_payload); break; }
+        }
+        p_file_out->num++;
+    }
+
+    fclose(p_file);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d, path=%s\n", line, p_path);
+
+    if( p_file ) fclose(p_file);
+
+    return -1;
+}
+
+static void free_file(replay_file_t *p_file)
+{
+    size_t i;
+
+    for(i=0; i<p_file->num; ++i){
+        if( p_file->p_reqs[i].p_payload ) free(p_file->p_reqs[i].p_payload);
+        if( p_file->p_reqs[i].p_arg ) free(p_file->p_reqs[i].p_arg);
+    }
+    free(p_file->p_reqs);
+}
+
+static int compare_ts(const void *p_a, const void *p_b)
+{
+    const replay_req_t *a = *(replay_req_t* const*)p_a;
+    const replay_req_t *b = *(replay_req_t* const*)p_b;
+
+    if( a->rec.ts_ns != b->rec.ts_ns ) return a->rec.ts_ns < b->rec.ts_ns ? -1 : 1;
+    return 0;
+}
+
+static int compare_u64(const void *p_a, const void *p_b)
+{
+    uint64_t a = *(const uint64_t*)p_a, b = *(const uint64_t*)p_b;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static int push_ptr(void ***ppp_array, size_t *p_num, size_t *p_cap, void *p)
+{
+    if( *p_num == *p_cap ){
+        void **pp_new;
+        *p_cap = *p_cap ? *p_cap * 2 : 64;
+        pp_new = realloc(*ppp_array, *p_cap * sizeof(void*));
+        if( !pp_new ) return -1;
+        *ppp_array = pp_new;
+    }
+    (*ppp_array)[ (*p_num)++ ] = p;
+    return 0;
+}
+
+static int push_u64(uint64_t **pp_array, size_t *p_num, size_t *p_cap, uint64_t val)
+{
+    if( *p_num == *p_cap ){
+        uint64_t *p_new;
+        *p_cap = *p_cap ? *p_cap * 2 : 64;
+        p_new = realloc(*pp_array, *p_cap * sizeof(uint64_t));
+        if( !p_new ) return -1;
+        *pp_array = p_new;
+    }
+    (*pp_array)[ (*p_num)++ ] = val;
+    return 0;
+}
+
+static void replay_done(int32_t fd, int32_t err_code, void *p_arg, uint32_t arg_len, void *p_cookie)
+{
+    replay_req_t *p_req = (replay_req_t*)p_cookie;
+
+    (void)fd; (void)p_arg; (void)arg_len;
+
+    p_req->lat_ns = replay_now() - p_req->send_ns;
+    p_req->err_code = err_code;
+}
+
+/* waits for the replies until "until_ns", or one of them if 0 */
+static int replay_wait(int32_t fd, replay_conn_t *p_conn, uint64_t until_ns)
+{
+    struct pollfd pfd;
+    uint64_t now;
+    int timeout_ms, ret;
+
+    do{
+        now = replay_now();
+        if( until_ns  &&  now >= until_ns ) return 0;
+        timeout_ms = until_ns ? (int)((until_ns - now + 999999) / 1000000) : REPLAY_DRAIN_MS;
+
+        if( vapi_core_get_pollfd(fd, &pfd.fd, &pfd.events) != 0 ) return -1;
+        ret = poll(&pfd, 1, timeout_ms);
+        if( ret < 0  &&  errno != EINTR ) return -1;
+        if( ret == 0  &&  !until_ns ) return -1;
+        if( ret > 0 ){
+            ret = vapi_core_process(fd);
+            if( ret < 0 ) return -1;
+            p_conn->done += ret;
+            if( !until_ns  &&  ret > 0 ) return 0;
+        }
+    }while( 1 );
+}
+
+/* issues the requests at their recorded time without waiting for the replies */
+static void* replay_thread(replay_conn_t *p_conn)
+{
+    int line = 0;
+    int32_t fd;
+    replay_req_t *p_req;
+    uint64_t at_ns = 0;
+    size_t i;
+
+    fd = vapi_core_open(replay_port);
+    if( fd == -1 ){ line = __LINE__; goto _err_end_; }
+
+    for(i=0; i<p_conn->num; ++i){
+        p_req = p_conn->pp_reqs[i];
+
+        if( replay_speed > 0 ){
+            at_ns = replay_start_ns + (uint64_t)(p_req->rec.ts_ns / replay_speed);
+            if( replay_wait(fd, p_conn, at_ns) != 0 ){ line = __LINE__; goto _err_end_; }
+        }
+
+        // the arguments of a capture without payload are zeros
+        p_req->p_arg = calloc(1, p_req->rec.arg_len ? p_req->rec.arg_len : 1);
+        if( !p_req->p_arg ){ line = __LINE__; goto _err_end_; }
+        if( p_req->p_payload ) memcpy(p_req->p_arg, p_req->p_payload, p_req->rec.arg_len);
+
+        // from the scheduled time rather than the actual one, or the requests
+        // delayed by a slow sub would hide its stall (coordinated omission)
+        p_req->send_ns = at_ns ? at_ns : replay_now();
+        if( p_req->rec.flags & VAPI_CORE_CAPTURE_REC_ONEWAY ){
+            // no reply, the latency is of handing it to the socket after the queued calls
+            while( vapi_core_invoke_oneway(fd, p_req->rec.api_id, p_req->p_arg, p_req->rec.arg_len) != 0 ){
+                if( errno != EBUSY  ||  replay_wait(fd, p_conn, replay_now() + 1000000) != 0 ){ line = __LINE__; goto _err_end_; }
+            }
+            replay_done(fd, 0, NULL, 0, p_req);
+            p_conn->done++;
+            continue;
+        }
+        if( vapi_core_invoke_async_flags(fd, p_req->rec.api_id, p_req->p_arg, p_req->rec.arg_len,
+                                         (p_req->rec.flags & VAPI_CORE_CAPTURE_REC_UNORDERED) ? VAPI_CORE_INVOKE_UNORDERED : 0,
+                                         replay_done, p_req) != 0 ){ line = __LINE__; goto _err_end_; }
+    }
+
+    while( p_conn->done < p_conn->num ){
+        if( replay_wait(fd, p_conn, 0) != 0 ){ line = __LINE__; goto _err_end_; }
+    }
+
+    vapi_core_close(fd);
+
+    return NULL;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d, conn=%u\n", line, p_conn->conn);
+
+    // the outstanding calls are completed with error
+    if( fd != -1 ) vapi_core_close(fd);
+    p_conn->error = 1;
+
+    return NULL;
+}
+
+static replay_stat_t* find_stat(replay_stat_t **pp_stats, size_t *p_num, int32_t api_id)
+{
+    replay_stat_t *p_new;
+    size_t i;
+
+    for(i=0; i<*p_num; ++i)
+      if( (*pp_stats)[i].api_id == api_id ) return &(*pp_stats)[i];
+
+    p_new = realloc(*pp_stats, (*p_num + 1) * sizeof(replay_stat_t));
+    if( !p_new ) return NULL;
+    *pp_stats = p_new;
+    memset(&p_new[*p_num], 0, sizeof(replay_stat_t));
+    p_new[*p_num].api_id = api_id;
+
+    return &p_new[ (*p_num)++ ];
+}
+
+static double percentile(uint64_t *p_lat, size_t num, int pct)
+{
+    if( num == 0 ) return 0;
+    return p_lat[ (num - 1) * pct / 100 ] / 1000.0;
+}
+
+/* prints the latencies "b" of each api_id, and their deltas from "a" unless "p_a" is NULL */
+static void print_stats(replay_stat_t *p_stats, size_t num, const char *p_a, const char *p_b)
+{
+    double a50, a99, b50, b99;
+    size_t i;
+
+    if( p_a ){
+        printf("%10s %8s | %10s %10s | %10s %10s | %10s %10s | %s\n", "api_id", "num",
+               p_a, "p99 us", p_b, "p99 us", "p50 delta", "p99 delta", "failed a/b");
+    } else {
+        printf("%10s %8s | %10s %10s | %s\n", "api_id", "num", p_b, "p99 us", "failed");
+    }
+    for(i=0; i<num; ++i){
+        qsort(p_stats[i].p_a, p_stats[i].a_num, sizeof(uint64_t), compare_u64);
+        qsort(p_stats[i].p_b, p_stats[i].b_num, sizeof(uint64_t), compare_u64);
+        a50 = percentile(p_stats[i].p_a, p_stats[i].a_num, 50);
+        a99 = percentile(p_stats[i].p_a, p_stats[i].a_num, 99);
+        b50 = percentile(p_stats[i].p_b, p_stats[i].b_num, 50);
+        b99 = percentile(p_stats[i].p_b, p_stats[i].b_num, 99);
+
+        if( !p_a ){
+            printf("%10d %8zu | %10.1f %10.1f | %zu\n", p_stats[i].api_id, p_stats[i].b_num, b50, b99, p_stats[i].b_failed);
+            free(p_stats[i].p_a);
+            free(p_stats[i].p_b);
+            continue;
+        }
+        printf("%10d %8zu | %10.1f %10.1f | %10.1f %10.1f | %+9.1f%% %+9.1f%% | %zu/%zu\n",
+               p_stats[i].api_id, p_stats[i].b_num, a50, a99, b50, b99,
+               a50 > 0 ? (b50 - a50) * 100 / a50 : 0, a99 > 0 ? (b99 - a99) * 100 / a99 : 0,
+               p_stats[i].a_failed, p_stats[i].b_failed);
+
+        free(p_stats[i].p_a);
+        free(p_stats[i].p_b);
+    }
+    free(p_stats);
+}
+
+/*
+  replays the capture against the sub, and reports the latencies seen by the
+  host. They include the transport, which the recorded ones do not, so they
+  are compared with the recorded only by "-t": the like-for-like comparison is
+  of the capture of the replay by the sub, by "-d".
+*/
+static int replay(const char *p_path)
+{
+    int line = 0;
+    replay_file_t file;
+    replay_conn_t *p_conns = NULL, *p_conn;
+    replay_stat_t *p_stats = NULL, *p_stat;
+    size_t conn_num = 0, stat_num = 0, i, j;
+    int error = 0;
+
+    if( load_file(p_path, &file) != 0 ){ line = __LINE__; goto _err_end_; }
+
+    // the requests of each recorded connection, in the order of the arrival
+    for(i=0; i<file.num; ++i){
+        for(j=0; j<conn_num; ++j)
+          if( p_conns[j].conn == file.p_reqs[i].rec.conn ) break;
+        if( j == conn_num ){
+            p_conn = realloc(p_conns, (conn_num + 1) * sizeof(replay_conn_t));
+            if( !p_conn ){ line = __LINE__; goto _err_end_; }
+            p_conns = p_conn;
+            memset(&p_conns[conn_num], 0, sizeof(replay_conn_t));
+            p_conns[conn_num++].conn = file.p_reqs[i].rec.conn;
+        }
+        if( push_ptr((void***)&p_conns[j].pp_reqs, &p_conns[j].num, &p_conns[j].cap, &file.p_reqs[i]) != 0 ){ line = __LINE__; goto _err_end_; }
+    }
+    for(j=0; j<conn_num; ++j)
+      qsort(p_conns[j].pp_reqs, p_conns[j].num, sizeof(replay_req_t*), compare_ts);
+
+    LOG_MSG("replaying %zu requests over %zu connections at %gx.\n", file.num, conn_num, replay_speed);
+
+    replay_start_ns = replay_now();
+    for(j=0; j<conn_num; ++j){
+        if( pthread_create(&p_conns[j].thrd, NULL, (void*)replay_thread, &p_conns[j]) != 0 ){
+            conn_num = j;
+            error = 1;
+            break;
+        }
+    }
+    for(j=0; j<conn_num; ++j){
+        pthread_join(p_conns[j].thrd, NULL);
+        if( p_conns[j].error ) error = 1;
+    }
+
+    LOG_MSG("replayed in %.3f s (recorded %.3f s).\n", (replay_now() - replay_start_ns) / 1e9,
+            file.num ? file.p_reqs[file.num - 1].rec.ts_ns / 1e9 : 0.0);
+
+    for(i=0; i<file.num; ++i){
+        p_stat = find_stat(&p_stats, &stat_num, file.p_reqs[i].rec.api_id);
+        if( !p_stat ){ line = __LINE__; goto _err_end_; }
+        if( replay_transport ){
+            if( push_u64(&p_stat->p_a, &p_stat->a_num, &p_stat->cap_a, file.p_reqs[i].rec.lat_ns) != 0 ){ line = __LINE__; goto _err_end_; }
+            if( file.p_reqs[i].rec.err_code != 0 ) p_stat->a_failed++;
+        }
+        if( !file.p_reqs[i].send_ns ) continue;
+        if( push_u64(&p_stat->p_b, &p_stat->b_num, &p_stat->cap_b, file.p_reqs[i].lat_ns) != 0 ){ line = __LINE__; goto _err_end_; }
+        if( file.p_reqs[i].err_code != 0 ) p_stat->b_failed++;
+    }
+
+    print_stats(p_stats, stat_num, replay_transport ? "record p50" : NULL, "replay p50");
+
+    for(j=0; j<conn_num; ++j) free(p_conns[j].pp_reqs);
+    free(p_conns);
+    free_file(&file);
+
+    return error ? -1 : 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    return -1;
+}
+
+/* compares the latencies recorded by two captures of the same traffic, such as a replay */
+static int diff(const char *p_path_a, const char *p_path_b)
+{
+    int line = 0;
+    replay_file_t file[2];
+    replay_stat_t *p_stats = NULL, *p_stat;
+    size_t stat_num = 0, i;
+    int k;
+
+    if( load_file(p_path_a, &file[0]) != 0 ){ line = __LINE__; goto _err_end_; }
+    if( load_file(p_path_b, &file[1]) != 0 ){ line = __LINE__; goto _err_end_; }
+
+    for(k=0; k<2; ++k){
+        for(i=0; i<file[k].num; ++i){
+            const vapi_core_capture_rec_t *p_rec = &file[k].p_reqs[i].rec;
+
+            p_stat = find_stat(&p_stats, &stat_num, p_rec->api_id);
+            if( !p_stat ){ line = __LINE__; goto _err_end_; }
+            if( k == 0 ){
+                if( push_u64(&p_stat->p_a, &p_stat->a_num, &p_stat->cap_a, p_rec->lat_ns) != 0 ){ line = __LINE__; goto _err_end_; }
+                if( p_rec->err_code != 0 ) p_stat->a_failed++;
+            } else {
+                if( push_u64(&p_stat->p_b, &p_stat->b_num, &p_stat->cap_b, p_rec->lat_ns) != 0 ){ line = __LINE__; goto _err_end_; }
+                if( p_rec->err_code != 0 ) p_stat->b_failed++;
+            }
+        }
+    }
+
+    print_stats(p_stats, stat_num, "a p50 us", "b p50 us");
+
+    free_file(&file[0]);
+    free_file(&file[1]);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    return -1;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int main(int argc, char *argv[])
+{
+    if( argc == 4  &&  strcmp(argv[1], "-d") == 0 ){
+        return diff(argv[2], argv[3]);
+    }
+
+    if( argc > 1  &&  strcmp(argv[1], "-t") == 0 ){
+        replay_transport = 1;
+        argc--;
+        argv++;
+    }
+
+    if( argc < 3  ||  argc > 4 ){
+        fprintf(stderr, "usage: %s [-t] <capture file> <port> [speed]\n", argv[0]);
+        fprintf(stderr, "         replays the capture against the sub listening on the port,\n");
+        fprintf(stderr, "         at \"speed\" times the recorded rate (1 by default, 0 for no wait),\n");
+        fprintf(stderr, "         and prints the latencies from the scheduled sends. \"-t\" compares\n");
+        fprintf(stderr, "         them with the recorded, which do not include the transport.\n");
+        fprintf(stderr, "       %s -d <capture file a> <capture file b>\n", argv[0]);
+        fprintf(stderr, "         compares the latencies of two captures like for like, such as of\n");
+        fprintf(stderr, "         the recorded traffic and of its replay captured by the sub.\n");
+        return -1;
+    }
+
+    replay_port = (uint16_t)atoi(argv[2]);
+    if( argc == 4 ) replay_speed = atof(argv[3]);
+    if( replay_port == 0  ||  replay_speed < 0 ){
+        fprintf(stderr, "invalid port or speed.\n");
+        return -1;
+    }
+
+    return replay(argv[1]);
+}
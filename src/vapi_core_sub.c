@@ -31,11 +31,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //=============================================================================
 #include "vapi_core_local.h"
 #include "vapi_core_sub.h"
+#include "vapi_core_capture.h"
+#include "vapi_core_trace.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -43,6 +46,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <arpa/inet.h>
 #include <errno.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
 
 
 //=============================================================================
@@ -53,259 +66,2321 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_SUB][ERR][%s] " fmt, __FUNCTION__, ##args)
 #define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
 
+#define _VAPI_CORE_SUB_EVENT_QUEUE_LEN (64)             /* per subscriber */
+#define _VAPI_CORE_SUB_RING_SIZE       (4*1024*1024)   /* broadcast ring */
+#define _VAPI_CORE_SUB_RX_BUF_MIN      (_VAPI_CORE_HUGE_PAGE_SIZE) /* arguments received into rx_buf */
+#define _VAPI_CORE_SUB_FLIGHT_BUCKETS  (64)             /* hash table of the coalesced requests */
+#define _VAPI_CORE_SUB_CONTROL_LEN_MAX (256)            /* arguments of the reserved api_ids */
+#define _VAPI_CORE_SUB_API_COUNT_NUM   (256)            /* api_ids counted apart, the others together */
+#define _VAPI_CORE_SUB_METRICS_TIMEOUT (1000)           /* msec to serve a scrape */
+
+/* An event serialized once and shared by the queues of all subscribers. */
 typedef struct
 {
+    volatile int ref;
+    uint32_t len;
+    uint8_t buf[]; /* _vapi_core_hdr_t + _vapi_core_event_t [+ payload] */
+} _vapi_core_sub_event_t;
+
+typedef struct __vapi_core_sub_child_t _vapi_core_sub_child_t;
+typedef struct __vapi_core_sub_t _vapi_core_sub_t;
+typedef struct __vapi_core_sub_flight_t _vapi_core_sub_flight_t;
+typedef struct __vapi_core_sub_request_t _vapi_core_sub_request_t;
+
+/* A coalesced request being handled, whose identical requests wait for its reply. */
+struct __vapi_core_sub_flight_t
+{
+    uint64_t hash;
     int32_t api_id;
     uint32_t arg_len;
-    int err_code, errsv;
-} _vapi_core_hdr_t;
+    uint8_t *p_key;                        /* the arguments as received */
+    int32_t *p_waiters;                    /* tokens of the deferred identical requests */
+    uint32_t waiter_num, waiter_max;
+    _vapi_core_sub_flight_t *p_next;
+};
+
+/* The requests of an api_id, updated without locks. */
+typedef struct
+{
+    volatile int32_t api_id;               /* -1 if not used yet */
+    volatile uint64_t calls, errors;
+} _vapi_core_sub_api_count_t;
+
+/* A listening socket and its accept thread. */
+typedef struct
+{
+    int sock;
+    pthread_t thrd;
+    int thrd_started;
+    _vapi_core_sub_t *p_sub;
+} _vapi_core_sub_listener_t;
+
+struct __vapi_core_sub_t
+{
+    volatile int ref;                      /* the descriptor + the children */
+    _vapi_core_sub_t *p_registry_next;     /* in _vapi_core_sub_registry if "local_call" */
+    _vapi_core_sub_listener_t *p_lsn;      /* SO_REUSEPORT shards of the same port */
+    int lsn_num;
+    int thrd_alive;
+    vapi_core_sub_handler_t handler;
+    void *p_cookie;
+    uint16_t port;
+    int wake_fd;                           /* eventfd to stop the accept and the metrics threads */
+
+    /* transports offered by _VAPI_CORE_API_ID_HELLO besides TCP */
+    int unix_socket, shm;
+    char unix_name[_VAPI_CORE_RING_NAME_LEN]; /* abstract, the last of p_lsn if "unix_socket" */
+
+    /* admission control, no limit if 0 */
+    uint32_t max_conn, max_inflight;
+    uint64_t max_buffered, max_conn_buffered;
+    volatile uint32_t inflight;
+    volatile uint64_t buffered, buffered_peak, conn_buffered_peak;
+    volatile uint64_t refused, rejected_busy, rejected_nobufs;
+
+    /* metrics endpoint, which reads the counters without locks */
+    int metrics_sock;
+    char *p_metrics_path;                  /* removed when closed */
+    pthread_t metrics_thrd;
+    int metrics_started;
+    volatile uint32_t work_depth, ev_thrd_num;
+    _vapi_core_sub_api_count_t api_counts[_VAPI_CORE_SUB_API_COUNT_NUM + 1]; /* the last for the others */
+
+    /* single-flight of the coalesced api_ids */
+    int32_t *p_coalesce_ids;
+    uint32_t coalesce_num;
+    pthread_mutex_t flight_lock;
+    _vapi_core_sub_flight_t *flights[_VAPI_CORE_SUB_FLIGHT_BUCKETS];
+
+    /* the memory of the arguments provided by the user */
+    vapi_core_sub_provider_t provider;
+    vapi_core_sub_provider_release_t provider_release; /* NULL if the user frees them */
+    int32_t *p_provider_ids;
+    uint32_t provider_num;
+
+    /* capture of the requests by vapi_core_sub_capture_start() */
+    volatile int capture_on;
+    uint32_t capture_flags;
+    uint64_t capture_start_ns;
+    pthread_mutex_t capture_lock;          /* protects p_capture */
+    FILE *p_capture;
+
+    /* direct calls from vapi_core_open() of the same process */
+    int local_call;
+    volatile int local_closed;
+    volatile uint32_t local_running;       /* handlers being called directly */
+    volatile uint32_t local_num;
+
+    /* workers of the unordered requests */
+    pthread_t *p_workers;
+    int worker_num;
+    pthread_mutex_t work_lock;             /* protects the followings */
+    pthread_cond_t  work_cond;
+    _vapi_core_sub_request_t *p_work_head, *p_work_tail;
+    int work_alive;
+
+    pthread_mutex_t lock;                  /* protects the followings */
+    pthread_cond_t  child_cond;            /* signaled when a child leaves the list */
+    _vapi_core_sub_child_t *p_child_list;
+    volatile uint32_t child_num;           /* read by the metrics without the lock */
+    volatile uint32_t conn_seq;            /* numbers the connections */
+    int ring_fd;
+    _vapi_core_ring_hdr_t *p_ring;
+    char ring_name[_VAPI_CORE_RING_NAME_LEN];
+};
+
+struct __vapi_core_sub_child_t
+{
+    volatile int ref;                      /* the child thread + deferred requests */
+    int sock;
+    int is_unix;                           /* accepted by the unix listener */
+    int verified;                          /* of a unix socket, by the nonce of _VAPI_CORE_API_ID_HELLO */
+    uint16_t peer_port;                    /* of a TCP socket, protected by p_sub->lock with "nonce" */
+    uint64_t nonce;                        /* given to the host over TCP, for its unix HELLO */
+    vapi_core_sub_handler_t handler;
+    void *p_cookie;
+
+    _vapi_core_sub_t *p_sub;               /* set before the child thread starts, never changed */
+    _vapi_core_sub_child_t *p_next;
+    pthread_mutex_t send_lock;             /* serializes replies and events */
+    uint32_t conn_id;                      /* p_sub->conn_seq when accepted */
+
+    /* a direct caller of the same process without the socket, which waits for
+       the reply of its deferred request by local_cond with send_lock */
+    int local;
+    pthread_cond_t local_cond;
+    int local_done;
+    _vapi_core_hdr_t local_hdr;
+
+    /* subscriptions, protected by p_sub->lock */
+    int32_t topics[_VAPI_CORE_TOPIC_MAX];
+    int topic_num;
+    int use_ring;
+
+    /* argument region of the host, mapped by _VAPI_CORE_API_ID_SHM_ATTACH */
+    uint8_t *p_shm;
+    uint32_t shm_size;
+    int rx_fd;                             /* the memfd received with its argument, -1 if none */
+
+    /* bytes of the arguments buffered for the requests being handled */
+    volatile uint64_t buffered;
+
+    /* one-way requests failed since the last _VAPI_CORE_API_ID_BARRIER */
+    volatile uint32_t oneway_failed;
+
+    /* receive buffer of large arguments kept over the requests, on hugepages if possible,
+       unless "max_buffered" or "max_conn_buffered" limits the memory */
+    char *p_rx_buf;
+    size_t rx_buf_len;
+
+    /* bounded event queue, protected by ev_lock */
+    pthread_mutex_t ev_lock;
+    pthread_cond_t  ev_cond;
+    _vapi_core_sub_event_t *ev_queue[_VAPI_CORE_SUB_EVENT_QUEUE_LEN];
+    uint32_t ev_rd, ev_wr, ev_dropped;
+    int ev_alive;
+    pthread_t ev_thrd;
+
+#ifdef VAPI_CORE_TRACE
+    uint16_t trace_conn;
+    uint32_t trace_seq;
+#endif
+};
+
+/* A request being handled, which is deferred by vapi_core_sub_defer() or queued to the workers. */
+struct __vapi_core_sub_request_t
+{
+    _vapi_core_sub_child_t *p_child;
+    _vapi_core_hdr_t hdr;
+    char *p_arg;
+    size_t buf_len;       /* mapped length if p_arg is a receive buffer of the child, 0 if malloc()ed */
+    int provided;         /* p_arg is of the provider, given back to its release function */
+    _vapi_core_sub_flight_t *p_flight; /* led by this request */
+    int32_t token;
+    _vapi_core_sub_request_t *p_next;     /* in the work queue */
+    uint64_t arrive_ns;   /* if captured, 0 if not */
+    uint8_t *p_capture;   /* the arguments as received, if captured with the payload */
+#ifdef VAPI_CORE_TRACE
+    uint32_t seq;
+#endif
+};
+
+/* the request whose handler is running on the calling thread */
+static __thread _vapi_core_sub_request_t *_vapi_core_sub_current = NULL;
+
+/* the subs of this process, which vapi_core_open() calls directly */
+static pthread_mutex_t _vapi_core_sub_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static _vapi_core_sub_t *_vapi_core_sub_registry = NULL;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static void _vapi_core_sub_event_unref(_vapi_core_sub_event_t *p_ev)
+{
+    if( __sync_sub_and_fetch(&p_ev->ref, 1) == 0 ) free(p_ev);
+}
+
+static _vapi_core_sub_event_t* _vapi_core_sub_event_new(int32_t topic, const void *p_data, uint32_t len,
+                                                        uint64_t ring_pos, int in_ring)
+{
+    _vapi_core_sub_event_t *p_ev;
+    _vapi_core_hdr_t *p_hdr;
+    _vapi_core_event_t *p_body;
+    uint32_t data_len = in_ring ? 0 : len;
+
+    p_ev = malloc( sizeof(*p_ev) + sizeof(*p_hdr) + sizeof(*p_body) + data_len );
+    if( !p_ev ) return NULL;
+
+    p_ev->ref = 1;
+    p_ev->len = sizeof(*p_hdr) + sizeof(*p_body) + data_len;
+
+    p_hdr = (_vapi_core_hdr_t*)p_ev->buf;
+    memset(p_hdr, 0, sizeof(*p_hdr));
+    p_hdr->api_id = _VAPI_CORE_API_ID_EVENT;
+    p_hdr->arg_len = sizeof(*p_body) + data_len;
+    p_hdr->version = _VAPI_CORE_VERSION;
+
+    p_body = (_vapi_core_event_t*)(p_hdr + 1);
+    memset(p_body, 0, sizeof(*p_body));
+    p_body->topic = topic;
+    p_body->len = len;
+    p_body->ring_pos = ring_pos;
+    p_body->flags = in_ring ? _VAPI_CORE_EVENT_RING : 0;
+    if( data_len ) _vapi_core_copy(p_body + 1, p_data, data_len);
+
+    return p_ev;
+}
+
+static void* _vapi_core_sub_event_thread(_vapi_core_sub_child_t *p_child)
+{
+    _vapi_core_sub_event_t *p_ev;
+    ssize_t size, len;
+
+    while( 1 ){
+        pthread_mutex_lock(&p_child->ev_lock);
+        while( p_child->ev_alive  &&  p_child->ev_rd == p_child->ev_wr )
+          pthread_cond_wait(&p_child->ev_cond, &p_child->ev_lock);
+        if( !p_child->ev_alive ){
+            pthread_mutex_unlock(&p_child->ev_lock);
+            break;
+        }
+        p_ev = p_child->ev_queue[ p_child->ev_rd % _VAPI_CORE_SUB_EVENT_QUEUE_LEN ];
+        p_child->ev_rd++;
+        pthread_mutex_unlock(&p_child->ev_lock);
+
+        len = p_ev->len;
+        pthread_mutex_lock(&p_child->send_lock);
+        size = _vapi_core_send( p_child->sock, p_ev->buf, len, MSG_NOSIGNAL );
+        pthread_mutex_unlock(&p_child->send_lock);
+        _vapi_core_sub_event_unref(p_ev);
+
+        if( size != len ){
+            ERR_MSG("failed to send an event to sock=0x%08x.\n", p_child->sock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void _vapi_core_sub_event_stop(_vapi_core_sub_child_t *p_child)
+{
+    if( !p_child->ev_thrd ) return;
+
+    pthread_mutex_lock(&p_child->ev_lock);
+    p_child->ev_alive = 0;
+    pthread_cond_signal(&p_child->ev_cond);
+    pthread_mutex_unlock(&p_child->ev_lock);
+    pthread_join(p_child->ev_thrd, NULL);
+    p_child->ev_thrd = 0;
+    __sync_sub_and_fetch(&p_child->p_sub->ev_thrd_num, 1);
+
+    for( ; p_child->ev_rd != p_child->ev_wr; p_child->ev_rd++ )
+      _vapi_core_sub_event_unref( p_child->ev_queue[ p_child->ev_rd % _VAPI_CORE_SUB_EVENT_QUEUE_LEN ] );
+
+    if( p_child->ev_dropped )
+      LOG_MSG("%u events were dropped for sock=0x%08x.\n", p_child->ev_dropped, p_child->sock);
+}
+
+static void _vapi_core_sub_event_push(_vapi_core_sub_child_t *p_child, _vapi_core_sub_event_t *p_ev)
+{
+    pthread_mutex_lock(&p_child->ev_lock);
+    if( p_child->ev_alive  &&  p_child->ev_wr - p_child->ev_rd < _VAPI_CORE_SUB_EVENT_QUEUE_LEN ){
+        __sync_add_and_fetch(&p_ev->ref, 1);
+        p_child->ev_queue[ p_child->ev_wr % _VAPI_CORE_SUB_EVENT_QUEUE_LEN ] = p_ev;
+        p_child->ev_wr++;
+        pthread_cond_signal(&p_child->ev_cond);
+    } else {
+        p_child->ev_dropped++; /* slow subscriber, never block the publisher */
+    }
+    pthread_mutex_unlock(&p_child->ev_lock);
+}
+
+/* must be called with p_sub->lock held */
+static int _vapi_core_sub_ring_create(_vapi_core_sub_t *p_sub)
+{
+    int line = 0, errsv = 0;
+    size_t map_len = sizeof(_vapi_core_ring_hdr_t) + _VAPI_CORE_SUB_RING_SIZE;
+
+    if( p_sub->p_ring ) return 0;
+
+    snprintf(p_sub->ring_name, sizeof(p_sub->ring_name), "/vapi_core.%d.%u", (int)getpid(), p_sub->port);
+    p_sub->ring_fd = shm_open(p_sub->ring_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if( p_sub->ring_fd == -1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    if( ftruncate(p_sub->ring_fd, map_len) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    p_sub->p_ring = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, p_sub->ring_fd, 0);
+    if( p_sub->p_ring == MAP_FAILED ){ p_sub->p_ring = NULL; line = __LINE__; errsv = errno; goto _err_end_; }
+
+    p_sub->p_ring->size = _VAPI_CORE_SUB_RING_SIZE;
+    p_sub->p_ring->head = 0;
+    p_sub->p_ring->magic = _VAPI_CORE_RING_MAGIC;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_sub->ring_fd >= 0 ){
+        close(p_sub->ring_fd);
+        shm_unlink(p_sub->ring_name);
+    }
+    p_sub->ring_fd = -1;
+    p_sub->ring_name[0] = '\0';
+
+    return -1;
+}
+
+static void _vapi_core_sub_ring_destroy(_vapi_core_sub_t *p_sub)
+{
+    if( !p_sub->p_ring ) return;
+
+    munmap(p_sub->p_ring, sizeof(_vapi_core_ring_hdr_t) + p_sub->p_ring->size);
+    close(p_sub->ring_fd);
+    shm_unlink(p_sub->ring_name);
+    p_sub->p_ring = NULL;
+    p_sub->ring_fd = -1;
+}
+
+/* must be called with p_sub->lock held */
+static int _vapi_core_sub_ring_write(_vapi_core_sub_t *p_sub, const void *p_data, uint32_t len, uint64_t *p_pos)
+{
+    _vapi_core_ring_hdr_t *p_ring = p_sub->p_ring;
+    uint64_t pos;
+
+    if( !p_ring  ||  len > p_ring->size / 2 ) return -1;
+
+    pos = p_ring->head;
+    if( (pos % p_ring->size) + len > p_ring->size )
+      pos += p_ring->size - (pos % p_ring->size); /* wrap to keep the payload contiguous */
+
+    p_ring->head = pos + ((len + 7) & ~7);
+    __sync_synchronize();
+    _vapi_core_copy((uint8_t*)(p_ring + 1) + (pos % p_ring->size), p_data, len);
+    __sync_synchronize();
+
+    *p_pos = pos;
+    return 0;
+}
+
+static int _vapi_core_sub_subscribe(_vapi_core_sub_child_t *p_child, _vapi_core_subscribe_t *p_arg, int on)
+{
+    int err_code = 0, line = 0, i;
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+
+    pthread_mutex_lock(&p_sub->lock);
+
+    for(i=0; i<p_child->topic_num; ++i)
+      if( p_child->topics[i] == p_arg->topic ) break;
+
+    if( on ){
+        if( i == p_child->topic_num  &&  p_child->topic_num >= _VAPI_CORE_TOPIC_MAX ){
+            pthread_mutex_unlock(&p_sub->lock);
+            line = __LINE__; goto _err_end_;
+        }
+
+        // the sender runs before vapi_core_sub_publish() sees the topic, or the first events are dropped
+        if( !p_child->ev_thrd ){
+            p_child->ev_alive = 1;
+            err_code = pthread_create( &p_child->ev_thrd, NULL, (void*)_vapi_core_sub_event_thread, (void*)p_child );
+            if( err_code!=0 ){
+                p_child->ev_alive = 0; p_child->ev_thrd = 0;
+                pthread_mutex_unlock(&p_sub->lock);
+                line = __LINE__; goto _err_end_;
+            }
+            __sync_add_and_fetch(&p_sub->ev_thrd_num, 1);
+        }
+
+        if( i == p_child->topic_num ) p_child->topics[ p_child->topic_num++ ] = p_arg->topic;
+
+        p_child->use_ring = 0;
+        if( (p_arg->flags & _VAPI_CORE_SUBSCRIBE_RING)  &&  _vapi_core_sub_ring_create(p_sub) == 0 ){
+            p_child->use_ring = 1;
+            p_arg->ring_size = p_sub->p_ring->size;
+            strncpy(p_arg->ring_name, p_sub->ring_name, sizeof(p_arg->ring_name));
+        }
+        p_arg->flags = p_child->use_ring ? _VAPI_CORE_SUBSCRIBE_RING : 0;
+    } else if( i < p_child->topic_num ){
+        p_child->topics[i] = p_child->topics[ --p_child->topic_num ];
+    }
+
+    pthread_mutex_unlock(&p_sub->lock);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    return -1;
+}
+
+static int _vapi_core_sub_shm_attach(_vapi_core_sub_child_t *p_child, _vapi_core_shm_attach_t *p_arg)
+{
+    int line = 0, errsv = 0;
+    int shm_fd = p_child->rx_fd;
+    struct stat st;
+    struct statfs stfs;
+    void *p_map;
+
+    // the memfd is the host's, not the one of a path or a name given by the peer
+    p_child->rx_fd = -1;
+    if( !p_child->p_sub->shm ){ line = __LINE__; errsv = ENOTSUP; goto _err_end_; }
+    if( p_child->p_shm ){ line = __LINE__; errsv = EBUSY; goto _err_end_; }
+
+    p_arg->name[ sizeof(p_arg->name) - 1 ] = '\0';
+    if( p_arg->flags == _VAPI_CORE_SHM_FD ){
+        if( shm_fd == -1 ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+    } else if( p_arg->flags == 0 ){
+        // over TCP, only the regions named by the hosts
+        if( strncmp(p_arg->name, _VAPI_CORE_SHM_PREFIX, strlen(_VAPI_CORE_SHM_PREFIX)) != 0  ||
+            strchr(p_arg->name + 1, '/') ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+        if( shm_fd >= 0 ){ close(shm_fd); shm_fd = -1; }
+        shm_fd = shm_open(p_arg->name, O_RDWR | O_NOFOLLOW, 0);
+        if( shm_fd == -1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    } else { line = __LINE__; errsv = EINVAL; goto _err_end_; }
+
+    // shared memory of this user, and a region shorter than announced would
+    // raise SIGBUS on the first access past its end
+    if( fstat(shm_fd, &st) == -1  ||  fstatfs(shm_fd, &stfs) == -1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    if( !S_ISREG(st.st_mode)  ||  st.st_uid != geteuid()  ||
+        (stfs.f_type != TMPFS_MAGIC  &&  stfs.f_type != HUGETLBFS_MAGIC) ){ line = __LINE__; errsv = EACCES; goto _err_end_; }
+    if( st.st_size < (off_t)p_arg->size ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+
+    p_map = mmap(NULL, p_arg->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if( p_map == MAP_FAILED ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    close(shm_fd);
+    if( stfs.f_type == TMPFS_MAGIC ) madvise(p_map, p_arg->size, MADV_HUGEPAGE);
+
+    p_child->p_shm = (uint8_t*)p_map;
+    p_child->shm_size = p_arg->size;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( shm_fd >= 0 ) close(shm_fd);
+    errno = errsv;
+
+    return -1;
+}
+
+/*
+  gets the receive buffer kept by the child for the arguments of "len" bytes.
+  It is mapped on hugepages, or aligned to them and advised for THP, so that
+  the pages are faulted in once instead of by every request.
+*/
+static char* _vapi_core_sub_rx_buf(_vapi_core_sub_child_t *p_child, uint32_t len)
+{
+    size_t map_len, head;
+    uint8_t *p_map;
+
+    if( p_child->p_rx_buf  &&  p_child->rx_buf_len >= len ) return p_child->p_rx_buf;
+
+    if( p_child->p_rx_buf ){
+        munmap(p_child->p_rx_buf, p_child->rx_buf_len);
+        p_child->p_rx_buf = NULL;
+    }
+
+    map_len = ((size_t)len + _VAPI_CORE_HUGE_PAGE_SIZE - 1) & ~((size_t)_VAPI_CORE_HUGE_PAGE_SIZE - 1);
+
+    p_map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if( p_map == MAP_FAILED ){
+        // no hugepages reserved, over-map to align for THP
+        p_map = mmap(NULL, map_len + _VAPI_CORE_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( p_map == MAP_FAILED ) return NULL;
+
+        head = (_VAPI_CORE_HUGE_PAGE_SIZE - ((uintptr_t)p_map & (_VAPI_CORE_HUGE_PAGE_SIZE - 1))) & (_VAPI_CORE_HUGE_PAGE_SIZE - 1);
+        if( head ) munmap(p_map, head);
+        munmap(p_map + head + map_len, _VAPI_CORE_HUGE_PAGE_SIZE - head);
+        p_map += head;
+        madvise(p_map, map_len, MADV_HUGEPAGE);
+    }
+
+    p_child->p_rx_buf = (char*)p_map;
+    p_child->rx_buf_len = map_len;
+
+    return p_child->p_rx_buf;
+}
+
+/* gets the memory of the arguments from the provider, NULL if the api_id is not of it */
+static char* _vapi_core_sub_provide(_vapi_core_sub_child_t *p_child, const _vapi_core_hdr_t *p_hdr)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    uint32_t i;
+
+    for(i=0; i<p_sub->provider_num; ++i){
+        if( p_sub->p_provider_ids[i] == p_hdr->api_id ){
+            return (char*)p_sub->provider(p_hdr->api_id, p_hdr->arg_len, p_child->p_cookie);
+        }
+    }
+
+    return NULL;
+}
+
+/* gives the memory back to the provider, once the request is replied or failed */
+static void _vapi_core_sub_unprovide(_vapi_core_sub_child_t *p_child, const _vapi_core_hdr_t *p_hdr, char *p_arg)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+
+    if( p_sub->provider_release ) p_sub->provider_release(p_hdr->api_id, p_arg, p_hdr->arg_len, p_child->p_cookie);
+}
+
+/* frees the arguments received by the child thread */
+static void _vapi_core_sub_arg_free(char *p_arg, size_t buf_len)
+{
+    if( buf_len ) munmap(p_arg, buf_len);
+    else free(p_arg);
+}
+
+/* releases the arguments of a request handed over by the child thread, once replied */
+static void _vapi_core_sub_req_arg_free(_vapi_core_sub_request_t *p_req)
+{
+    if( !p_req->p_arg  ||  (p_req->hdr.flags & (_VAPI_CORE_HDR_SHM | _VAPI_CORE_HDR_LOCAL)) ) return;
+
+    if( p_req->provided ) _vapi_core_sub_unprovide(p_req->p_child, &p_req->hdr, p_req->p_arg);
+    else _vapi_core_sub_arg_free(p_req->p_arg, p_req->buf_len);
+}
+
+/* a random nonce, never 0 */
+static int _vapi_core_sub_nonce(uint64_t *p_nonce)
+{
+    ssize_t size = -1;
+    int fd;
+
+#ifdef SYS_getrandom
+    size = syscall(SYS_getrandom, p_nonce, sizeof(*p_nonce), 0);
+#endif
+    if( size != sizeof(*p_nonce) ){
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if( fd == -1 ) return -1;
+        size = read(fd, p_nonce, sizeof(*p_nonce));
+        close(fd);
+        if( size != sizeof(*p_nonce) ) return -1;
+    }
+    if( *p_nonce == 0 ) *p_nonce = 1;
+
+    return 0;
+}
+
+/*
+  takes the nonce of the TCP connection of the host moving to the unix socket,
+  which is used once. It fails with EACCES unless the connection is found.
+*/
+static int _vapi_core_sub_nonce_take(_vapi_core_sub_child_t *p_child, uint32_t conn, uint64_t *p_nonce)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    _vapi_core_sub_child_t *p_tcp;
+
+    *p_nonce = 0;
+    pthread_mutex_lock(&p_sub->lock);
+    for(p_tcp = p_sub->p_child_list; p_tcp; p_tcp = p_tcp->p_next){
+        if( !p_tcp->is_unix  &&  p_tcp->nonce  &&  p_tcp->peer_port == conn ){
+            *p_nonce = p_tcp->nonce;
+            p_tcp->nonce = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p_sub->lock);
+
+    if( !*p_nonce ){ errno = EACCES; return -1; }
+
+    return 0;
+}
+
+/* tells the host what the sub supports, which picks the transport by it */
+static int _vapi_core_sub_hello(_vapi_core_sub_child_t *p_child, _vapi_core_hello_t *p_arg)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    uint64_t max = p_sub->max_conn_buffered;
+    uint64_t nonce = 0;
+
+    DBG_MSG("hello of version %u from conn %u.\n", p_arg->version, p_arg->conn);
+#ifdef VAPI_CORE_TRACE
+    // moved from the TCP connection, by which the traces of the host know it
+    if( p_arg->conn ) p_child->trace_conn = (uint16_t)p_arg->conn;
+#endif
+
+    // the unix socket is of this sub, if its nonce reached the host over TCP
+    if( p_child->is_unix ){
+        if( _vapi_core_sub_nonce_take(p_child, p_arg->conn, &nonce) != 0 ) return -1;
+        p_child->verified = 1;
+    }
+
+    // larger arguments are never admitted, which the host refuses without sending
+    if( p_sub->max_buffered  &&  (!max  ||  p_sub->max_buffered < max) ) max = p_sub->max_buffered;
+
+    memset(p_arg, 0, sizeof(*p_arg));
+    p_arg->version = _VAPI_CORE_VERSION;
+    p_arg->max_arg_len = max > UINT32_MAX ? 0 : (uint32_t)max;
+    if( p_sub->shm ) p_arg->transports |= _VAPI_CORE_TRANSPORT_SHM;
+    if( p_child->is_unix ){
+        p_arg->transports |= _VAPI_CORE_TRANSPORT_UNIX;
+        p_arg->nonce = nonce;
+    } else if( p_sub->unix_socket  &&  _vapi_core_sub_nonce(&nonce) == 0 ){
+        p_arg->transports |= _VAPI_CORE_TRANSPORT_UNIX;
+        p_arg->nonce = nonce;
+        memcpy(p_arg->unix_name, p_sub->unix_name, sizeof(p_arg->unix_name));
+
+        pthread_mutex_lock(&p_sub->lock);
+        p_child->nonce = nonce;
+        pthread_mutex_unlock(&p_sub->lock);
+    }
+
+    return 0;
+}
+
+static int _vapi_core_sub_control(_vapi_core_sub_child_t *p_child, _vapi_core_hdr_t *p_hdr, void *p_arg)
+{
+    switch( p_hdr->api_id ){
+      case _VAPI_CORE_API_ID_SUBSCRIBE:
+      case _VAPI_CORE_API_ID_UNSUBSCRIBE:
+        if( p_hdr->arg_len != sizeof(_vapi_core_subscribe_t) ) break;
+        return _vapi_core_sub_subscribe(p_child, (_vapi_core_subscribe_t*)p_arg,
+                                        p_hdr->api_id == _VAPI_CORE_API_ID_SUBSCRIBE);
+      case _VAPI_CORE_API_ID_PING:
+        return 0;
+      case _VAPI_CORE_API_ID_BARRIER:
+        // the one-way requests before it have been handled, as it is in order
+        if( p_hdr->arg_len != sizeof(uint32_t) ) break;
+        *(uint32_t*)p_arg = __sync_lock_test_and_set(&p_child->oneway_failed, 0);
+        return 0;
+      case _VAPI_CORE_API_ID_SHM_ATTACH:
+        if( p_hdr->arg_len != sizeof(_vapi_core_shm_attach_t) ) break;
+        return _vapi_core_sub_shm_attach(p_child, (_vapi_core_shm_attach_t*)p_arg);
+      case _VAPI_CORE_API_ID_HELLO:
+        if( p_hdr->arg_len != sizeof(_vapi_core_hello_t) ) break;
+        return _vapi_core_sub_hello(p_child, (_vapi_core_hello_t*)p_arg);
+      default:
+        break;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* the sub is freed when the last deferred request of its children is completed */
+static void _vapi_core_sub_unref(_vapi_core_sub_t *p_sub)
+{
+    if( __sync_sub_and_fetch(&p_sub->ref, 1) != 0 ) return;
+
+    pthread_mutex_destroy(&p_sub->lock);
+    pthread_cond_destroy(&p_sub->child_cond);
+    pthread_mutex_destroy(&p_sub->flight_lock);
+    pthread_mutex_destroy(&p_sub->work_lock);
+    pthread_mutex_destroy(&p_sub->capture_lock);
+    pthread_cond_destroy(&p_sub->work_cond);
+    if( p_sub->p_workers ) free(p_sub->p_workers);
+    if( p_sub->p_coalesce_ids ) free(p_sub->p_coalesce_ids);
+    if( p_sub->p_provider_ids ) free(p_sub->p_provider_ids);
+    if( p_sub->p_metrics_path ) free(p_sub->p_metrics_path);
+    free(p_sub->p_lsn);
+    free(p_sub);
+}
+
+static void _vapi_core_sub_peak(volatile uint64_t *p_peak, uint64_t val)
+{
+    uint64_t peak = *p_peak;
+
+    while( val > peak ){
+        if( __sync_bool_compare_and_swap(p_peak, peak, val) ) break;
+        peak = *p_peak;
+    }
+}
+
+/*
+  admits a request of the child with "len" bytes to be buffered, or returns
+  the reason of the rejection. It is decided before the arguments are
+  received, so that a rejected request never allocates them.
+*/
+static int _vapi_core_sub_admit(_vapi_core_sub_child_t *p_child, uint32_t len)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    uint32_t inflight;
+    uint64_t buffered, conn_buffered;
+
+    inflight = __sync_add_and_fetch(&p_sub->inflight, 1);
+    if( p_sub->max_inflight  &&  inflight > p_sub->max_inflight ){
+        __sync_sub_and_fetch(&p_sub->inflight, 1);
+        __sync_add_and_fetch(&p_sub->rejected_busy, 1);
+        return EBUSY;
+    }
+
+    if( !len ) return 0;
+
+    conn_buffered = __sync_add_and_fetch(&p_child->buffered, (uint64_t)len);
+    buffered = __sync_add_and_fetch(&p_sub->buffered, (uint64_t)len);
+    if( (p_sub->max_conn_buffered  &&  conn_buffered > p_sub->max_conn_buffered)  ||
+        (p_sub->max_buffered  &&  buffered > p_sub->max_buffered) ){
+        __sync_sub_and_fetch(&p_child->buffered, (uint64_t)len);
+        __sync_sub_and_fetch(&p_sub->buffered, (uint64_t)len);
+        __sync_sub_and_fetch(&p_sub->inflight, 1);
+        __sync_add_and_fetch(&p_sub->rejected_nobufs, 1);
+        return ENOBUFS;
+    }
+
+    _vapi_core_sub_peak(&p_sub->buffered_peak, buffered);
+    _vapi_core_sub_peak(&p_sub->conn_buffered_peak, conn_buffered);
+
+    return 0;
+}
+
+static void _vapi_core_sub_release(_vapi_core_sub_child_t *p_child, uint32_t len)
+{
+    __sync_sub_and_fetch(&p_child->p_sub->inflight, 1);
+    if( len ){
+        __sync_sub_and_fetch(&p_child->buffered, (uint64_t)len);
+        __sync_sub_and_fetch(&p_child->p_sub->buffered, (uint64_t)len);
+    }
+}
+
+/* counts the completed request by its api_id, whose slot is taken at the first call */
+static void _vapi_core_sub_count(_vapi_core_sub_t *p_sub, const _vapi_core_hdr_t *p_hdr)
+{
+    _vapi_core_sub_api_count_t *p_count = &p_sub->api_counts[_VAPI_CORE_SUB_API_COUNT_NUM];
+    uint32_t i, idx;
+
+    for(i=0; i<_VAPI_CORE_SUB_API_COUNT_NUM; ++i){
+        idx = ((uint32_t)p_hdr->api_id + i) % _VAPI_CORE_SUB_API_COUNT_NUM;
+        if( p_sub->api_counts[idx].api_id == p_hdr->api_id  ||
+            (p_sub->api_counts[idx].api_id == -1  &&
+             __sync_bool_compare_and_swap(&p_sub->api_counts[idx].api_id, -1, p_hdr->api_id)) ){
+            p_count = &p_sub->api_counts[idx];
+            break;
+        }
+        // taken by another api_id meanwhile, which may be this one
+        if( p_sub->api_counts[idx].api_id == p_hdr->api_id ){ p_count = &p_sub->api_counts[idx]; break; }
+    }
+
+    __sync_add_and_fetch(&p_count->calls, 1);
+    if( p_hdr->err_code != 0 ) __sync_add_and_fetch(&p_count->errors, 1);
+}
+
+static uint64_t _vapi_core_sub_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* keeps the arguments as received, before the handler updates them */
+static void _vapi_core_sub_capture_arrive(_vapi_core_sub_t *p_sub, _vapi_core_sub_request_t *p_req, uint64_t arrive_ns)
+{
+    p_req->arrive_ns = arrive_ns;
+    p_req->p_capture = NULL;
+
+    if( arrive_ns  &&  (p_sub->capture_flags & VAPI_CORE_SUB_CAPTURE_PAYLOAD)  &&  p_req->hdr.arg_len ){
+        p_req->p_capture = malloc(p_req->hdr.arg_len);
+        if( p_req->p_capture ) _vapi_core_copy(p_req->p_capture, p_req->p_arg, p_req->hdr.arg_len);
+    }
+}
+
+/* records the completed request, if it was captured */
+static void _vapi_core_sub_capture(_vapi_core_sub_child_t *p_child, _vapi_core_sub_request_t *p_req)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    vapi_core_capture_rec_t rec;
+    uint64_t now;
+
+    if( !p_req->arrive_ns ) return;
+
+    now = _vapi_core_sub_now();
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = p_req->arrive_ns > p_sub->capture_start_ns ? p_req->arrive_ns - p_sub->capture_start_ns : 0;
+    rec.lat_ns = now - p_req->arrive_ns;
+    rec.api_id = p_req->hdr.api_id;
+    rec.arg_len = p_req->hdr.arg_len;
+    rec.conn = p_child->conn_id;
+    rec.err_code = p_req->hdr.err_code;
+    if( p_req->p_capture ) rec.flags |= VAPI_CORE_CAPTURE_REC_PAYLOAD;
+    if( p_req->hdr.flags & _VAPI_CORE_HDR_UNORDERED ) rec.flags |= VAPI_CORE_CAPTURE_REC_UNORDERED;
+    if( p_req->hdr.flags & _VAPI_CORE_HDR_ONEWAY ) rec.flags |= VAPI_CORE_CAPTURE_REC_ONEWAY;
+
+    // the capture may have been stopped while handling
+    pthread_mutex_lock(&p_sub->capture_lock);
+    if( p_sub->p_capture ){
+        fwrite(&rec, sizeof(rec), 1, p_sub->p_capture);
+        if( p_req->p_capture ) fwrite(p_req->p_capture, rec.arg_len, 1, p_sub->p_capture);
+    }
+    pthread_mutex_unlock(&p_sub->capture_lock);
+
+    if( p_req->p_capture ) free(p_req->p_capture);
+    p_req->p_capture = NULL;
+    p_req->arrive_ns = 0;
+}
+
+static void _vapi_core_sub_capture_close(_vapi_core_sub_t *p_sub)
+{
+    pthread_mutex_lock(&p_sub->capture_lock);
+    p_sub->capture_on = 0;
+    if( p_sub->p_capture ){
+        if( fclose(p_sub->p_capture) != 0 ) ERR_MSG("errsv=%d\n", errno);
+        p_sub->p_capture = NULL;
+    }
+    pthread_mutex_unlock(&p_sub->capture_lock);
+}
+
+static void _vapi_core_sub_child_detach(_vapi_core_sub_child_t *p_child)
+{
+    _vapi_core_sub_child_t **pp;
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+
+    if( p_sub ){
+        pthread_mutex_lock(&p_sub->lock);
+        for(pp = &p_sub->p_child_list; *pp; pp = &(*pp)->p_next){
+            if( *pp == p_child ){ *pp = p_child->p_next; p_sub->child_num--; break; }
+        }
+        pthread_cond_broadcast(&p_sub->child_cond);
+        pthread_mutex_unlock(&p_sub->lock);
+    }
+
+    _vapi_core_sub_event_stop(p_child);
+}
+
+/* the socket is kept open until the deferred requests are completed, so that
+   its number is never reused under them */
+static void _vapi_core_sub_child_unref(_vapi_core_sub_child_t *p_child)
+{
+    if( __sync_sub_and_fetch(&p_child->ref, 1) != 0 ) return;
+
+    pthread_mutex_destroy(&p_child->send_lock);
+    pthread_mutex_destroy(&p_child->ev_lock);
+    pthread_cond_destroy(&p_child->ev_cond);
+    if( p_child->p_shm ) munmap(p_child->p_shm, p_child->shm_size);
+    if( p_child->p_rx_buf ) munmap(p_child->p_rx_buf, p_child->rx_buf_len);
+    if( p_child->local ) pthread_cond_destroy(&p_child->local_cond);
+    else close(p_child->sock);
+    _vapi_core_sub_unref(p_child->p_sub);
+    free(p_child);
+}
+
+static int _vapi_core_sub_reply(_vapi_core_sub_child_t *p_child, _vapi_core_hdr_t *p_hdr, void *p_arg)
+{
+    int ret = -1;
+    ssize_t size;
+
+    // the host only learns the failures of one-way requests by a barrier
+    if( p_hdr->flags & _VAPI_CORE_HDR_ONEWAY ){
+        if( p_hdr->err_code != 0 ) __sync_add_and_fetch(&p_child->oneway_failed, 1);
+        return 0;
+    }
+
+    // the arguments of a direct caller are updated in place
+    if( p_child->local ){
+        pthread_mutex_lock(&p_child->send_lock);
+        p_child->local_hdr = *p_hdr;
+        p_child->local_done = 1;
+        pthread_cond_signal(&p_child->local_cond);
+        pthread_mutex_unlock(&p_child->send_lock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&p_child->send_lock);
+
+    // send header
+    p_hdr->version = _VAPI_CORE_VERSION;
+    size = _vapi_core_send( p_child->sock, p_hdr, sizeof(*p_hdr), MSG_NOSIGNAL );
+    if( size == sizeof(*p_hdr) ){
+        // send data, unless it is updated in the argument region
+        if( _vapi_core_body_len(p_hdr) == 0 ) ret = 0;
+        else if( _vapi_core_send( p_child->sock, p_arg, p_hdr->arg_len, MSG_NOSIGNAL ) == p_hdr->arg_len ) ret = 0;
+    }
+
+    pthread_mutex_unlock(&p_child->send_lock);
+
+    return ret;
+}
+
+static int _vapi_core_sub_coalesced(_vapi_core_sub_t *p_sub, int32_t api_id)
+{
+    uint32_t i;
+
+    for(i=0; i<p_sub->coalesce_num; ++i)
+      if( p_sub->p_coalesce_ids[i] == api_id ) return 1;
+
+    return 0;
+}
+
+/* FNV-1a over 8 bytes words */
+static uint64_t _vapi_core_sub_hash(int32_t api_id, const uint8_t *p_data, uint32_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint32_t)api_id, word;
+    uint32_t i;
+
+    for(i=0; i+8<=len; i+=8){
+        memcpy(&word, p_data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for(; i<len; ++i)
+      hash = (hash ^ p_data[i]) * 0x100000001b3ULL;
+
+    return hash ^ (hash >> 32);
+}
+
+/*
+  looks up the flight of the identical request being handled. If found, the
+  request is deferred as its waiter and 1 returns. Otherwise 0 returns, and
+  the request leads the new flight set to "*pp_flight", or NULL if it could
+  not be created. Must be called from the handler context.
+*/
+static int _vapi_core_sub_flight_join(_vapi_core_sub_t *p_sub, const _vapi_core_hdr_t *p_hdr, const void *p_data,
+                                      _vapi_core_sub_flight_t **pp_flight)
+{
+    _vapi_core_sub_flight_t *p_flight, **pp_bucket;
+    uint64_t hash = _vapi_core_sub_hash(p_hdr->api_id, p_data, p_hdr->arg_len);
+    int32_t *p_waiters, token;
+
+    *pp_flight = NULL;
+    pp_bucket = &p_sub->flights[ hash % _VAPI_CORE_SUB_FLIGHT_BUCKETS ];
+
+    pthread_mutex_lock(&p_sub->flight_lock);
+    for(p_flight = *pp_bucket; p_flight; p_flight = p_flight->p_next){
+        if( p_flight->hash == hash  &&  p_flight->api_id == p_hdr->api_id  &&  p_flight->arg_len == p_hdr->arg_len  &&
+            (p_hdr->arg_len == 0  ||  memcmp(p_flight->p_key, p_data, p_hdr->arg_len) == 0) ) break;
+    }
+
+    if( p_flight ){
+        if( p_flight->waiter_num == p_flight->waiter_max ){
+            p_waiters = realloc(p_flight->p_waiters, sizeof(int32_t) * (p_flight->waiter_max ? p_flight->waiter_max * 2 : 4));
+            if( !p_waiters ) goto _run_;
+            p_flight->p_waiters = p_waiters;
+            p_flight->waiter_max = p_flight->waiter_max ? p_flight->waiter_max * 2 : 4;
+        }
+
+        token = vapi_core_sub_defer();
+        if( token == -1 ) goto _run_;
+        p_flight->p_waiters[ p_flight->waiter_num++ ] = token;
+        pthread_mutex_unlock(&p_sub->flight_lock);
+
+        return 1;
+    }
+
+    p_flight = calloc(1, sizeof(_vapi_core_sub_flight_t) + p_hdr->arg_len);
+    if( p_flight ){
+        p_flight->hash = hash;
+        p_flight->api_id = p_hdr->api_id;
+        p_flight->arg_len = p_hdr->arg_len;
+        p_flight->p_key = (uint8_t*)(p_flight + 1);
+        if( p_hdr->arg_len ) _vapi_core_copy(p_flight->p_key, p_data, p_hdr->arg_len);
+        p_flight->p_next = *pp_bucket;
+        *pp_bucket = p_flight;
+        *pp_flight = p_flight;
+    }
+
+  _run_:
+    // handled by itself
+    pthread_mutex_unlock(&p_sub->flight_lock);
+
+    return 0;
+}
+
+/* replies the result of the leader to the waiters of the flight, and frees it */
+static void _vapi_core_sub_flight_finish(_vapi_core_sub_t *p_sub, _vapi_core_sub_flight_t *p_flight,
+                                         int32_t err_code, int errsv, const void *p_data)
+{
+    _vapi_core_sub_flight_t **pp;
+    uint32_t i;
+
+    // the next identical request runs the handler again
+    pthread_mutex_lock(&p_sub->flight_lock);
+    for(pp = &p_sub->flights[ p_flight->hash % _VAPI_CORE_SUB_FLIGHT_BUCKETS ]; *pp; pp = &(*pp)->p_next){
+        if( *pp == p_flight ){ *pp = p_flight->p_next; break; }
+    }
+    pthread_mutex_unlock(&p_sub->flight_lock);
+
+    for(i=0; i<p_flight->waiter_num; ++i){
+        errno = errsv;
+        vapi_core_sub_complete(p_flight->p_waiters[i], err_code, p_data, p_flight->arg_len);
+    }
+
+    if( p_flight->p_waiters ) free(p_flight->p_waiters);
+    free(p_flight);
+}
+
+/* runs the handler of the request, and returns 1 if it was deferred */
+static int _vapi_core_sub_handle(_vapi_core_sub_request_t *p_req)
+{
+    _vapi_core_sub_child_t *p_child = p_req->p_child;
+    _vapi_core_hdr_t *p_hdr = &p_req->hdr;
+    _vapi_core_sub_request_t *p_outer = _vapi_core_sub_current; /* calling this sub directly */
+
+    _vapi_core_sub_current = p_req;
+    if( p_child->p_sub->coalesce_num  &&  _vapi_core_sub_coalesced(p_child->p_sub, p_hdr->api_id)  &&
+        _vapi_core_sub_flight_join(p_child->p_sub, p_hdr, p_req->p_arg, &p_req->p_flight) ){
+        // waits for the identical request, deferred
+    } else {
+        p_hdr->err_code = p_child->handler(p_hdr->api_id, p_req->p_arg, p_hdr->arg_len, p_child->p_cookie);
+        p_hdr->errsv = errno;
+    }
+    _vapi_core_sub_current = p_outer;
+
+    // the flight of a deferred leader is finished by vapi_core_sub_complete()
+    if( p_req->p_flight  &&  !p_req->token ){
+        _vapi_core_sub_flight_finish(p_child->p_sub, p_req->p_flight, p_hdr->err_code, p_hdr->errsv, p_req->p_arg);
+    }
+
+    return p_req->token != 0;
+}
+
+/* handles an unordered request on a worker, which owns it and a reference of the child */
+static void _vapi_core_sub_work_run(_vapi_core_sub_request_t *p_req)
+{
+    _vapi_core_sub_child_t *p_child = p_req->p_child;
+
+    if( !_vapi_core_sub_handle(p_req) ){
+        _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_HANDLED, p_child->trace_conn, p_req->seq,
+                         p_req->hdr.api_id, p_req->hdr.arg_len);
+
+        _vapi_core_sub_count(p_child->p_sub, &p_req->hdr);
+        _vapi_core_sub_capture(p_child, p_req);
+
+        _vapi_core_sub_release(p_child, _vapi_core_body_len(&p_req->hdr));
+
+        // the connection may be gone already, which its child thread reports
+        if( _vapi_core_sub_reply(p_child, &p_req->hdr, p_req->p_arg) != 0 ){
+            DBG_MSG("failed to reply api_id=%d. errsv=%d\n", p_req->hdr.api_id, errno);
+        }
+
+        _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_SENT, p_child->trace_conn, p_req->seq,
+                         p_req->hdr.api_id, p_req->hdr.arg_len);
+
+        _vapi_core_sub_req_arg_free(p_req);
+    }
+
+    free(p_req);
+    _vapi_core_sub_child_unref(p_child);
+}
+
+static void* _vapi_core_sub_worker_thread(_vapi_core_sub_t *p_sub)
+{
+    _vapi_core_sub_request_t *p_req;
+
+    while( 1 ){
+        pthread_mutex_lock(&p_sub->work_lock);
+        while( !p_sub->p_work_head  &&  p_sub->work_alive )
+          pthread_cond_wait(&p_sub->work_cond, &p_sub->work_lock);
+        p_req = p_sub->p_work_head;
+        if( p_req ){
+            p_sub->p_work_head = p_req->p_next;
+            if( !p_sub->p_work_head ) p_sub->p_work_tail = NULL;
+            __sync_sub_and_fetch(&p_sub->work_depth, 1);
+        }
+        pthread_mutex_unlock(&p_sub->work_lock);
+
+        // the queue is drained before leaving
+        if( !p_req ) break;
+
+        _vapi_core_sub_work_run(p_req);
+    }
+
+    return NULL;
+}
+
+static void _vapi_core_sub_work_push(_vapi_core_sub_t *p_sub, _vapi_core_sub_request_t *p_req)
+{
+    p_req->p_next = NULL;
+
+    pthread_mutex_lock(&p_sub->work_lock);
+    if( p_sub->p_work_tail ) p_sub->p_work_tail->p_next = p_req;
+    else p_sub->p_work_head = p_req;
+    p_sub->p_work_tail = p_req;
+    __sync_add_and_fetch(&p_sub->work_depth, 1);
+    pthread_cond_signal(&p_sub->work_cond);
+    pthread_mutex_unlock(&p_sub->work_lock);
+}
+
+/* lets the workers run the queued requests out, and joins them */
+static void _vapi_core_sub_work_stop(_vapi_core_sub_t *p_sub)
+{
+    int i;
+
+    pthread_mutex_lock(&p_sub->work_lock);
+    p_sub->work_alive = 0;
+    pthread_cond_broadcast(&p_sub->work_cond);
+    pthread_mutex_unlock(&p_sub->work_lock);
+
+    for(i=0; i<p_sub->worker_num; ++i) pthread_join(p_sub->p_workers[i], NULL);
+    p_sub->worker_num = 0;
+}
+
+/*
+  handles a request of a direct caller on its thread with its arguments, as
+  the child thread does with the received ones, and returns the reason if it
+  could not. A one-way request gets a copy, as the caller may reuse its
+  arguments before a deferred one completes.
+*/
+static int _vapi_core_sub_local_call(_vapi_core_sub_child_t *p_child, _vapi_core_sub_request_t *p_req)
+{
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    int oneway = (p_req->hdr.flags & _VAPI_CORE_HDR_ONEWAY) != 0;
+    const void *p_arg = p_req->p_arg;
+    int reason;
+
+    reason = _vapi_core_sub_admit(p_child, _vapi_core_body_len(&p_req->hdr));
+    if( reason ){
+        p_req->hdr.err_code = -1;
+        p_req->hdr.errsv = reason;
+        _vapi_core_sub_reply(p_child, &p_req->hdr, NULL);
+        return 0;
+    }
+
+    if( oneway ){
+        // freed with the request, never the arguments of the caller
+        p_req->p_arg = NULL;
+        if( p_req->hdr.arg_len ){
+            p_req->p_arg = malloc(p_req->hdr.arg_len);
+            if( !p_req->p_arg ){ _vapi_core_sub_release(p_child, p_req->hdr.arg_len); return ENOMEM; }
+            memcpy(p_req->p_arg, p_arg, p_req->hdr.arg_len);
+        }
+    }
+
+    _vapi_core_sub_capture_arrive(p_sub, p_req, p_sub->capture_on ? _vapi_core_sub_now() : 0);
+
+    p_child->local_done = 0;
+    if( _vapi_core_sub_handle(p_req) ){
+        // the arguments and the reply belong to vapi_core_sub_complete()
+        if( !oneway ){
+            pthread_mutex_lock(&p_child->send_lock);
+            while( !p_child->local_done )
+              pthread_cond_wait(&p_child->local_cond, &p_child->send_lock);
+            p_req->hdr.err_code = p_child->local_hdr.err_code;
+            p_req->hdr.errsv = p_child->local_hdr.errsv;
+            pthread_mutex_unlock(&p_child->send_lock);
+        }
+        return 0;
+    }
+
+    _vapi_core_sub_count(p_sub, &p_req->hdr);
+    _vapi_core_sub_capture(p_child, p_req);
+    _vapi_core_sub_release(p_child, _vapi_core_body_len(&p_req->hdr));
+    if( oneway ){
+        _vapi_core_sub_reply(p_child, &p_req->hdr, NULL);
+        if( p_req->p_arg ) free(p_req->p_arg);
+    }
+
+    return 0;
+}
+
+/* refuses a request without receiving its arguments into memory */
+static int _vapi_core_sub_reject(_vapi_core_sub_child_t *p_child, _vapi_core_hdr_t *p_hdr, int errsv)
+{
+    uint32_t len = _vapi_core_body_len(p_hdr);
+    char buf[4096];
+    ssize_t size;
+
+    // MSG_TRUNC discards the data of a TCP socket, which a unix socket fails with EFAULT
+    while( len ){
+        if( p_child->is_unix ) size = recv(p_child->sock, buf, len < sizeof(buf) ? len : sizeof(buf), 0);
+        else size = recv(p_child->sock, NULL, len, MSG_TRUNC);
+        if( size < 0  &&  errno == EINTR ) continue;
+        if( size <= 0 ) return -1;
+        len -= size;
+    }
+
+    p_hdr->arg_len = 0;
+    p_hdr->err_code = -1;
+    p_hdr->errsv = errsv;
+
+    return _vapi_core_sub_reply(p_child, p_hdr, NULL);
+}
+
+static void* _vapi_core_sub_child_thread(_vapi_core_sub_child_t *p_child)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    ssize_t size = -1;
+    _vapi_core_hdr_t hdr;
+    char *p_arg = NULL;   /* received over the socket by malloc() */
+    char *p_data;         /* p_arg, p_child->p_rx_buf, of the provider, or in the argument region */
+    int admitted = 0, reason, provided = 0;
+    uint64_t arrive_ns;
+    struct timeval tv = { 0, 0 }; /* infinity. never timeout. */
+    int opt;
+#ifdef VAPI_CORE_TRACE
+    uint32_t seq;
+#endif
+
+    err_code = setsockopt(p_child->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    // a unix socket has no Nagle to disable
+    opt = 1;
+    err_code = setsockopt( p_child->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt) );
+    if( err_code!=0  &&  errno != EOPNOTSUPP ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    while( 1 ){
+        // recv header
+        size = _vapi_core_recv( p_child->sock, &hdr, sizeof(hdr), 0 );
+        if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+        else if( size == 0 ){ break; }
+        else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
+
+#ifdef VAPI_CORE_TRACE
+        seq = p_child->trace_seq++;
+#endif
+        _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_RECV, p_child->trace_conn, seq, hdr.api_id, hdr.arg_len);
+        arrive_ns = p_child->p_sub->capture_on ? _vapi_core_sub_now() : 0;
+
+        // LOCAL is of the direct calls only, and would take the arguments off the budgets.
+        // the arguments of such a request are sent, so dropped as those of any other
+        if( hdr.flags & ~_VAPI_CORE_HDR_SOCKET_MASK ){
+            hdr.flags &= _VAPI_CORE_HDR_SOCKET_MASK;
+            err_code = _vapi_core_sub_reject(p_child, &hdr, EINVAL);
+            if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+            continue;
+        }
+
+        // a unix connection is refused until it proves to be of a TCP one
+        if( p_child->is_unix  &&  !p_child->verified  &&  hdr.api_id != _VAPI_CORE_API_ID_HELLO ){
+            err_code = _vapi_core_sub_reject(p_child, &hdr, EACCES);
+            if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+            continue;
+        }
+
+        // admission control of the requests to the handler
+        if( hdr.api_id < 0 ){
+            if( _vapi_core_body_len(&hdr) > _VAPI_CORE_SUB_CONTROL_LEN_MAX ){
+                err_code = _vapi_core_sub_reject(p_child, &hdr, EINVAL);
+                if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+                continue;
+            }
+        } else {
+            reason = _vapi_core_sub_admit(p_child, _vapi_core_body_len(&hdr));
+            if( reason ){
+                DBG_MSG("api_id=%d was rejected. errsv=%d\n", hdr.api_id, reason);
+                err_code = _vapi_core_sub_reject(p_child, &hdr, reason);
+                if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+                continue;
+            }
+            admitted = 1;
+        }
+
+        // recv data, unless the host placed it in the argument region
+        p_data = NULL;
+        provided = 0;
+        if( hdr.flags & _VAPI_CORE_HDR_SHM ){
+            if( p_child->p_shm  &&  hdr.shm_off <= p_child->shm_size  &&
+                hdr.arg_len <= p_child->shm_size - hdr.shm_off ){
+                p_data = (char*)p_child->p_shm + hdr.shm_off;
+            }
+        } else if( hdr.arg_len ){
+            if( p_child->p_sub->provider_num  &&  hdr.api_id >= 0  &&
+                (p_data = _vapi_core_sub_provide(p_child, &hdr)) ){
+                provided = 1;
+            } else if( hdr.arg_len < _VAPI_CORE_SUB_RX_BUF_MIN ){
+                p_data = p_arg = malloc( hdr.arg_len );
+            } else {
+                p_data = _vapi_core_sub_rx_buf( p_child, hdr.arg_len );
+            }
+            if( !p_data ){ line = __LINE__; goto _err_end_; }
+
+            // only the argument region comes with a descriptor, dropped on the others
+            if( hdr.api_id == _VAPI_CORE_API_ID_SHM_ATTACH  &&  p_child->is_unix ){
+                size = _vapi_core_recv_fd( p_child->sock, p_data, hdr.arg_len, &p_child->rx_fd );
+            } else {
+                size = _vapi_core_recv( p_child->sock, p_data, hdr.arg_len, 0 );
+            }
+            if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+            else if( size == 0 ){ break; }
+            else if( size != hdr.arg_len ){ line = __LINE__; goto _err_end_; }
+        }
+
+        _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_RECEIVED, p_child->trace_conn, seq, hdr.api_id, hdr.arg_len);
+
+        // call hander
+        if( hdr.arg_len  &&  !p_data ) {
+            ERR_MSG("invalid offset(0x%08x) of the argument region.\n", hdr.shm_off);
+            hdr.err_code = -1;
+            hdr.errsv = EFAULT;
+        } else if( hdr.api_id < 0 ) {
+            hdr.err_code = _vapi_core_sub_control(p_child, &hdr, p_data);
+            hdr.errsv = errno;
+            if( p_child->rx_fd >= 0 ){ close(p_child->rx_fd); p_child->rx_fd = -1; }
+        } else if( p_child->handler ) {
+            _vapi_core_sub_request_t req, *p_work = NULL;
+
+            req.p_child = p_child;
+            req.hdr = hdr;
+            req.p_arg = p_data;
+            req.buf_len = (p_data  &&  !provided  &&  p_data == p_child->p_rx_buf) ? p_child->rx_buf_len : 0;
+            req.provided = provided;
+            req.p_flight = NULL;
+            req.token = 0;
+            req.p_next = NULL;
+#ifdef VAPI_CORE_TRACE
+            req.seq = seq;
+#endif
+            _vapi_core_sub_capture_arrive(p_child->p_sub, &req, arrive_ns);
+
+            // an unordered request is handed to the workers with its arguments,
+            // or handled in order here if it cannot be
+            if( (hdr.flags & _VAPI_CORE_HDR_UNORDERED)  &&  p_child->p_sub->worker_num ){
+                p_work = malloc(sizeof(_vapi_core_sub_request_t));
+            }
+            if( p_work ){
+                *p_work = req;
+                if( req.buf_len ) p_child->p_rx_buf = NULL;
+                p_arg = NULL;
+                provided = 0;
+                admitted = 0;
+                __sync_add_and_fetch(&p_child->ref, 1);
+                _vapi_core_sub_work_push(p_child->p_sub, p_work);
+                continue;
+            }
+
+            if( _vapi_core_sub_handle(&req) ){
+                // the arguments and the reply belong to vapi_core_sub_complete()
+                if( req.buf_len ) p_child->p_rx_buf = NULL;
+                p_arg = NULL;
+                provided = 0;
+                admitted = 0;
+                continue;
+            }
+            _vapi_core_sub_count(p_child->p_sub, &req.hdr);
+            _vapi_core_sub_capture(p_child, &req);
+            hdr.err_code = req.hdr.err_code;
+            hdr.errsv = req.hdr.errsv;
+        } else {
+            hdr.err_code = -99;
+            hdr.errsv = ENXIO; /* No such device or address */
+        }
+
+        _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_HANDLED, p_child->trace_conn, seq, hdr.api_id, hdr.arg_len);
+
+        // released before the reply, so that the host can send the next one at once
+        if( admitted ){ _vapi_core_sub_release(p_child, _vapi_core_body_len(&hdr)); admitted = 0; }
+
+        err_code = _vapi_core_sub_reply(p_child, &hdr, p_data);
+        if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+        _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_SENT, p_child->trace_conn, seq, hdr.api_id, hdr.arg_len);
+
+        if( p_arg ){ free( p_arg ); p_arg = NULL; }
+        if( provided ){ _vapi_core_sub_unprovide(p_child, &hdr, p_data); provided = 0; }
+
+        // not charged to the budgets once the request is done, so not kept under them
+        if( p_child->p_rx_buf  &&  (p_child->p_sub->max_buffered  ||  p_child->p_sub->max_conn_buffered) ){
+            munmap(p_child->p_rx_buf, p_child->rx_buf_len);
+            p_child->p_rx_buf = NULL;
+        }
+    }
+
+    LOG_MSG("The peer(sock=0x%08x) side seems to be closed.\n", p_child->sock);
+
+    if( p_arg ){ free( p_arg ); p_arg = NULL; }
+    if( provided ) _vapi_core_sub_unprovide(p_child, &hdr, p_data);
+    if( admitted ) _vapi_core_sub_release(p_child, _vapi_core_body_len(&hdr));
+    _vapi_core_sub_child_detach(p_child);
+    _vapi_core_sub_child_unref(p_child);
+
+    return NULL;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_arg ){ free( p_arg ); p_arg = NULL; }
+    if( provided ) _vapi_core_sub_unprovide(p_child, &hdr, p_data);
+    if( admitted ) _vapi_core_sub_release(p_child, _vapi_core_body_len(&hdr));
+    _vapi_core_sub_child_detach(p_child);
+    _vapi_core_sub_child_unref(p_child);
+
+    return NULL;
+}
+
+static void* _vapi_core_sub_accept_thread(_vapi_core_sub_listener_t *p_lsn)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    _vapi_core_sub_t *p_fd = p_lsn->p_sub;
+    int sock;
+    struct sockaddr_in addr;
+    socklen_t len;
+    pthread_t       thrd;
+    pthread_attr_t  thrd_attr;
+    _vapi_core_sub_child_t *p_child = NULL;
+    struct pollfd pfd[2];
+    int refused;
+
+    err_code = pthread_attr_init( &thrd_attr );
+    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+
+    err_code = pthread_attr_setdetachstate(&thrd_attr , PTHREAD_CREATE_DETACHED);
+    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+
+    pfd[0].fd = p_lsn->sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = p_fd->wake_fd;
+    pfd[1].events = POLLIN;
+
+    while( p_fd->thrd_alive ){
+        DBG_MSG("accepting...\n");
+        p_child = NULL;
+
+        // sleep until a connection arrives or vapi_core_sub_close() wakes us up
+        pfd[0].revents = pfd[1].revents = 0;
+        if( poll(pfd, 2, -1) < 0 ){
+            if( errno == EINTR ) continue;
+            errsv = errno; line = __LINE__; goto _err_end_;
+        }
+        if( pfd[1].revents ) break;
+
+        len = sizeof(addr);
+        sock = accept(p_lsn->sock, (struct sockaddr*)&addr, &len);
+        if( sock==-1 ){
+            errsv = errno;
+            switch(errsv){
+              case EWOULDBLOCK /* Operation would block */:
+              case EINTR:
+              case ECONNABORTED:
+                errsv = 0;
+                continue;
+              default:
+                ERR_MSG("failed to accept. errsv=%d\n", errsv);
+                line = __LINE__;
+                goto _err_end_;
+            }
+        }
+
+        p_child = calloc(1, sizeof(_vapi_core_sub_child_t));
+        if( !p_child ){ close(sock); line = __LINE__; goto _err_end_; }
+        
+        p_child->ref = 1;
+        p_child->sock = sock;
+        p_child->is_unix = (addr.sin_family == AF_UNIX);
+        if( addr.sin_family == AF_INET ) p_child->peer_port = ntohs(addr.sin_port);
+        p_child->rx_fd = -1;
+        p_child->handler = p_fd->handler;
+        p_child->p_cookie = p_fd->p_cookie;
+        p_child->p_sub = p_fd;
+        __sync_add_and_fetch(&p_fd->ref, 1);
+#ifdef VAPI_CORE_TRACE
+        // a unix connection is named by its _VAPI_CORE_API_ID_HELLO
+        if( addr.sin_family == AF_INET ) p_child->trace_conn = ntohs(addr.sin_port);
+#endif
+        pthread_mutex_init(&p_child->send_lock, NULL);
+        pthread_mutex_init(&p_child->ev_lock, NULL);
+        pthread_cond_init(&p_child->ev_cond, NULL);
+
+        // counted under the lock, as the other listeners of the port accept too
+        pthread_mutex_lock(&p_fd->lock);
+        refused = (p_fd->max_conn  &&  p_fd->child_num >= p_fd->max_conn);
+        if( !refused ){
+            p_child->p_next = p_fd->p_child_list;
+            p_fd->p_child_list = p_child;
+            p_fd->child_num++;
+            p_child->conn_id = p_fd->conn_seq++;
+        }
+        pthread_mutex_unlock(&p_fd->lock);
+
+        if( refused ){
+            // refused at once rather than left in the backlog
+            DBG_MSG("the connection(sock=0x%08x) was refused.\n", sock);
+            __sync_add_and_fetch(&p_fd->refused, 1);
+            _vapi_core_sub_child_unref(p_child);
+            continue;
+        }
+
+        err_code = pthread_create( &thrd, &thrd_attr,
+                                   (void*)_vapi_core_sub_child_thread, (void*)p_child);
+        if( err_code!=0 ){
+            _vapi_core_sub_child_detach(p_child);
+            _vapi_core_sub_child_unref(p_child);
+            p_child = NULL;
+            line = __LINE__;
+            goto _err_end_;
+        }
+        // the child may have gone already
+        LOG_MSG("The new connection(sock=0x%08x) was accepted. \n", sock);
+    }
+
+    err_code = pthread_attr_destroy( &thrd_attr );
+    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+
+    return NULL;
+
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+    
+    // the other listeners of the port go on accepting
+    if( p_child ) free(p_child);
+    pthread_attr_destroy( &thrd_attr );
+
+    return NULL;
+}
+
+static void _vapi_core_sub_metric(FILE *fp, const char *p_name, const char *p_type, const char *p_help, uint64_t val)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", p_name, p_help, p_name, p_type, p_name, (unsigned long long)val);
+}
+
+/* writes the metrics in the Prometheus text format into a malloc()ed buffer */
+static int _vapi_core_sub_metrics_render(_vapi_core_sub_t *p_sub, char **pp_body, size_t *p_len)
+{
+    FILE *fp;
+    uint32_t i;
+    int pass;
+
+    fp = open_memstream(pp_body, p_len);
+    if( !fp ) return -1;
+
+    _vapi_core_sub_metric(fp, "vapi_core_sub_connections", "gauge",
+                          "The number of the connections.", p_sub->child_num);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_local_connections", "gauge",
+                          "The descriptors of this process calling the handler directly.", p_sub->local_num);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_connections_accepted_total", "counter",
+                          "The connections accepted.", p_sub->conn_seq);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_connections_refused_total", "counter",
+                          "The connections refused by max_conn.", p_sub->refused);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_threads", "gauge",
+                          "The threads of the accept, the workers, the metrics, the connections and their events.",
+                          p_sub->lsn_num + p_sub->worker_num + (p_sub->metrics_started ? 1 : 0) +
+                          p_sub->child_num + p_sub->ev_thrd_num);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_inflight", "gauge",
+                          "The requests being handled, including the deferred ones.", p_sub->inflight);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_queue_depth", "gauge",
+                          "The unordered requests waiting for a worker.", p_sub->work_depth);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_buffered_bytes", "gauge",
+                          "The bytes of the arguments buffered for the requests being handled.", p_sub->buffered);
+    _vapi_core_sub_metric(fp, "vapi_core_sub_buffered_peak_bytes", "gauge",
+                          "The peak of vapi_core_sub_buffered_bytes.", p_sub->buffered_peak);
+
+    fprintf(fp, "# HELP vapi_core_sub_rejected_total The requests rejected by the limits.\n"
+                "# TYPE vapi_core_sub_rejected_total counter\n"
+                "vapi_core_sub_rejected_total{reason=\"busy\"} %llu\n"
+                "vapi_core_sub_rejected_total{reason=\"nobufs\"} %llu\n",
+            (unsigned long long)p_sub->rejected_busy, (unsigned long long)p_sub->rejected_nobufs);
+
+    // a slot being taken may show its api_id without a call yet
+    for(pass=0; pass<2; ++pass){
+        if( pass == 0 ) fprintf(fp, "# HELP vapi_core_sub_requests_total The requests handled.\n"
+                                    "# TYPE vapi_core_sub_requests_total counter\n");
+        else fprintf(fp, "# HELP vapi_core_sub_request_errors_total The requests handled with an error.\n"
+                         "# TYPE vapi_core_sub_request_errors_total counter\n");
+
+        for(i=0; i<=_VAPI_CORE_SUB_API_COUNT_NUM; ++i){
+            _vapi_core_sub_api_count_t *p_count = &p_sub->api_counts[i];
+            uint64_t val = pass == 0 ? p_count->calls : p_count->errors;
+
+            if( i == _VAPI_CORE_SUB_API_COUNT_NUM ){
+                if( p_count->calls ) fprintf(fp, "%s{api_id=\"other\"} %llu\n",
+                                             pass == 0 ? "vapi_core_sub_requests_total" : "vapi_core_sub_request_errors_total",
+                                             (unsigned long long)val);
+            } else if( p_count->api_id != -1 ){
+                fprintf(fp, "%s{api_id=\"%d\"} %llu\n",
+                        pass == 0 ? "vapi_core_sub_requests_total" : "vapi_core_sub_request_errors_total",
+                        p_count->api_id, (unsigned long long)val);
+            }
+        }
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* waits for "events" of the scraper until "end_ns" of _vapi_core_sub_now() */
+static int _vapi_core_sub_metrics_wait(int sock, short events, uint64_t end_ns)
+{
+    struct pollfd pfd;
+    uint64_t now;
+    int ret;
+
+    pfd.fd = sock;
+    pfd.events = events;
+    do{
+        now = _vapi_core_sub_now();
+        if( now >= end_ns ){ errno = ETIMEDOUT; return -1; }
+        ret = poll(&pfd, 1, (int)((end_ns - now + 999999) / 1000000));
+    }while( ret < 0  &&  errno == EINTR );
+
+    if( ret == 0 ) errno = ETIMEDOUT;
+    return ret > 0 ? 0 : -1;
+}
+
+static int _vapi_core_sub_metrics_send(int sock, const char *p_buf, size_t len, uint64_t end_ns)
+{
+    ssize_t size;
+
+    while( len ){
+        if( _vapi_core_sub_metrics_wait(sock, POLLOUT, end_ns) != 0 ) return -1;
+        size = send(sock, p_buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if( size < 0  &&  (errno == EAGAIN  ||  errno == EINTR) ) continue;
+        if( size < 0 ) return -1;
+        p_buf += size;
+        len -= size;
+    }
+
+    return 0;
+}
+
+/* answers a scrape with the metrics, whatever it requests */
+static void _vapi_core_sub_metrics_serve(_vapi_core_sub_t *p_sub, int sock)
+{
+    char req[1024], head[128];
+    size_t req_len = 0, body_len = 0;
+    char *p_body = NULL;
+    ssize_t size;
+    int head_len;
+    uint64_t end_ns;
+
+    // a stalled scraper never holds the thread longer than the timeout, for the whole scrape
+    end_ns = _vapi_core_sub_now() + (uint64_t)_VAPI_CORE_SUB_METRICS_TIMEOUT * 1000000;
+    while( req_len < sizeof(req) - 1 ){
+        if( _vapi_core_sub_metrics_wait(sock, POLLIN, end_ns) != 0 ) return;
+        size = recv(sock, req + req_len, sizeof(req) - 1 - req_len, MSG_DONTWAIT);
+        if( size < 0  &&  (errno == EAGAIN  ||  errno == EINTR) ) continue;
+        if( size <= 0 ) return;
+        req_len += size;
+        req[req_len] = 0;
+        if( strstr(req, "\r\n\r\n") ) break;
+    }
+
+    if( _vapi_core_sub_metrics_render(p_sub, &p_body, &body_len) != 0 ){ ERR_MSG("errsv=%d\n", errno); return; }
+
+    head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %lu\r\n\r\n", (unsigned long)body_len);
+
+    if( _vapi_core_sub_metrics_send(sock, head, head_len, end_ns) != 0  ||
+        _vapi_core_sub_metrics_send(sock, p_body, body_len, end_ns) != 0 ){
+        DBG_MSG("failed to send the metrics. errsv=%d\n", errno);
+    }
+
+    free(p_body);
+}
+
+static void* _vapi_core_sub_metrics_thread(_vapi_core_sub_t *p_sub)
+{
+    struct pollfd pfd[2];
+    int sock;
+
+    pfd[0].fd = p_sub->metrics_sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = p_sub->wake_fd;
+    pfd[1].events = POLLIN;
+
+    while( p_sub->thrd_alive ){
+        pfd[0].revents = pfd[1].revents = 0;
+        if( poll(pfd, 2, -1) < 0 ){
+            if( errno == EINTR ) continue;
+            ERR_MSG("errsv=%d\n", errno);
+            break;
+        }
+        if( pfd[1].revents ) break;
+
+        sock = accept(p_sub->metrics_sock, NULL, NULL);
+        if( sock == -1 ) continue;
+        _vapi_core_sub_metrics_serve(p_sub, sock);
+        close(sock);
+    }
+
+    return NULL;
+}
+
+/* removes the socket file of "p_path", but nothing else found there */
+static void _vapi_core_sub_unlink_sock(const char *p_path)
+{
+    struct stat st;
+
+    if( lstat(p_path, &st) == 0  &&  S_ISSOCK(st.st_mode) ) unlink(p_path);
+}
+
+/* listens for the scrapes on the unix socket "p_path", or the loopback "port" */
+static int _vapi_core_sub_metrics_listen(_vapi_core_sub_t *p_sub, uint16_t port, const char *p_path)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    struct sockaddr_in addr;
+    struct sockaddr_un un;
+    int opt = 1;
+
+    if( p_path ){
+        if( strlen(p_path) >= sizeof(un.sun_path) ){ line = __LINE__; errsv = ENAMETOOLONG; goto _err_end_; }
+        p_sub->metrics_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if( p_sub->metrics_sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, p_path);
+        _vapi_core_sub_unlink_sock(p_path);
+        err_code = bind(p_sub->metrics_sock, (struct sockaddr*)&un, sizeof(un));
+        if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+        p_sub->p_metrics_path = strdup(p_path);
+        if( !p_sub->p_metrics_path ){ _vapi_core_sub_unlink_sock(p_path); line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+    } else {
+        p_sub->metrics_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if( p_sub->metrics_sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+        err_code = setsockopt(p_sub->metrics_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(port);
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        err_code = bind(p_sub->metrics_sock, (struct sockaddr*)&addr, sizeof(addr));
+        if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    }
+
+    err_code = listen(p_sub->metrics_sock, SOMAXCONN);
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_sub->metrics_sock >= 0 ){ close(p_sub->metrics_sock); p_sub->metrics_sock = -1; }
+    errno = errsv;
+
+    return -1;
+}
+
+/* binds a listening socket to "port", which is shared with the others if "reuse" */
+static int _vapi_core_sub_listen(_vapi_core_sub_listener_t *p_lsn, uint16_t port, int backlog, int reuse)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    struct sockaddr_in addr;
+    int opt;
+
+    p_lsn->sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( p_lsn->sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    if( reuse ){
+        opt = 1;
+        err_code = setsockopt(p_lsn->sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    err_code = bind(p_lsn->sock, (struct sockaddr*)&addr, sizeof(addr));
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    err_code = listen(p_lsn->sock, backlog);
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_lsn->sock >= 0 ){ close(p_lsn->sock); p_lsn->sock = -1; }
+
+    return -1;
+}
+
+/* binds a listening socket to the abstract unix "p_name", which is gone with the socket */
+static int _vapi_core_sub_unix_listen(_vapi_core_sub_listener_t *p_lsn, const char *p_name, int backlog)
+{
+    int err_code = 0, line = 0, errsv = 0;
+    struct sockaddr_un un;
+    socklen_t len;
+
+    p_lsn->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( p_lsn->sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path + 1, p_name, sizeof(un.sun_path) - 2);
+    len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(un.sun_path + 1);
+    err_code = bind(p_lsn->sock, (struct sockaddr*)&un, len);
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    err_code = listen(p_lsn->sock, backlog);
+    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    if( p_lsn->sock >= 0 ){ close(p_lsn->sock); p_lsn->sock = -1; }
+
+    return -1;
+}
+
+/* wakes the accept and the metrics threads up, waits for them, and closes the listening sockets */
+static void _vapi_core_sub_listen_stop(_vapi_core_sub_t *p_fd)
+{
+    int i;
+
+    p_fd->thrd_alive = 0;
+    if( eventfd_write(p_fd->wake_fd, 1) != 0 ) ERR_MSG("errsv=%d\n", errno);
+
+    for(i=0; i<p_fd->lsn_num; ++i){
+        if( p_fd->p_lsn[i].thrd_started ) pthread_join( p_fd->p_lsn[i].thrd, NULL );
+        if( p_fd->p_lsn[i].sock >= 0 ) close( p_fd->p_lsn[i].sock );
+    }
 
-typedef struct
-{
-    int sock;
-    int thrd_alive;
-    vapi_core_sub_handler_t handler;
-    void *p_cookie;
-    pthread_t       thrd;
-    uint16_t port;
-} _vapi_core_sub_t;
+    if( p_fd->metrics_started ) pthread_join( p_fd->metrics_thrd, NULL );
+    p_fd->metrics_started = 0;
+    if( p_fd->metrics_sock >= 0 ){ close( p_fd->metrics_sock ); p_fd->metrics_sock = -1; }
+    if( p_fd->p_metrics_path ) _vapi_core_sub_unlink_sock( p_fd->p_metrics_path );
+}
 
-typedef struct __vapi_core_sub_child_t
+/*
+  stops accepting, shuts the accepted connections down and waits for their
+  threads, and lets the workers run the queued requests out. Used by
+  vapi_core_sub_close(), and by a failed open whose threads have started.
+*/
+static void _vapi_core_sub_stop(_vapi_core_sub_t *p_fd)
 {
-    int sock;
-    vapi_core_sub_handler_t handler;
-    void *p_cookie;
-} _vapi_core_sub_child_t;
+    _vapi_core_sub_child_t *p_child;
+
+    // wake the accept threads up immediately instead of waiting for a timeout
+    if( p_fd->wake_fd >= 0 ){
+        _vapi_core_sub_listen_stop(p_fd);
+        close(p_fd->wake_fd);
+        p_fd->wake_fd = -1;
+    }
+
+    // shut the accepted connections down, which makes their blocking recv()
+    // return at once, and wait for the child threads to leave
+    pthread_mutex_lock(&p_fd->lock);
+    for(p_child = p_fd->p_child_list; p_child; p_child = p_child->p_next)
+      shutdown(p_child->sock, SHUT_RDWR);
+    while( p_fd->p_child_list )
+      pthread_cond_wait(&p_fd->child_cond, &p_fd->lock);
+    _vapi_core_sub_ring_destroy(p_fd);
+    pthread_mutex_unlock(&p_fd->lock);
+
+    // the requests queued by them are run out, and their replies fail
+    _vapi_core_sub_work_stop(p_fd);
+    _vapi_core_sub_capture_close(p_fd);
+}
 
 
 //=============================================================================
-// Local Function/Variable Implementations
+// Global Function/Variable Implementations
 //=============================================================================
-static void* _vapi_core_sub_child_thread(_vapi_core_sub_child_t *p_child)
+void vapi_core_sub_attr_init(vapi_core_sub_attr_t *p_attr)
+{
+    memset(p_attr, 0, sizeof(*p_attr));
+    p_attr->port = 0;
+    p_attr->backlog = SOMAXCONN;
+    p_attr->listener_num = 1;
+    p_attr->unix_socket = 1;
+    p_attr->shm = 1;
+}
+
+int32_t vapi_core_sub_open(uint16_t port, vapi_core_sub_handler_t handler, const void *p_cookie)
+{
+    vapi_core_sub_attr_t attr;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.port = port;
+
+    return vapi_core_sub_open_attr(&attr, handler, p_cookie);
+}
+
+int32_t vapi_core_sub_open_attr(const vapi_core_sub_attr_t *p_attr, vapi_core_sub_handler_t handler, const void *p_cookie)
 {
     int err_code = 0, line = 0, errsv = 0;
-    ssize_t size = -1;
-    _vapi_core_hdr_t hdr;
-    char *p_arg = NULL;
-    struct timeval tv = { 0, 0 }; /* infinity. never timeout. */
-    int opt;
+    _vapi_core_sub_t *p_fd = NULL;
+    int32_t fd;
+    struct sockaddr_in addr;
+    socklen_t socklen = sizeof(addr);
+    int i;
 
-    err_code = setsockopt(p_child->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    if( !p_attr  ||  p_attr->listener_num < 1  ||  p_attr->backlog < 1  ||  p_attr->worker_num < 0 ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
 
-    opt = 1;
-    err_code = setsockopt( p_child->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt) );
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    p_fd = calloc( 1, sizeof(_vapi_core_sub_t) );
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
 
-    while( 1 ){
-        // recv header
-        size = _vapi_core_recv( p_child->sock, &hdr, sizeof(hdr), 0 );
-        if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
-        else if( size == 0 ){ break; }
-        else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
+    p_fd->ref = 1;
+    p_fd->handler = handler;
+    p_fd->p_cookie = (void*)p_cookie;
+    p_fd->max_conn = p_attr->max_conn;
+    p_fd->max_inflight = p_attr->max_inflight;
+    p_fd->max_buffered = p_attr->max_buffered;
+    p_fd->max_conn_buffered = p_attr->max_conn_buffered;
+    p_fd->local_call = p_attr->local_call;
+    p_fd->shm = p_attr->shm;
+    p_fd->ring_fd = -1;
+    p_fd->wake_fd = -1;
+    p_fd->metrics_sock = -1;
+    for(i=0; i<_VAPI_CORE_SUB_API_COUNT_NUM; ++i) p_fd->api_counts[i].api_id = -1;
+    pthread_mutex_init(&p_fd->lock, NULL);
+    pthread_cond_init(&p_fd->child_cond, NULL);
+    pthread_mutex_init(&p_fd->flight_lock, NULL);
+    pthread_mutex_init(&p_fd->work_lock, NULL);
+    pthread_mutex_init(&p_fd->capture_lock, NULL);
+    pthread_cond_init(&p_fd->work_cond, NULL);
+
+    if( p_attr->coalesce_num ){
+        if( !p_attr->p_coalesce_ids ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+        p_fd->p_coalesce_ids = malloc( sizeof(int32_t) * p_attr->coalesce_num );
+        if( !p_fd->p_coalesce_ids ){ line = __LINE__; goto _err_end_; }
+        memcpy(p_fd->p_coalesce_ids, p_attr->p_coalesce_ids, sizeof(int32_t) * p_attr->coalesce_num);
+        p_fd->coalesce_num = p_attr->coalesce_num;
+    }
 
-        // recv data
-        if( hdr.arg_len ){
-            p_arg = malloc( hdr.arg_len );
-            if( !p_arg ){ line = __LINE__; goto _err_end_; }
+    if( p_attr->provider_num ){
+        if( !p_attr->provider  ||  !p_attr->p_provider_ids ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+        p_fd->p_provider_ids = malloc( sizeof(int32_t) * p_attr->provider_num );
+        if( !p_fd->p_provider_ids ){ line = __LINE__; goto _err_end_; }
+        memcpy(p_fd->p_provider_ids, p_attr->p_provider_ids, sizeof(int32_t) * p_attr->provider_num);
+        p_fd->provider_num = p_attr->provider_num;
+        p_fd->provider = p_attr->provider;
+        p_fd->provider_release = p_attr->provider_release;
+    }
 
-            size = _vapi_core_recv( p_child->sock, p_arg, hdr.arg_len, 0 );
-            if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
-            else if( size == 0 ){ break; }
-            else if( size != hdr.arg_len ){ line = __LINE__; goto _err_end_; }
+    // and one more for the unix socket
+    p_fd->p_lsn = calloc( p_attr->listener_num + 1, sizeof(_vapi_core_sub_listener_t) );
+    if( !p_fd->p_lsn ){ line = __LINE__; goto _err_end_; }
+    p_fd->lsn_num = p_attr->listener_num;
+    for(i=0; i<=p_fd->lsn_num; ++i){
+        p_fd->p_lsn[i].sock = -1;
+        p_fd->p_lsn[i].p_sub = p_fd;
+    }
+
+    p_fd->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if( p_fd->wake_fd==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    // the first listener decides the port, to which the others are bound
+    p_fd->port = p_attr->port;
+    for(i=0; i<p_fd->lsn_num; ++i){
+        err_code = _vapi_core_sub_listen(&p_fd->p_lsn[i], p_fd->port, p_attr->backlog, p_fd->lsn_num > 1);
+        if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+
+        if( i == 0 ){
+            err_code = getsockname(p_fd->p_lsn[0].sock, (struct sockaddr*)&addr, &socklen );
+            if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+            p_fd->port = ntohs(addr.sin_port);
         }
+    }
 
-        // call hander
-        if( p_child->handler ) {
-            hdr.err_code = p_child->handler(hdr.api_id, p_arg, hdr.arg_len, p_child->p_cookie);
-            hdr.errsv = errno;
+    // named by the port, which no other sub of the network namespace has
+    if( p_attr->unix_socket ){
+        snprintf(p_fd->unix_name, sizeof(p_fd->unix_name), "vapi_core.%u", p_fd->port);
+        if( _vapi_core_sub_unix_listen(&p_fd->p_lsn[p_fd->lsn_num], p_fd->unix_name, p_attr->backlog) == 0 ){
+            p_fd->lsn_num++;
+            p_fd->unix_socket = 1;
         } else {
-            hdr.err_code = -99;
-            hdr.errsv = ENXIO; /* No such device or address */
+            // the hosts stay on TCP
+            LOG_MSG("no unix socket for port %u.\n", p_fd->port);
         }
+    }
 
-        // send header
-        size = _vapi_core_send( p_child->sock, &hdr, sizeof(hdr), MSG_NOSIGNAL );
-        if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
-        else if( size != sizeof(hdr) ){ line = __LINE__; goto _err_end_; }
+    if( p_attr->metrics_port  ||  p_attr->p_metrics_path ){
+        err_code = _vapi_core_sub_metrics_listen(p_fd, p_attr->metrics_port, p_attr->p_metrics_path);
+        if( err_code!=0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    }
 
-        // send data
-        if( hdr.arg_len ){
-            size = _vapi_core_send( p_child->sock, p_arg, hdr.arg_len, MSG_NOSIGNAL );
-            if( size < 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
-            else if( size != hdr.arg_len ){ line = __LINE__; goto _err_end_; }
+    // the workers are ready before any connection
+    if( p_attr->worker_num ){
+        p_fd->p_workers = calloc( p_attr->worker_num, sizeof(pthread_t) );
+        if( !p_fd->p_workers ){ line = __LINE__; goto _err_end_; }
+        p_fd->work_alive = 1;
+        for(i=0; i<p_attr->worker_num; ++i){
+            err_code = pthread_create( &p_fd->p_workers[i], NULL, (void*)_vapi_core_sub_worker_thread, (void*)p_fd);
+            if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+            p_fd->worker_num++;
         }
+    }
 
-        if( p_arg ){ free( p_arg ); p_arg = NULL; }
+    // each listener has its own accept thread, among which the kernel spreads the connections
+    p_fd->thrd_alive = 1;
+    for(i=0; i<p_fd->lsn_num; ++i){
+        err_code = pthread_create( &p_fd->p_lsn[i].thrd, NULL, (void*)_vapi_core_sub_accept_thread, (void*)&p_fd->p_lsn[i]);
+        if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+        p_fd->p_lsn[i].thrd_started = 1;
     }
 
-    LOG_MSG("The peer(sock=0x%08x) side seems to be closed.\n", p_child->sock);
+    if( p_fd->metrics_sock >= 0 ){
+        err_code = pthread_create( &p_fd->metrics_thrd, NULL, (void*)_vapi_core_sub_metrics_thread, (void*)p_fd);
+        if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+        p_fd->metrics_started = 1;
+    }
 
-    if( p_arg ){ free( p_arg ); p_arg = NULL; }
-    close(p_child->sock);
-    free(p_child);
+    fd = _vapi_core_handle_alloc(_VAPI_CORE_HANDLE_SUB, p_fd);
+    if( fd == -1 ){ line = __LINE__; goto _err_end_; }
 
-    return NULL;
+    // found by vapi_core_open() of this process from now on
+    if( p_fd->local_call ){
+        pthread_mutex_lock(&_vapi_core_sub_registry_lock);
+        p_fd->p_registry_next = _vapi_core_sub_registry;
+        _vapi_core_sub_registry = p_fd;
+        pthread_mutex_unlock(&_vapi_core_sub_registry_lock);
+    }
+
+    return fd;
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( errsv ) ERR_MSG("errsv=%d\n", errsv);
     if( err_code ) ERR_MSG("err_code=%d\n", err_code);
 
-    if( p_arg ){ free( p_arg ); p_arg = NULL; }
-    close(p_child->sock);
-    free(p_child);
+    // the accept threads may have taken connections already
+    if( p_fd ) _vapi_core_sub_stop(p_fd);
+    if( p_fd ) _vapi_core_sub_unref(p_fd);
 
-    return NULL;
+    if( errsv ) errno = errsv;
+    return -1;
 }
 
-static void* _vapi_core_sub_accept_thread(_vapi_core_sub_t *p_fd)
+int32_t vapi_core_sub_close(int32_t fd)
 {
     int err_code = 0, line = 0, errsv = 0;
-    int sock;
-    struct sockaddr_in addr;
-    socklen_t len;
-    pthread_t       thrd;
-    pthread_attr_t  thrd_attr;
-    _vapi_core_sub_child_t *p_child = NULL;
-
-    p_fd->thrd_alive = 1;
+    _vapi_core_sub_t *p_fd = NULL;
 
-    err_code = pthread_attr_init( &thrd_attr );
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+    p_fd = _vapi_core_handle_free(fd, _VAPI_CORE_HANDLE_SUB);
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
 
-    err_code = pthread_attr_setdetachstate(&thrd_attr , PTHREAD_CREATE_DETACHED);
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+    // no more direct callers, and wait for the handlers being called by them.
+    // their deferred requests are completed as those of the connections.
+    if( p_fd->local_call ){
+        _vapi_core_sub_t **pp;
 
-    while( p_fd->thrd_alive ){
-        DBG_MSG("accepting...\n");
-        p_child = NULL;
-        sock = accept(p_fd->sock, (struct sockaddr*)&addr, &len);
-        if( sock==-1 ){
-            errsv = errno;
-            switch(errsv){
-              case EWOULDBLOCK /* Operation would block */:
-                continue;
-              default:
-                ERR_MSG("failed to accept. errsv=%d\n", errsv);
-                p_fd->thrd_alive = 0;
-                line = __LINE__;
-                goto _err_end_;
-            }
+        pthread_mutex_lock(&_vapi_core_sub_registry_lock);
+        for(pp = &_vapi_core_sub_registry; *pp; pp = &(*pp)->p_registry_next){
+            if( *pp == p_fd ){ *pp = p_fd->p_registry_next; break; }
         }
-
-        p_child = calloc(1, sizeof(_vapi_core_sub_child_t));
-        if( !p_child ){ line = __LINE__; goto _err_end_; }
-        
-        p_child->sock = sock;
-        p_child->handler = p_fd->handler;
-        p_child->p_cookie = p_fd->p_cookie;
-        err_code = pthread_create( &thrd, &thrd_attr,
-                                   (void*)_vapi_core_sub_child_thread, (void*)p_child);
-        if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
-        LOG_MSG("The new connection(sock=0x%08x) was accepted. \n", p_child->sock);
+        pthread_mutex_unlock(&_vapi_core_sub_registry_lock);
+
+        p_fd->local_closed = 1;
+        __sync_synchronize();
+        pthread_mutex_lock(&p_fd->lock);
+        while( p_fd->local_running )
+          pthread_cond_wait(&p_fd->child_cond, &p_fd->lock);
+        pthread_mutex_unlock(&p_fd->lock);
     }
 
-    err_code = pthread_attr_destroy( &thrd_attr );
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+    _vapi_core_sub_stop(p_fd);
 
-    return NULL;
+    // freed by the children if their deferred requests are still pending
+    _vapi_core_sub_unref(p_fd);
 
+    return 0;
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( errsv ) ERR_MSG("errsv=%d\n", errsv);
     if( err_code ) ERR_MSG("err_code=%d\n", err_code);
-    
-    if( p_child ) free(p_child);
-    p_fd->thrd_alive = 0;
-    pthread_attr_destroy( &thrd_attr );
 
-    return NULL;
+    return -1;
 }
 
-
-//=============================================================================
-// Global Function/Variable Implementations
-//=============================================================================
-int32_t vapi_core_sub_open(uint16_t port, vapi_core_sub_handler_t handler, const void *p_cookie)
+int32_t vapi_core_sub_publish(int32_t fd, int32_t topic, const void *p_data, uint32_t len)
 {
-    int err_code = 0, line = 0, errsv = 0;
+    int line = 0, i;
     _vapi_core_sub_t *p_fd = NULL;
-    struct sockaddr_in addr;
-    pthread_attr_t  thrd_attr;
-    struct timeval tv = { 2, 0 }; /* 2 sec */
-    socklen_t socklen = sizeof(addr);
+    _vapi_core_sub_child_t *p_child;
+    _vapi_core_sub_event_t *p_ev_inline = NULL, *p_ev_ring = NULL;
+    uint64_t ring_pos;
+    int ring_tried = 0, num = 0;
 
-    p_fd = calloc( 1, sizeof(_vapi_core_sub_t) );
+    if( len && !p_data ){ line = __LINE__; goto _err_end_; }
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_SUB);
     if( !p_fd ){ line = __LINE__; goto _err_end_; }
 
-    p_fd->handler = handler;
+    pthread_mutex_lock(&p_fd->lock);
 
-    p_fd->sock = socket(AF_INET, SOCK_STREAM, 0);
-    if( p_fd->sock==-1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    for(p_child = p_fd->p_child_list; p_child; p_child = p_child->p_next){
+        for(i=0; i<p_child->topic_num; ++i)
+          if( p_child->topics[i] == topic ) break;
+        if( i == p_child->topic_num ) continue;
 
-    err_code = setsockopt(p_fd->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); // for accept() timeout
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+        // serialize once per encoding, no matter how many subscribers
+        if( p_child->use_ring  &&  !ring_tried ){
+            ring_tried = 1;
+            if( _vapi_core_sub_ring_write(p_fd, p_data, len, &ring_pos) == 0 )
+              p_ev_ring = _vapi_core_sub_event_new(topic, p_data, len, ring_pos, 1);
+        }
+        if( p_child->use_ring  &&  p_ev_ring ){
+            _vapi_core_sub_event_push(p_child, p_ev_ring);
+        } else {
+            if( !p_ev_inline ) p_ev_inline = _vapi_core_sub_event_new(topic, p_data, len, 0, 0);
+            if( !p_ev_inline ){ pthread_mutex_unlock(&p_fd->lock); line = __LINE__; goto _err_end_; }
+            _vapi_core_sub_event_push(p_child, p_ev_inline);
+        }
+        num++;
+    }
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port   = htons(port);
-    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    err_code = bind(p_fd->sock, (struct sockaddr*)&addr, sizeof(addr));
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    pthread_mutex_unlock(&p_fd->lock);
 
-    err_code = listen(p_fd->sock, 5);
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+    if( p_ev_ring ) _vapi_core_sub_event_unref(p_ev_ring);
+    if( p_ev_inline ) _vapi_core_sub_event_unref(p_ev_inline);
 
-    err_code = getsockname(p_fd->sock, (struct sockaddr*)&addr, &socklen );
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
-    p_fd->port = ntohs(addr.sin_port);
+    return num;
 
-    err_code = pthread_attr_init( &thrd_attr );
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
-    err_code = pthread_create( &p_fd->thrd, &thrd_attr, (void*)_vapi_core_sub_accept_thread, (void*)p_fd);
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
-    err_code = pthread_attr_destroy( &thrd_attr );
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    if( p_ev_ring ) _vapi_core_sub_event_unref(p_ev_ring);
+
+    return -1;
+}
+
+int32_t vapi_core_sub_defer(void)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_sub_request_t *p_req = _vapi_core_sub_current;
+    _vapi_core_sub_request_t *p_pending = NULL;
+    int32_t token;
+
+    if( !p_req ){ line = __LINE__; errsv = EPERM; goto _err_end_; }
+    if( p_req->token ) return p_req->token;
+
+    p_pending = malloc(sizeof(_vapi_core_sub_request_t));
+    if( !p_pending ){ line = __LINE__; errsv = ENOMEM; goto _err_end_; }
+    *p_pending = *p_req;
 
-    return (int)p_fd;
+    token = _vapi_core_handle_alloc(_VAPI_CORE_HANDLE_TOKEN, p_pending);
+    if( token == -1 ){ line = __LINE__; errsv = EAGAIN; goto _err_end_; }
+
+    __sync_add_and_fetch(&p_req->p_child->ref, 1);
+    p_pending->token = p_req->token = token;
+
+    return token;
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( errsv ) ERR_MSG("errsv=%d\n", errsv);
-    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
 
-    if( p_fd && (p_fd->sock > 0) ) close(p_fd->sock);
-    if( p_fd ) free( p_fd );
-    
+    if( p_pending ) free(p_pending);
+    errno = errsv;
+
     return -1;
 }
 
-int32_t vapi_core_sub_close(int32_t fd)
+int32_t vapi_core_sub_complete(int32_t token, int32_t err_code, const void *p_data, uint32_t len)
 {
-    int err_code = 0, line = 0, errsv = 0;
+    int line = 0, errsv = 0;
+    _vapi_core_sub_request_t *p_pending;
+    _vapi_core_sub_child_t *p_child;
+
+    p_pending = _vapi_core_handle_free(token, _VAPI_CORE_HANDLE_TOKEN);
+    if( !p_pending ){ errno = EINVAL; ERR_MSG("invalid token=0x%08x\n", token); return -1; }
+    p_child = p_pending->p_child;
+
+    p_pending->hdr.err_code = err_code;
+    p_pending->hdr.errsv = errno;
+
+    if( p_data  &&  len > p_pending->hdr.arg_len ){
+        // the reply never exceeds the buffer of the host
+        p_pending->hdr.err_code = -1;
+        p_pending->hdr.errsv = EMSGSIZE;
+        line = __LINE__; errsv = EMSGSIZE;
+    } else if( p_data  &&  p_data != p_pending->p_arg ){
+        _vapi_core_copy(p_pending->p_arg, p_data, len);
+    }
+
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_HANDLED, p_child->trace_conn, p_pending->seq,
+                     p_pending->hdr.api_id, p_pending->hdr.arg_len);
+
+    _vapi_core_sub_count(p_child->p_sub, &p_pending->hdr);
+    _vapi_core_sub_capture(p_child, p_pending);
+
+    _vapi_core_sub_release(p_child, _vapi_core_body_len(&p_pending->hdr));
+
+    if( p_pending->p_flight ){
+        _vapi_core_sub_flight_finish(p_child->p_sub, p_pending->p_flight,
+                                     p_pending->hdr.err_code, p_pending->hdr.errsv, p_pending->p_arg);
+    }
+
+    if( _vapi_core_sub_reply(p_child, &p_pending->hdr, p_pending->p_arg) != 0  &&  !line ){
+        line = __LINE__; errsv = errno;
+    }
+
+    _VAPI_CORE_TRACE(VAPI_CORE_TRACE_SUB_SENT, p_child->trace_conn, p_pending->seq,
+                     p_pending->hdr.api_id, p_pending->hdr.arg_len);
+
+    _vapi_core_sub_req_arg_free(p_pending);
+    free(p_pending);
+    _vapi_core_sub_child_unref(p_child);
+
+    if( line ){
+        ERR_MSG("line=%d, errsv=%d\n", line, errsv);
+        errno = errsv;
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t vapi_core_sub_capture_start(int32_t fd, const char *p_path, uint32_t flags)
+{
+    int line = 0, errsv = 0;
     _vapi_core_sub_t *p_fd = NULL;
+    vapi_core_capture_hdr_t hdr;
+    FILE *p_file = NULL;
+
+    if( !p_path  ||  (flags & ~VAPI_CORE_SUB_CAPTURE_PAYLOAD) ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_SUB);
+    if( !p_fd ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+
+    // checked before the file of the running capture may be truncated
+    pthread_mutex_lock(&p_fd->capture_lock);
+    if( p_fd->p_capture ){ pthread_mutex_unlock(&p_fd->capture_lock); line = __LINE__; errsv = EBUSY; goto _err_end_; }
+
+    p_file = fopen(p_path, "wb");
+    if( !p_file ){ errsv = errno; pthread_mutex_unlock(&p_fd->capture_lock); line = __LINE__; goto _err_end_; }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = VAPI_CORE_CAPTURE_MAGIC;
+    hdr.version = VAPI_CORE_CAPTURE_VERSION;
+    hdr.rec_size = sizeof(vapi_core_capture_rec_t);
+    hdr.flags = flags;
+    hdr.start_sec = (uint64_t)time(NULL);
+    if( fwrite(&hdr, sizeof(hdr), 1, p_file) != 1 ){
+        errsv = errno; pthread_mutex_unlock(&p_fd->capture_lock); line = __LINE__; goto _err_end_;
+    }
 
-    if( fd == 0  ||  fd == -1 ){ line = __LINE__; goto _err_end_; }
-    p_fd = (_vapi_core_sub_t*)fd;
+    p_fd->p_capture = p_file;
+    p_fd->capture_flags = flags;
+    p_fd->capture_start_ns = _vapi_core_sub_now();
+    p_fd->capture_on = 1;
+    pthread_mutex_unlock(&p_fd->capture_lock);
 
-    p_fd->thrd_alive = 0;
-    err_code = pthread_join( p_fd->thrd, NULL );
-    if( err_code!=0 ){ line = __LINE__; goto _err_end_; }
+    return 0;
 
-    err_code = close(p_fd->sock);
-    if( err_code!=0 ){ line = __LINE__; errsv = errno;  goto _err_end_; }
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_file ) fclose(p_file);
+    errno = errsv;
+
+    return -1;
+}
+
+int32_t vapi_core_sub_capture_stop(int32_t fd)
+{
+    _vapi_core_sub_t *p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_SUB);
+
+    if( !p_fd ){
+        ERR_MSG("invalid descriptor(%d).\n", fd);
+        errno = EBADF;
+        return -1;
+    }
+
+    _vapi_core_sub_capture_close(p_fd);
+
+    return 0;
+}
+
+int32_t vapi_core_sub_get_stats(int32_t fd, vapi_core_sub_stats_t *p_stats)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_sub_t *p_fd = NULL;
+
+    if( !p_stats ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_SUB);
+    if( !p_fd ){ line = __LINE__; errsv = EBADF; goto _err_end_; }
+
+    pthread_mutex_lock(&p_fd->lock);
+    p_stats->conn_num = p_fd->child_num;
+    pthread_mutex_unlock(&p_fd->lock);
 
-    free(p_fd);
+    p_stats->inflight = p_fd->inflight;
+    p_stats->buffered = p_fd->buffered;
+    p_stats->buffered_peak = p_fd->buffered_peak;
+    p_stats->conn_buffered_peak = p_fd->conn_buffered_peak;
 
     return 0;
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( errsv ) ERR_MSG("errsv=%d\n", errsv);
-    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
 
+    errno = errsv;
     return -1;
 }
 
@@ -314,8 +2389,8 @@ int32_t vapi_core_sub_get_port(int32_t fd, uint16_t *p_port)
     int line = 0, errsv = 0;
     _vapi_core_sub_t *p_fd = NULL;
 
-    if( fd == 0  ||  fd == -1 ){ line = __LINE__; goto _err_end_; }
-    p_fd = (_vapi_core_sub_t*)fd;
+    p_fd = _vapi_core_handle_get(fd, _VAPI_CORE_HANDLE_SUB);
+    if( !p_fd ){ line = __LINE__; goto _err_end_; }
 
     *p_port = p_fd->port;
 
@@ -327,3 +2402,94 @@ int32_t vapi_core_sub_get_port(int32_t fd, uint16_t *p_port)
 
     return -1;
 }
+
+void* _vapi_core_sub_local_connect(uint16_t port)
+{
+    _vapi_core_sub_t *p_sub;
+    _vapi_core_sub_child_t *p_child = NULL;
+
+    pthread_mutex_lock(&_vapi_core_sub_registry_lock);
+    for(p_sub = _vapi_core_sub_registry; p_sub; p_sub = p_sub->p_registry_next)
+      if( p_sub->port == port ) break;
+
+    if( p_sub ){
+        p_child = calloc(1, sizeof(_vapi_core_sub_child_t));
+        if( p_child ){
+            p_child->ref = 1;
+            p_child->sock = -1;
+            p_child->rx_fd = -1;
+            p_child->local = 1;
+            p_child->handler = p_sub->handler;
+            p_child->p_cookie = p_sub->p_cookie;
+            p_child->p_sub = p_sub;
+            __sync_add_and_fetch(&p_sub->ref, 1);
+            __sync_add_and_fetch(&p_sub->local_num, 1);
+            pthread_mutex_init(&p_child->send_lock, NULL);
+            pthread_mutex_init(&p_child->ev_lock, NULL);
+            pthread_cond_init(&p_child->ev_cond, NULL);
+            pthread_cond_init(&p_child->local_cond, NULL);
+
+            pthread_mutex_lock(&p_sub->lock);
+            p_child->conn_id = p_sub->conn_seq++;
+            pthread_mutex_unlock(&p_sub->lock);
+        }
+    }
+    pthread_mutex_unlock(&_vapi_core_sub_registry_lock);
+
+    return p_child;
+}
+
+int32_t _vapi_core_sub_local_invoke(void *p_conn, int32_t api_id, void *p_arg, uint32_t arg_len, uint32_t flags)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_sub_child_t *p_child = (_vapi_core_sub_child_t*)p_conn;
+    _vapi_core_sub_t *p_sub = p_child->p_sub;
+    _vapi_core_sub_request_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.p_child = p_child;
+    req.hdr.api_id = api_id;
+    req.hdr.arg_len = arg_len;
+    req.hdr.flags = (flags & _VAPI_CORE_HDR_ONEWAY) ? _VAPI_CORE_HDR_ONEWAY : _VAPI_CORE_HDR_LOCAL;
+    req.p_arg = (char*)p_arg;
+
+    if( api_id < 0 ){
+        // only the control requests which need no socket
+        if( api_id != _VAPI_CORE_API_ID_PING  &&  api_id != _VAPI_CORE_API_ID_BARRIER ){ line = __LINE__; errsv = EINVAL; goto _err_end_; }
+        req.hdr.err_code = _vapi_core_sub_control(p_child, &req.hdr, p_arg);
+        req.hdr.errsv = errno;
+    } else {
+        // counted before checking, so that vapi_core_sub_close() either waits for it or it sees the close
+        __sync_add_and_fetch(&p_sub->local_running, 1);
+        errsv = p_sub->local_closed ? ECONNRESET : _vapi_core_sub_local_call(p_child, &req);
+        if( __sync_sub_and_fetch(&p_sub->local_running, 1) == 0  &&  p_sub->local_closed ){
+            pthread_mutex_lock(&p_sub->lock);
+            pthread_cond_broadcast(&p_sub->child_cond);
+            pthread_mutex_unlock(&p_sub->lock);
+        }
+        if( errsv ){ line = __LINE__; goto _err_end_; }
+    }
+
+    // the failure of a one-way request is told by the barrier
+    if( !(req.hdr.flags & _VAPI_CORE_HDR_ONEWAY)  &&  req.hdr.err_code != 0 ){
+        errno = req.hdr.errsv;
+        return -1;
+    }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    errno = errsv;
+    return -1;
+}
+
+void _vapi_core_sub_local_close(void *p_conn)
+{
+    _vapi_core_sub_child_t *p_child = (_vapi_core_sub_child_t*)p_conn;
+
+    __sync_sub_and_fetch(&p_child->p_sub->local_num, 1);
+    _vapi_core_sub_child_unref(p_child);
+}
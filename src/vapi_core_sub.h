@@ -37,6 +37,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //=============================================================================
 // Macro/Type/Enumeration/Structure Definitions
 //=============================================================================
+#define VAPI_CORE_SUB_PENDING (0x7fffffff) /* returned by a deferring handler */
+
+#define VAPI_CORE_SUB_CAPTURE_PAYLOAD (0x00000001) /* flags of vapi_core_sub_capture_start() */
 
 /*!
   \brief
@@ -44,7 +47,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
   called when an invoked request is received from the host side.
 
   \param[in] api_id
-  The API function ID to be executed.
+  The API function ID to be executed. Negative values are reserved by
+  the library and never passed to the handler.
 
   \param[in,out] p_arg
   The pointer to the arguments.
@@ -58,9 +62,152 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
   \return
   0 for success, and the other values for handling error.
   If not 0, vapi_core_invoke() of the host side will return error.
+  If the request was deferred by vapi_core_sub_defer(), the return value is
+  ignored and VAPI_CORE_SUB_PENDING should be returned.
 */
 typedef int (*vapi_core_sub_handler_t)(int32_t api_id, void* p_arg, uint32_t arg_len, void *p_cookie);
 
+/*!
+  \brief
+  "vapi_core_sub_provider_t" is the type of function to be called with
+  the header of a request received over the socket, before its arguments,
+  to provide the memory they are received into, so that the handler gets
+  them in place with no copy. The memory is passed to the handler as
+  "p_arg", and its reply is sent from it. It is never freed by the library,
+  and must stay valid until it is given to "provider_release", which is
+  called once the reply is sent: after the handler returns, or after
+  vapi_core_sub_complete() if the request was deferred. It is given back as
+  well if the arguments fail to be received, or the reply to be sent. A
+  rejected request is never given any memory.
+
+  \param[in] api_id
+  The API function ID of the request.
+
+  \param[in] arg_len
+  The length of the arguments, which is never 0.
+
+  \param[in,out] p_cookie
+  The pointer to the user data, the same as the handler's.
+
+  \return
+  The memory of "arg_len" bytes at least, or NULL to receive into the
+  memory of the library as usual.
+*/
+typedef void* (*vapi_core_sub_provider_t)(int32_t api_id, uint32_t arg_len, void *p_cookie);
+
+/*!
+  \brief
+  "vapi_core_sub_provider_release_t" is the type of function to be called
+  with the memory of "vapi_core_sub_provider_t" once the library is done
+  with it, so that the user frees or reuses it.
+
+  \param[in] api_id
+  The API function ID of the request.
+
+  \param[in] p_arg
+  The memory returned by the provider for the request.
+
+  \param[in] arg_len
+  The length of the arguments, the same as the provider's.
+
+  \param[in,out] p_cookie
+  The pointer to the user data, the same as the handler's.
+*/
+typedef void (*vapi_core_sub_provider_release_t)(int32_t api_id, void *p_arg, uint32_t arg_len, void *p_cookie);
+
+/*!
+  \brief
+  "vapi_core_sub_attr_t" is the attributes of vapi_core_sub_open_attr(),
+  which must be initialized by vapi_core_sub_attr_init().
+*/
+typedef struct
+{
+    uint16_t port;       /*!< The port number to be listened, 0 for any. */
+    int backlog;         /*!< The backlog of each listening socket, SOMAXCONN by default. */
+    int listener_num;    /*!< The number of the listening sockets sharing the port by
+                              SO_REUSEPORT, each of which has its own accept thread.
+                              1 by default. */
+    uint32_t max_conn;   /*!< The maximum number of the connections, each of which
+                              has its own thread. The others are closed as soon as
+                              accepted. 0 for no limit, by default. */
+    uint32_t max_inflight; /*!< The maximum number of the requests being handled,
+                              including the deferred ones. The others are rejected
+                              with EBUSY without calling the handler. 0 for no
+                              limit, by default. */
+    uint64_t max_buffered; /*!< The maximum total bytes of the arguments received
+                              for the requests being handled. The others are
+                              rejected with ENOBUFS without being buffered. The
+                              arguments in vapi_core_alloc() memory do not count.
+                              With this or "max_conn_buffered", the receive
+                              buffer of the large arguments is released after
+                              each request instead of being kept for the next
+                              one. 0 for no limit, by default. */
+    uint64_t max_conn_buffered; /*!< The same as "max_buffered" but of each connection,
+                              so that a peer cannot take the budget of the others.
+                              0 for no limit, by default. */
+    const int32_t *p_coalesce_ids; /*!< The api_ids whose identical requests, with the
+                              same arguments, are coalesced while one of them is
+                              being handled: the handler runs once, and the others
+                              get a copy of its reply. Copied by
+                              vapi_core_sub_open_attr(). NULL by default. */
+    uint32_t coalesce_num; /*!< The number of "p_coalesce_ids". */
+    vapi_core_sub_provider_t provider; /*!< The function providing the memory of the
+                              arguments of "p_provider_ids". Not called for the
+                              arguments in vapi_core_alloc() memory, nor for the
+                              direct calls by "local_call", which pass the
+                              arguments of the caller. NULL by default. */
+    vapi_core_sub_provider_release_t provider_release; /*!< The function given the memory
+                              of "provider" back. NULL by default, with which
+                              the user has to tell by itself when it is done. */
+    const int32_t *p_provider_ids; /*!< The api_ids whose arguments are received into
+                              the memory of "provider". Copied by
+                              vapi_core_sub_open_attr(). NULL by default. */
+    uint32_t provider_num; /*!< The number of "p_provider_ids". */
+    int worker_num;      /*!< The number of the worker threads shared by the connections,
+                              which run the handler of the requests invoked with
+                              VAPI_CORE_INVOKE_UNORDERED concurrently, while the
+                              connection goes on to the next request. Their
+                              replies are sent as soon as each completes. 0 for
+                              no workers, by default, with which all the requests
+                              of a connection are handled in order. */
+    uint16_t metrics_port; /*!< The port on 127.0.0.1 serving the metrics of the
+                              descriptor over HTTP in the Prometheus text format,
+                              by its own thread. 0 for none, by default. */
+    const char *p_metrics_path; /*!< The path of a unix socket serving the metrics
+                              instead of "metrics_port". A socket left there is
+                              replaced, any other file fails the open. It is
+                              removed when closed. NULL by default. */
+    int local_call;      /*!< 1 to let vapi_core_open() of the same process on the port
+                              call the handler directly on the calling thread,
+                              with the arguments of the caller and no socket.
+                              The descriptor connects the socket when first
+                              used for the other than vapi_core_invoke(),
+                              vapi_core_invoke_oneway() and vapi_core_barrier().
+                              0 to always go through the socket, by default. */
+    int unix_socket;     /*!< 1 to listen on an abstract unix socket as well, to which
+                              vapi_core_open() moves from TCP after negotiating
+                              it. 0 to serve TCP only. 1 by default. */
+    int shm;             /*!< 1 to let the hosts pass the arguments allocated by
+                              vapi_core_alloc() in a region shared with the sub.
+                              0 to refuse it, when vapi_core_alloc() returns NULL.
+                              1 by default. */
+} vapi_core_sub_attr_t;
+
+/*!
+  \brief
+  "vapi_core_sub_stats_t" is the usage of a descriptor, gotten by
+  vapi_core_sub_get_stats().
+*/
+typedef struct
+{
+    uint32_t conn_num;   /*!< The number of the connections. */
+    uint32_t inflight;   /*!< The number of the requests being handled, including
+                              the deferred ones. */
+    uint64_t buffered;   /*!< The total bytes of the arguments buffered for them. */
+    uint64_t buffered_peak; /*!< The peak of "buffered" since opened. */
+    uint64_t conn_buffered_peak; /*!< The peak of the bytes buffered for a connection. */
+} vapi_core_sub_stats_t;
+
 
 //=============================================================================
 // Global Function/Variable Prototypes
@@ -90,9 +237,47 @@ int32_t vapi_core_sub_open(uint16_t port, vapi_core_sub_handler_t handler, const
 
 /*!
   \brief
-  "vapi_core_sub_close()" close the listened socket.
-  However the accepted sockets would not be closed. This sockets should
-  be closed by the host side.
+  "vapi_core_sub_attr_init()" initializes the attributes with the defaults
+  of vapi_core_sub_open().
+
+  \param[out] p_attr
+  The pointer to the attributes.
+*/
+void vapi_core_sub_attr_init(vapi_core_sub_attr_t *p_attr);
+
+
+/*!
+  \brief
+  "vapi_core_sub_open_attr()" is the same as vapi_core_sub_open() but takes
+  the attributes. With "listener_num" more than 1, the listening sockets
+  are bound to the same port by SO_REUSEPORT, and the kernel spreads the
+  incoming connections over them and their accept threads, so that the
+  connection storms are accepted on several cores.
+  The limits of the attributes keep an overloaded sub responsive: the excess
+  connections and requests are refused at once instead of queued, and the
+  host sees the reason in errno.
+
+  \param[in] p_attr
+  The pointer to the attributes.
+
+  \param[in] handler
+  The handler function to be called when an invoked request is received from
+  the host side.
+
+  \param[in] p_cookie
+  The pointer to the user data.
+
+  \return
+  It returns a descriptor. If error happened, -1 will return.
+*/
+int32_t vapi_core_sub_open_attr(const vapi_core_sub_attr_t *p_attr, vapi_core_sub_handler_t handler, const void *p_cookie);
+
+
+/*!
+  \brief
+  "vapi_core_sub_close()" close the listened socket and all the accepted
+  sockets. It returns as soon as the handlers running at that time return,
+  including those of the unordered requests already queued to the workers.
 
   \param[in] fd
   The descriptor.
@@ -118,4 +303,131 @@ int32_t vapi_core_sub_close(int32_t fd);
 */
 int32_t vapi_core_sub_get_port(int32_t fd, uint16_t *p_port);
 
+
+/*!
+  \brief
+  "vapi_core_sub_get_stats()" gets the current and the peak usage of the
+  descriptor, to be compared with the limits of vapi_core_sub_attr_t.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[out] p_stats
+  The pointer of the usage.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_sub_get_stats(int32_t fd, vapi_core_sub_stats_t *p_stats);
+
+
+/*!
+  \brief
+  "vapi_core_sub_publish()" broadcasts an event of the "topic" to all the
+  host processes subscribing it by vapi_core_subscribe().
+  The event is serialized only once, and queued to the bounded queue of each
+  subscriber without waiting for any acknowledgement. Subscribers on the same
+  host receive the payload through a shared memory ring. If the queue of a
+  slow subscriber is full, the event is dropped for it.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] topic
+  The topic of the event.
+
+  \param[in] p_data
+  The pointer to the payload of the event.
+
+  \param[in] len
+  The length of the payload.
+
+  \return
+  The number of subscribers the event was queued to, and -1 for error.
+*/
+int32_t vapi_core_sub_publish(int32_t fd, int32_t topic, const void *p_data, uint32_t len);
+
+
+
+/*!
+  \brief
+  "vapi_core_sub_defer()" defers the reply of the request being handled by
+  the calling handler, which returns VAPI_CORE_SUB_PENDING right after it.
+  The connection goes on to the next request, and the reply is sent when
+  vapi_core_sub_complete() is called with the returned token from any thread.
+  The arguments "p_arg" of the handler stay valid until then, and belong to
+  the token. Every token must be completed once, even after
+  vapi_core_sub_close().
+
+  \return
+  The token of the request. If not called from a handler or error happened,
+  -1 will return.
+*/
+int32_t vapi_core_sub_defer(void);
+
+
+/*!
+  \brief
+  "vapi_core_sub_complete()" sends the reply of a request deferred by
+  vapi_core_sub_defer(), and releases the token.
+
+  \param[in] token
+  The token returned by vapi_core_sub_defer().
+
+  \param[in] err_code
+  The result as returned by a handler. errno is passed to the host as well.
+
+  \param[in] p_data
+  The data to be copied to the arguments of the reply. If NULL, the
+  arguments which the handler got are replied as they are.
+
+  \param[in] len
+  The length of "p_data", which must not exceed the length of the arguments.
+
+  \return
+  0 for success, and -1 for error. The token is released even on error,
+  except for an invalid token.
+*/
+int32_t vapi_core_sub_complete(int32_t token, int32_t err_code, const void *p_data, uint32_t len);
+
+
+
+/*!
+  \brief
+  "vapi_core_sub_capture_start()" starts recording the requests handled by
+  the descriptor into a file, which "vapi_core_replay" re-issues against a
+  sub process to reproduce the traffic. The format is of vapi_core_capture.h.
+  Every request to the handler is recorded with its arrival time, api_id,
+  length, connection and latency. The requests rejected by the limits of
+  vapi_core_sub_attr_t are not.
+
+  \param[in] fd
+  The descriptor.
+
+  \param[in] p_path
+  The path of the file, which is truncated.
+
+  \param[in] flags
+  0, or VAPI_CORE_SUB_CAPTURE_PAYLOAD to record the arguments as received
+  as well, which are copied before the handler runs.
+
+  \return
+  0 for success, and -1 for error. It fails with EBUSY if already capturing.
+*/
+int32_t vapi_core_sub_capture_start(int32_t fd, const char *p_path, uint32_t flags);
+
+
+/*!
+  \brief
+  "vapi_core_sub_capture_stop()" stops the capture and closes the file.
+  vapi_core_sub_close() stops it as well.
+
+  \param[in] fd
+  The descriptor.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_sub_capture_stop(int32_t fd);
+
 #endif // _VAPI_CORE_SUB_H_
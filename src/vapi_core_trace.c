@@ -0,0 +1,351 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_local.h"
+#include "vapi_core_trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stdout, "[VAPI_CORE_TRACE][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_TRACE][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#ifdef VAPI_CORE_TRACE
+
+#define _VAPI_CORE_TRACE_RING_LEN (1 << 16) /* records per thread, power of 2 */
+
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE (1)
+#endif
+#ifndef MREMAP_FIXED
+#define MREMAP_FIXED   (2)
+#endif
+
+typedef struct __vapi_core_trace_buf_t
+{
+    struct __vapi_core_trace_buf_t *p_next;      /* all the buffers */
+    struct __vapi_core_trace_buf_t *p_next_free; /* buffers of exited threads */
+    vapi_core_trace_ring_t *p_ring;
+    size_t map_len;
+    int file;                                    /* a file of the directory, or anonymous */
+} _vapi_core_trace_buf_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static pthread_mutex_t _vapi_core_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _vapi_core_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _vapi_core_trace_key;
+static _vapi_core_trace_buf_t *_vapi_core_trace_list = NULL;
+static _vapi_core_trace_buf_t *_vapi_core_trace_free = NULL;
+static char _vapi_core_trace_dir[PATH_MAX];
+static uint32_t _vapi_core_trace_file_num = 0;
+
+static __thread _vapi_core_trace_buf_t *_vapi_core_trace_tls = NULL;
+static __thread uint32_t _vapi_core_trace_tid = 0;
+
+/* gives the buffer of an exited thread to the next thread */
+static void _vapi_core_trace_retire(void *p_arg)
+{
+    _vapi_core_trace_buf_t *p_buf = (_vapi_core_trace_buf_t*)p_arg;
+
+    pthread_mutex_lock(&_vapi_core_trace_lock);
+    p_buf->p_next_free = _vapi_core_trace_free;
+    _vapi_core_trace_free = p_buf;
+    pthread_mutex_unlock(&_vapi_core_trace_lock);
+}
+
+static void _vapi_core_trace_init(void)
+{
+    pthread_key_create(&_vapi_core_trace_key, _vapi_core_trace_retire);
+}
+
+/* must be called with _vapi_core_trace_lock held, maps a new file of the directory */
+static void* _vapi_core_trace_file_map(size_t map_len)
+{
+    int line = 0, errsv = 0;
+    char path[PATH_MAX + 64];
+    int file_fd = -1;
+    void *p_map;
+
+    snprintf(path, sizeof(path), "%s/vapi_core_trace.%d.%u", _vapi_core_trace_dir, (int)getpid(), _vapi_core_trace_file_num++);
+    file_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if( file_fd == -1 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    if( ftruncate(file_fd, map_len) != 0 ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    p_map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, file_fd, 0);
+    if( p_map == MAP_FAILED ){ line = __LINE__; errsv = errno; goto _err_end_; }
+    close(file_fd);
+
+    return p_map;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( file_fd >= 0 ) close(file_fd);
+
+    return MAP_FAILED;
+}
+
+/* must be called with _vapi_core_trace_lock held */
+static _vapi_core_trace_buf_t* _vapi_core_trace_buf_new(void)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_trace_buf_t *p_buf = NULL;
+    void *p_map;
+
+    p_buf = calloc( 1, sizeof(_vapi_core_trace_buf_t) );
+    if( !p_buf ){ line = __LINE__; goto _err_end_; }
+    p_buf->map_len = sizeof(vapi_core_trace_ring_t) + _VAPI_CORE_TRACE_RING_LEN * sizeof(vapi_core_trace_rec_t);
+
+    if( _vapi_core_trace_dir[0] ){
+        p_map = _vapi_core_trace_file_map(p_buf->map_len);
+        p_buf->file = 1;
+    } else {
+        p_map = mmap(NULL, p_buf->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( p_map == MAP_FAILED ) errsv = errno;
+    }
+    if( p_map == MAP_FAILED ){ line = __LINE__; goto _err_end_; }
+
+    p_buf->p_ring = (vapi_core_trace_ring_t*)p_map;
+    p_buf->p_ring->version = VAPI_CORE_TRACE_VERSION;
+    p_buf->p_ring->rec_size = sizeof(vapi_core_trace_rec_t);
+    p_buf->p_ring->capacity = _VAPI_CORE_TRACE_RING_LEN;
+    p_buf->p_ring->pid = getpid();
+    p_buf->p_ring->head = 0;
+    p_buf->p_ring->magic = VAPI_CORE_TRACE_MAGIC;
+
+    p_buf->p_next = _vapi_core_trace_list;
+    _vapi_core_trace_list = p_buf;
+
+    return p_buf;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_buf ) free(p_buf);
+
+    return NULL;
+}
+
+/*
+  must be called with _vapi_core_trace_lock held. moves an anonymous ring
+  into a file of the directory at the same address, which its thread keeps
+  writing without a lock: a record stamped during the copy may be lost.
+*/
+static int _vapi_core_trace_buf_move(_vapi_core_trace_buf_t *p_buf)
+{
+    int line = 0, errsv = 0;
+    void *p_map;
+
+    p_map = _vapi_core_trace_file_map(p_buf->map_len);
+    if( p_map == MAP_FAILED ){ line = __LINE__; goto _err_end_; }
+
+    memcpy(p_map, p_buf->p_ring, p_buf->map_len);
+    if( syscall(SYS_mremap, p_map, p_buf->map_len, p_buf->map_len, MREMAP_MAYMOVE | MREMAP_FIXED, p_buf->p_ring) == -1 ){
+        line = __LINE__; errsv = errno;
+        munmap(p_map, p_buf->map_len);
+        goto _err_end_;
+    }
+    p_buf->file = 1;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    return -1;
+}
+
+static _vapi_core_trace_buf_t* _vapi_core_trace_attach(void)
+{
+    _vapi_core_trace_buf_t *p_buf;
+
+    pthread_once(&_vapi_core_trace_once, _vapi_core_trace_init);
+
+    pthread_mutex_lock(&_vapi_core_trace_lock);
+    p_buf = _vapi_core_trace_free;
+    if( p_buf ){
+        _vapi_core_trace_free = p_buf->p_next_free;
+    } else {
+        p_buf = _vapi_core_trace_buf_new();
+    }
+    pthread_mutex_unlock(&_vapi_core_trace_lock);
+
+    if( p_buf ){
+        pthread_setspecific(_vapi_core_trace_key, p_buf);
+        _vapi_core_trace_tls = p_buf;
+        _vapi_core_trace_tid = (uint32_t)syscall(SYS_gettid);
+    }
+
+    return p_buf;
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+volatile int _vapi_core_trace_enabled = 0;
+
+void _vapi_core_trace_record(uint8_t stage, uint16_t conn, uint32_t seq, int32_t api_id, uint32_t arg_len)
+{
+    _vapi_core_trace_buf_t *p_buf = _vapi_core_trace_tls;
+    vapi_core_trace_ring_t *p_ring;
+    vapi_core_trace_rec_t *p_rec;
+    struct timespec ts;
+    uint64_t head;
+
+    if( !p_buf  &&  !(p_buf = _vapi_core_trace_attach()) ) return;
+
+    // single writer per ring, so that no atomic read-modify-write is needed
+    p_ring = p_buf->p_ring;
+    head = p_ring->head;
+    p_rec = (vapi_core_trace_rec_t*)(p_ring + 1) + (head & (_VAPI_CORE_TRACE_RING_LEN - 1));
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    p_rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    p_rec->api_id = api_id;
+    p_rec->seq = seq;
+    p_rec->arg_len = arg_len;
+    p_rec->tid = _vapi_core_trace_tid;
+    p_rec->conn = conn;
+    p_rec->stage = stage;
+
+    __atomic_store_n(&p_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int32_t vapi_core_trace_start(const char *p_dir)
+{
+    int line = 0;
+    _vapi_core_trace_buf_t *p_buf;
+
+    if( p_dir  &&  strlen(p_dir) >= sizeof(_vapi_core_trace_dir) ){ line = __LINE__; goto _err_end_; }
+
+    pthread_mutex_lock(&_vapi_core_trace_lock);
+    if( p_dir ) strcpy(_vapi_core_trace_dir, p_dir);
+    else _vapi_core_trace_dir[0] = '\0';
+
+    // the rings of the threads which stamped before, with their records
+    for(p_buf = _vapi_core_trace_list; p_dir  &&  p_buf; p_buf = p_buf->p_next)
+      if( !p_buf->file ) _vapi_core_trace_buf_move(p_buf);
+    pthread_mutex_unlock(&_vapi_core_trace_lock);
+
+    _vapi_core_trace_enabled = 1;
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    return -1;
+}
+
+int32_t vapi_core_trace_stop(void)
+{
+    _vapi_core_trace_enabled = 0;
+    return 0;
+}
+
+int32_t vapi_core_trace_dump(const char *p_path)
+{
+    int line = 0, errsv = 0;
+    _vapi_core_trace_buf_t *p_buf;
+    FILE *p_file = NULL;
+
+    p_file = fopen(p_path, "wb");
+    if( !p_file ){ line = __LINE__; errsv = errno; goto _err_end_; }
+
+    pthread_mutex_lock(&_vapi_core_trace_lock);
+    for(p_buf = _vapi_core_trace_list; p_buf; p_buf = p_buf->p_next){
+        if( fwrite(p_buf->p_ring, p_buf->map_len, 1, p_file) != 1 ){
+            pthread_mutex_unlock(&_vapi_core_trace_lock);
+            line = __LINE__; errsv = errno; goto _err_end_;
+        }
+    }
+    pthread_mutex_unlock(&_vapi_core_trace_lock);
+
+    if( fclose(p_file) != 0 ){ p_file = NULL; line = __LINE__; errsv = errno; goto _err_end_; }
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( errsv ) ERR_MSG("errsv=%d\n", errsv);
+
+    if( p_file ) fclose(p_file);
+
+    return -1;
+}
+
+#else // VAPI_CORE_TRACE
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int32_t vapi_core_trace_start(const char *p_dir)
+{
+    (void)p_dir;
+    ERR_MSG("the library was built without VAPI_CORE_TRACE.\n");
+    return -1;
+}
+
+int32_t vapi_core_trace_stop(void)
+{
+    return -1;
+}
+
+int32_t vapi_core_trace_dump(const char *p_path)
+{
+    (void)p_path;
+    ERR_MSG("the library was built without VAPI_CORE_TRACE.\n");
+    return -1;
+}
+
+#endif // VAPI_CORE_TRACE
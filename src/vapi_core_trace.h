@@ -0,0 +1,142 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+#ifndef _VAPI_CORE_TRACE_H_
+#define _VAPI_CORE_TRACE_H_
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include <stdint.h>
+
+//=============================================================================
+// Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define VAPI_CORE_TRACE_MAGIC   (0x56415054) /* "VAPT" */
+#define VAPI_CORE_TRACE_VERSION (1)
+
+/*!
+  \brief
+  The stages of a request stamped by the tracing. Requests are matched
+  between the host and the sub by "conn" and "seq" of the records.
+*/
+enum vapi_core_trace_stage_e
+{
+    VAPI_CORE_TRACE_HOST_SEND = 1, /* vapi_core_invoke() starts sending      */
+    VAPI_CORE_TRACE_HOST_SENT,     /* the request was handed to the kernel   */
+    VAPI_CORE_TRACE_HOST_REPLY,    /* the reply header arrived               */
+    VAPI_CORE_TRACE_HOST_DONE,     /* the reply was received                 */
+    VAPI_CORE_TRACE_SUB_RECV,      /* the request header arrived             */
+    VAPI_CORE_TRACE_SUB_RECEIVED,  /* the request was received               */
+    VAPI_CORE_TRACE_SUB_HANDLED,   /* the handler returned                   */
+    VAPI_CORE_TRACE_SUB_SENT,      /* the reply was handed to the kernel     */
+};
+
+/*!
+  \brief
+  A record of the trace ring buffer.
+*/
+typedef struct
+{
+    uint64_t ts_ns;    /* CLOCK_MONOTONIC */
+    int32_t api_id;
+    uint32_t seq;      /* request sequence number on the connection */
+    uint32_t arg_len;
+    uint32_t tid;
+    uint16_t conn;     /* the port number of the host side of the connection */
+    uint8_t stage;
+    uint8_t reserved[3];
+} vapi_core_trace_rec_t;
+
+/*!
+  \brief
+  The header of a trace ring buffer, followed by "capacity" records.
+  Records are written to "head % capacity" by a single thread without lock,
+  so the valid ones are from "head - capacity" (or 0) to "head".
+  The dump file is the concatenation of the ring buffers of all threads.
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t capacity;
+    uint32_t pid;
+    volatile uint64_t head;
+    uint8_t reserved[40];
+} vapi_core_trace_ring_t;
+
+
+//=============================================================================
+// Global Function/Variable Prototypes
+//=============================================================================
+
+/*!
+  \brief
+  "vapi_core_trace_start()" starts stamping the stages of the requests into
+  the per-thread ring buffers.
+  The tracing is available only if the library was built with
+  "-DVAPI_CORE_TRACE". Otherwise the stamps are compiled out at all.
+
+  \param[in] p_dir
+  If not NULL, the ring buffers are mmapped files created in the directory,
+  which can be read while the process runs or after it died. The buffers
+  of the threads which stamped before are moved into files as well. If NULL,
+  the ring buffers are anonymous memory to be dumped by vapi_core_trace_dump().
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_trace_start(const char *p_dir);
+
+
+/*!
+  \brief
+  "vapi_core_trace_stop()" stops the tracing. The records are kept.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_trace_stop(void);
+
+
+/*!
+  \brief
+  "vapi_core_trace_dump()" writes the ring buffers of all threads to a file,
+  which can be converted into the Chrome trace / Perfetto JSON format by
+  "vapi_core_trace_decode".
+
+  \param[in] p_path
+  The path of the file.
+
+  \return
+  0 for success, and -1 for error.
+*/
+int32_t vapi_core_trace_dump(const char *p_path);
+
+#endif // _VAPI_CORE_TRACE_H_
@@ -0,0 +1,236 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "vapi_core_trace.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_TRACE_DECODE][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[VAPI_CORE_TRACE_DECODE][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#define STAGE_NUM (VAPI_CORE_TRACE_SUB_SENT + 1)
+
+typedef struct
+{
+    vapi_core_trace_rec_t rec;
+    uint32_t pid;
+} trace_rec_t;
+
+typedef struct
+{
+    const char *p_name;
+    uint8_t from, to;
+} trace_span_t;
+
+typedef struct
+{
+    uint64_t num, sum_ns, max_ns;
+} trace_stat_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+
+/* the spans between two stages, in the order of the request */
+static const trace_span_t span_table[] = {
+    { "host send",    VAPI_CORE_TRACE_HOST_SEND,     VAPI_CORE_TRACE_HOST_SENT     },
+    { "kernel queue", VAPI_CORE_TRACE_HOST_SENT,     VAPI_CORE_TRACE_SUB_RECV      },
+    { "sub recv",     VAPI_CORE_TRACE_SUB_RECV,      VAPI_CORE_TRACE_SUB_RECEIVED  },
+    { "handler",      VAPI_CORE_TRACE_SUB_RECEIVED,  VAPI_CORE_TRACE_SUB_HANDLED   },
+    { "sub reply",    VAPI_CORE_TRACE_SUB_HANDLED,   VAPI_CORE_TRACE_SUB_SENT      },
+    { "host wait",    VAPI_CORE_TRACE_HOST_SENT,     VAPI_CORE_TRACE_HOST_REPLY    },
+    { "host recv",    VAPI_CORE_TRACE_HOST_REPLY,    VAPI_CORE_TRACE_HOST_DONE     },
+};
+#define SPAN_NUM (sizeof(span_table)/sizeof(span_table[0]))
+
+static trace_rec_t *rec_table = NULL;
+static size_t rec_num = 0, rec_cap = 0;
+static int first_event = 1;
+
+static int load_file(const char *p_path)
+{
+    int line = 0;
+    FILE *p_file = NULL;
+    vapi_core_trace_ring_t ring;
+    vapi_core_trace_rec_t *p_recs = NULL;
+    uint64_t i, start;
+
+    p_file = fopen(p_path, "rb");
+    if( !p_file ){ line = __LINE__; goto _err_end_; }
+
+    while( fread(&ring, sizeof(ring), 1, p_file) == 1 ){
+        if( ring.magic != VAPI_CORE_TRACE_MAGIC  ||  ring.version != VAPI_CORE_TRACE_VERSION  ||
+            ring.rec_size != sizeof(vapi_core_trace_rec_t)  ||  ring.capacity == 0 ){ line = __LINE__; goto _err_end_; }
+
+        p_recs = malloc( (size_t)ring.capacity * sizeof(vapi_core_trace_rec_t) );
+        if( !p_recs ){ line = __LINE__; goto _err_end_; }
+        if( fread(p_recs, sizeof(vapi_core_trace_rec_t), ring.capacity, p_file) != ring.capacity ){ line = __LINE__; goto _err_end_; }
+
+        start = ring.head > ring.capacity ? ring.head - ring.capacity : 0;
+        for(i=start; i<ring.head; ++i){
+            if( rec_num == rec_cap ){
+                trace_rec_t *p_new;
+                rec_cap = rec_cap ? rec_cap * 2 : 4096;
+                p_new = realloc(rec_table, rec_cap * sizeof(trace_rec_t));
+                if( !p_new ){ line = __LINE__; goto _err_end_; }
+                rec_table = p_new;
+            }
+            rec_table[rec_num].rec = p_recs[ i % ring.capacity ];
+            rec_table[rec_num].pid = ring.pid;
+            rec_num++;
+        }
+
+        free(p_recs);
+        p_recs = NULL;
+    }
+
+    fclose(p_file);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d, path=%s\n", line, p_path);
+
+    if( p_recs ) free(p_recs);
+    if( p_file ) fclose(p_file);
+
+    return -1;
+}
+
+static int compare_rec(const void *p_a, const void *p_b)
+{
+    const vapi_core_trace_rec_t *a = &((const trace_rec_t*)p_a)->rec;
+    const vapi_core_trace_rec_t *b = &((const trace_rec_t*)p_b)->rec;
+
+    if( a->conn != b->conn ) return a->conn < b->conn ? -1 : 1;
+    if( a->seq != b->seq ) return a->seq < b->seq ? -1 : 1;
+    if( a->ts_ns != b->ts_ns ) return a->ts_ns < b->ts_ns ? -1 : 1;
+    return 0;
+}
+
+static void print_event(const char *p_name, const char *p_ph, const trace_rec_t *p_at, uint64_t dur_ns,
+                        const trace_rec_t *p_req)
+{
+    printf("%s\n  {\"name\":\"%s\",\"cat\":\"vapi_core\",\"ph\":\"%s\",\"ts\":%.3f,",
+           first_event ? "" : ",", p_name, p_ph, p_at->rec.ts_ns / 1000.0);
+    if( p_ph[0] == 'X' ) printf("\"dur\":%.3f,", dur_ns / 1000.0);
+    if( p_ph[0] == 's'  ||  p_ph[0] == 'f' ) printf("\"id\":\"%u.%u\",\"bp\":\"e\",", p_req->rec.conn, p_req->rec.seq);
+    printf("\"pid\":%u,\"tid\":%u,\"args\":{\"api_id\":%d,\"arg_len\":%u,\"conn\":%u,\"seq\":%u}}",
+           p_at->pid, p_at->rec.tid, p_req->rec.api_id, p_req->rec.arg_len, p_req->rec.conn, p_req->rec.seq);
+    first_event = 0;
+}
+
+/* prints the spans of the records of a request */
+static void print_request(trace_rec_t **pp_stage, trace_stat_t *p_stat)
+{
+    const trace_rec_t *p_from, *p_to, *p_req;
+    uint64_t dur;
+    size_t i;
+
+    p_req = pp_stage[VAPI_CORE_TRACE_HOST_SEND] ? pp_stage[VAPI_CORE_TRACE_HOST_SEND] : pp_stage[VAPI_CORE_TRACE_SUB_RECV];
+    if( !p_req ) return;
+
+    for(i=0; i<SPAN_NUM; ++i){
+        p_from = pp_stage[ span_table[i].from ];
+        p_to = pp_stage[ span_table[i].to ];
+        if( !p_from  ||  !p_to  ||  p_to->rec.ts_ns < p_from->rec.ts_ns ) continue;
+
+        dur = p_to->rec.ts_ns - p_from->rec.ts_ns;
+        p_stat[i].num++;
+        p_stat[i].sum_ns += dur;
+        if( dur > p_stat[i].max_ns ) p_stat[i].max_ns = dur;
+
+        // spans crossing the processes are drawn as flows
+        if( p_from->pid != p_to->pid ){
+            print_event(span_table[i].p_name, "s", p_from, 0, p_req);
+            print_event(span_table[i].p_name, "f", p_to, 0, p_req);
+        } else {
+            print_event(span_table[i].p_name, "X", p_from, dur, p_req);
+        }
+    }
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int main(int argc, char *argv[])
+{
+    int i;
+    size_t n;
+    trace_rec_t *p_stage[STAGE_NUM];
+    trace_stat_t stat[SPAN_NUM];
+
+    if( argc < 2 ){
+        fprintf(stderr, "usage: %s <trace file>... > trace.json\n", argv[0]);
+        return -1;
+    }
+
+    for(i=1; i<argc; ++i)
+      if( load_file(argv[i]) != 0 ) return -1;
+
+    qsort(rec_table, rec_num, sizeof(trace_rec_t), compare_rec);
+
+    memset(stat, 0, sizeof(stat));
+    memset(p_stage, 0, sizeof(p_stage));
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for(n=0; n<rec_num; ++n){
+        if( n > 0  &&  (rec_table[n].rec.conn != rec_table[n-1].rec.conn  ||  rec_table[n].rec.seq != rec_table[n-1].rec.seq) ){
+            print_request(p_stage, stat);
+            memset(p_stage, 0, sizeof(p_stage));
+        }
+        if( rec_table[n].rec.stage < STAGE_NUM ) p_stage[ rec_table[n].rec.stage ] = &rec_table[n];
+    }
+    if( rec_num ) print_request(p_stage, stat);
+    printf("\n]}\n");
+
+    LOG_MSG("%zu records.\n", rec_num);
+    for(n=0; n<SPAN_NUM; ++n){
+        if( stat[n].num == 0 ) continue;
+        LOG_MSG("%-12s: num=%8llu, avg=%10.3f us, max=%10.3f us\n", span_table[n].p_name,
+                (unsigned long long)stat[n].num, stat[n].sum_ns / 1000.0 / stat[n].num, stat[n].max_ns / 1000.0);
+    }
+
+    free(rec_table);
+
+    return 0;
+}
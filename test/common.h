@@ -30,20 +30,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdint.h>
 
-#define TEST_PORT (60000)
+#define VAPI_IDL_NAME test
+#define VAPI_IDL_FILE "test_api.def"
+#include "vapi_core_idl.h"
 
-enum api_id_e
-{
-    api_id_min    = 0x00000000,
-    api_id_test01 = 0x00000001,
-    api_id_test02 = 0x00000002,
-    api_id_max
-};
+#define TEST_PORT (60000)
 
-struct any_structure_01_t
+enum topic_e
 {
-    uint32_t set_val;
-    uint32_t get_val;
+    topic_test01 = 0x00000001,
 };
 
 struct any_structure_02_t
@@ -0,0 +1,810 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "common.h"
+#include "vapi_core.h"
+#include "vapi_core_sub.h"
+#include "vapi_core_pool.h"
+#include "vapi_core_local.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define LOG_MSG(fmt,args...) fprintf(stdout, "[EX_CHECK][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[EX_CHECK][ERR][%s] " fmt, __FUNCTION__, ##args)
+
+/* counts a failure, and goes on with the rest of the check */
+#define CHECK(cond) do{ if( !(cond) ){ ERR_MSG("line=%d: %s\n", __LINE__, #cond); g_failed++; } }while(0)
+
+/* a sub of this process, on a port chosen by the kernel */
+typedef struct
+{
+    int32_t fd;
+    uint16_t port;
+    volatile int num;      /* requests handled */
+    useconds_t delay;      /* of each handler */
+    uint64_t hash;         /* of the arguments of the last test02 */
+} check_sub_t;
+
+typedef struct
+{
+    const char *p_name;
+    void (*func)(void);
+} check_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+static int g_failed;
+
+/* FNV-1a of the bytes */
+static uint64_t check_hash(const uint8_t *p_data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for(i=0; i<len; ++i) hash = (hash ^ p_data[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+/* test01 publishes topic_test01 with set_val, test02 hashes its arguments, test03 returns set_val + 1 */
+static int check_handler(int32_t api_id, void* p_arg, uint32_t arg_len, void *p_cookie)
+{
+    check_sub_t *p_sub = (check_sub_t*)p_cookie;
+    test_test01_t *p_test = (test_test01_t*)p_arg;
+
+    __sync_add_and_fetch(&p_sub->num, 1);
+    if( p_sub->delay ) usleep(p_sub->delay);
+
+    switch( api_id ){
+      case test_api_id_test01:
+        if( arg_len != sizeof(*p_test) ) return -1;
+        vapi_core_sub_publish(p_sub->fd, topic_test01, &p_test->set_val, sizeof(p_test->set_val));
+        p_test->get_val = p_test->set_val;
+        return 0;
+      case test_api_id_test02:
+        p_sub->hash = check_hash((uint8_t*)p_arg, arg_len);
+        return 0;
+      case test_api_id_test03:
+        if( arg_len != sizeof(*p_test) ) return -1;
+        p_test->get_val = p_test->set_val + 1;
+        return 0;
+      default:
+        return 0;
+    }
+}
+
+static uint64_t check_mtime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* waits up to "timeout_ms" for the sub to have "conn_num" connections */
+static int check_conn_wait(check_sub_t *p_sub, uint32_t conn_num, int timeout_ms)
+{
+    vapi_core_sub_stats_t stats;
+    uint64_t end = check_mtime() + timeout_ms;
+
+    do {
+        if( vapi_core_sub_get_stats(p_sub->fd, &stats) == 0  &&  stats.conn_num == conn_num ) return 0;
+        usleep(10*1000);
+    } while( check_mtime() < end );
+
+    return -1;
+}
+
+static int check_sub_open(check_sub_t *p_sub, vapi_core_sub_attr_t *p_attr)
+{
+    memset(p_sub, 0, sizeof(*p_sub));
+    p_sub->fd = vapi_core_sub_open_attr(p_attr, check_handler, p_sub);
+    if( p_sub->fd < 0 ) return -1;
+
+    return vapi_core_sub_get_port(p_sub->fd, &p_sub->port);
+}
+
+//------------------------------------------------------------
+// Checks
+//------------------------------------------------------------
+typedef struct
+{
+    int32_t fd;
+    int num;
+    int32_t invoke_ret;
+    uint32_t get_val;
+    int32_t close_ret;
+    int close_errno;
+} check_reentry_t;
+
+static void check_reentry_handler(int32_t topic, const void* p_data, uint32_t len, void *p_cookie)
+{
+    check_reentry_t *p_ctx = (check_reentry_t*)p_cookie;
+    test_test03_t arg = { .set_val = 7 };
+
+    (void)topic; (void)p_data; (void)len;
+
+    p_ctx->num++;
+    p_ctx->invoke_ret = vapi_core_invoke(p_ctx->fd, test_api_id_test03, &arg, sizeof(arg));
+    p_ctx->get_val = arg.get_val;
+
+    errno = 0;
+    p_ctx->close_ret = vapi_core_close(p_ctx->fd);
+    p_ctx->close_errno = errno;
+}
+
+/* an event handler calls the sub again over the descriptor whose call received the event */
+static void check_reentry(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    check_reentry_t ctx;
+    test_test01_t arg = { .set_val = 1 };
+
+    vapi_core_sub_attr_init(&attr);
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+    sub.delay = 100*1000; /* the event arrives before the reply */
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd = vapi_core_open(sub.port);
+    CHECK(ctx.fd >= 0);
+    CHECK(vapi_core_subscribe(ctx.fd, topic_test01, check_reentry_handler, &ctx) == 0);
+
+    CHECK(vapi_core_invoke(ctx.fd, test_api_id_test01, &arg, sizeof(arg)) == 0);
+    if( ctx.num == 0 ) vapi_core_dispatch_event(ctx.fd, 1000);
+
+    CHECK(ctx.num == 1);
+    CHECK(ctx.invoke_ret == 0);
+    CHECK(ctx.get_val == 8);
+    CHECK(ctx.close_ret == -1  &&  ctx.close_errno == EBUSY);
+
+    CHECK(vapi_core_close(ctx.fd) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+static int check_test03(int32_t pool)
+{
+    test_test03_t arg = { .set_val = 1 };
+
+    if( vapi_core_pool_invoke(pool, test_api_id_test03, &arg, sizeof(arg)) != 0 ) return -1;
+
+    return arg.get_val == 2 ? 0 : -1;
+}
+
+/* a pool never waits for a sub which is down */
+static void check_pool_down(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    int32_t pool;
+    uint64_t start;
+
+    // a port nobody listens on
+    vapi_core_sub_attr_init(&attr);
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+
+    start = check_mtime();
+    CHECK(vapi_core_pool_open(sub.port, 1, 2, 0) == -1);
+
+    pool = vapi_core_pool_open(sub.port, 0, 2, 0);
+    CHECK(pool >= 0);
+    CHECK(check_test03(pool) == -1);
+    CHECK(check_mtime() - start < 1000);
+    CHECK(vapi_core_pool_close(pool) == 0);
+}
+
+static void* check_pool_thread(void *p_arg)
+{
+    int32_t pool = *(int32_t*)p_arg;
+    intptr_t ret;
+
+    errno = 0;
+    ret = check_test03(pool) == 0 ? 0 : errno;
+
+    return (void*)ret;
+}
+
+/* the connections kept by the threads of VAPI_CORE_POOL_PER_THREAD */
+static void check_pool_per_thread(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    int32_t pool;
+    pthread_t thrd;
+    void *p_ret;
+
+    vapi_core_sub_attr_init(&attr);
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    pool = vapi_core_pool_open(sub.port, 0, 1, VAPI_CORE_POOL_PER_THREAD);
+    CHECK(pool >= 0);
+
+    // a thread gives its connection back when it exits
+    CHECK(pthread_create(&thrd, NULL, check_pool_thread, &pool) == 0);
+    CHECK(pthread_join(thrd, &p_ret) == 0  &&  p_ret == (void*)0);
+    CHECK(check_test03(pool) == 0);
+
+    // the only connection is kept by this thread
+    CHECK(pthread_create(&thrd, NULL, check_pool_thread, &pool) == 0);
+    CHECK(pthread_join(thrd, &p_ret) == 0  &&  p_ret == (void*)EBUSY);
+
+    // closing the pool releases the connection of this thread too
+    CHECK(check_conn_wait(&sub, 1, 1000) == 0);
+    CHECK(vapi_core_pool_close(pool) == 0);
+    CHECK(check_conn_wait(&sub, 0, 1000) == 0);
+
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+/* the idle connections are reconnected to a sub restarted on the port */
+static void check_pool_reconnect(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    int32_t pool;
+    int num;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.listener_num = 2; /* SO_REUSEPORT binds again next to the closed connections */
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    pool = vapi_core_pool_open(sub.port, 1, 2, 0);
+    CHECK(pool >= 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+
+    attr.port = sub.port;
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); vapi_core_pool_close(pool); return; }
+
+    // without any call
+    CHECK(check_conn_wait(&sub, 1, 5000) == 0);
+    num = sub.num;
+    CHECK(check_test03(pool) == 0);
+    CHECK(sub.num == num + 1);
+
+    CHECK(vapi_core_pool_close(pool) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+/* an error replied by the sub keeps the connection in the pool, and a failure
+   of the connection itself discards it */
+static void check_pool_errors(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test01_t arg = { .set_val = 1 };
+    int32_t pool, fd, ret;
+    int sock;
+    short events;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.unix_socket = 0;
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    pool = vapi_core_pool_open(sub.port, 1, 1, 0);
+    CHECK(pool >= 0);
+    fd = vapi_core_pool_get(pool);
+    CHECK(fd >= 0);
+
+    // the handler rejects the arguments of a wrong length
+    ret = vapi_core_invoke(fd, test_api_id_test01, &arg, 1);
+    CHECK(ret == -1);
+    CHECK(vapi_core_pool_put(pool, fd, ret) == 0);
+    CHECK(vapi_core_pool_invoke(pool, test_api_id_test01, &arg, 1) == -1);
+    CHECK(vapi_core_pool_get(pool) == fd);
+
+    CHECK(vapi_core_get_pollfd(fd, &sock, &events) == 0  &&  shutdown(sock, SHUT_RDWR) == 0);
+    ret = vapi_core_invoke(fd, test_api_id_test03, &arg, sizeof(arg));
+    CHECK(ret == -1);
+    CHECK(vapi_core_pool_put(pool, fd, ret) == 0);
+    ret = vapi_core_pool_get(pool);
+    CHECK(ret >= 0  &&  ret != fd);
+    CHECK(vapi_core_pool_put(pool, ret, 0) == 0);
+
+    CHECK(vapi_core_pool_close(pool) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+/* the connections spread over the listeners sharing the port */
+static void check_listeners(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub, other;
+    int32_t fd[8];
+    size_t i;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.unix_socket = 0;
+    attr.listener_num = 4;
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    for(i=0; i<sizeof(fd)/sizeof(fd[0]); ++i){
+        test_test03_t arg = { .set_val = i };
+
+        fd[i] = vapi_core_open(sub.port);
+        CHECK(fd[i] >= 0);
+        CHECK(vapi_core_invoke(fd[i], test_api_id_test03, &arg, sizeof(arg)) == 0  &&  arg.get_val == i + 1);
+    }
+    CHECK(check_conn_wait(&sub, sizeof(fd)/sizeof(fd[0]), 1000) == 0);
+
+    // a port bound without SO_REUSEPORT fails the open after the first listener
+    vapi_core_sub_attr_init(&attr);
+    if( check_sub_open(&other, &attr) == 0 ){
+        attr.port = other.port;
+        attr.listener_num = 2;
+        CHECK(vapi_core_sub_open_attr(&attr, check_handler, &other) == -1);
+        CHECK(vapi_core_sub_close(other.fd) == 0);
+    } else {
+        CHECK(0);
+    }
+
+    for(i=0; i<sizeof(fd)/sizeof(fd[0]); ++i) CHECK(vapi_core_close(fd[i]) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+/* calls test03 over the descriptor, on a thread */
+static void* check_busy_thread(void *p_arg)
+{
+    int32_t fd = *(int32_t*)p_arg;
+    test_test03_t arg = { .set_val = 1 };
+
+    return (void*)(intptr_t)vapi_core_invoke(fd, test_api_id_test03, &arg, sizeof(arg));
+}
+
+/* "max_conn" closes the connections beyond it, "max_inflight" and "max_buffered"
+   reject the requests beyond them while another one is being handled, over TCP
+   and unix */
+static void check_admission(void)
+{
+    static const struct { uint32_t max_inflight; uint64_t max_buffered; int errsv; int unix_socket; } limits[] =
+    {
+        { 1, 0, EBUSY, 0 },
+        { 1, 0, EBUSY, 1 },
+        { 0, sizeof(test_test03_t) * 3 / 2, ENOBUFS, 0 },
+        { 0, sizeof(test_test03_t) * 3 / 2, ENOBUFS, 1 },
+    };
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test03_t arg = { .set_val = 1 };
+    int32_t fd[2];
+    uint32_t transport;
+    pthread_t thrd;
+    void *p_ret;
+    uint64_t end;
+    size_t i;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.unix_socket = 0;
+    attr.max_conn = 1;
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    fd[0] = vapi_core_open(sub.port);
+    CHECK(fd[0] >= 0);
+    CHECK(vapi_core_invoke(fd[0], test_api_id_test03, &arg, sizeof(arg)) == 0);
+    CHECK(vapi_core_open(sub.port) == -1);
+    CHECK(check_conn_wait(&sub, 1, 1000) == 0);
+
+    // the slot is free again once the first one is closed
+    CHECK(vapi_core_close(fd[0]) == 0);
+    CHECK(check_conn_wait(&sub, 0, 1000) == 0);
+    fd[1] = vapi_core_open(sub.port);
+    CHECK(fd[1] >= 0);
+    CHECK(vapi_core_close(fd[1]) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+
+    for(i=0; i<sizeof(limits)/sizeof(limits[0]); ++i){
+        vapi_core_sub_attr_init(&attr);
+        attr.unix_socket = limits[i].unix_socket;
+        attr.max_inflight = limits[i].max_inflight;
+        attr.max_buffered = limits[i].max_buffered;
+        if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+        sub.delay = 200*1000;
+
+        fd[0] = vapi_core_open(sub.port);
+        fd[1] = vapi_core_open(sub.port);
+        CHECK(fd[0] >= 0  &&  fd[1] >= 0);
+        CHECK(vapi_core_get_transport(fd[1], &transport) == 0  &&
+              transport == (limits[i].unix_socket ? VAPI_CORE_TRANSPORT_UNIX : VAPI_CORE_TRANSPORT_TCP));
+
+        CHECK(pthread_create(&thrd, NULL, check_busy_thread, &fd[0]) == 0);
+        for(end = check_mtime() + 1000; sub.num == 0  &&  check_mtime() < end; ) usleep(1000);
+
+        errno = 0;
+        CHECK(vapi_core_invoke(fd[1], test_api_id_test03, &arg, sizeof(arg)) == -1  &&  errno == limits[i].errsv);
+        CHECK(pthread_join(thrd, &p_ret) == 0  &&  p_ret == NULL);
+        CHECK(sub.num == 1);
+
+        // admitted again once the first one is done
+        CHECK(vapi_core_invoke(fd[1], test_api_id_test03, &arg, sizeof(arg)) == 0);
+
+        CHECK(vapi_core_close(fd[0]) == 0);
+        CHECK(vapi_core_close(fd[1]) == 0);
+        CHECK(vapi_core_sub_close(sub.fd) == 0);
+    }
+}
+
+/* the arguments in vapi_core_alloc() memory, by the memfd over unix and by the name over TCP */
+static void check_shm(void)
+{
+    static const uint32_t transports[] = { VAPI_CORE_TRANSPORT_UNIX, VAPI_CORE_TRANSPORT_TCP };
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test03_t *p_arg;
+    uint32_t transport;
+    int32_t fd;
+    size_t i;
+
+    for(i=0; i<sizeof(transports)/sizeof(transports[0]); ++i){
+        vapi_core_sub_attr_init(&attr);
+        attr.unix_socket = (transports[i] == VAPI_CORE_TRANSPORT_UNIX);
+        if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+        fd = vapi_core_open(sub.port);
+        CHECK(fd >= 0);
+        p_arg = vapi_core_alloc(fd, sizeof(*p_arg));
+        CHECK(p_arg != NULL);
+        if( p_arg ){
+            p_arg->set_val = 5;
+            CHECK(vapi_core_invoke(fd, test_api_id_test03, p_arg, sizeof(*p_arg)) == 0  &&  p_arg->get_val == 6);
+            CHECK(vapi_core_get_transport(fd, &transport) == 0  &&  transport == (transports[i] | VAPI_CORE_TRANSPORT_SHM));
+            CHECK(vapi_core_free(fd, p_arg) == 0);
+        }
+
+        CHECK(vapi_core_close(fd) == 0);
+        CHECK(vapi_core_sub_close(sub.fd) == 0);
+    }
+}
+
+static void check_local_event(int32_t topic, const void* p_data, uint32_t len, void *p_cookie)
+{
+    (void)topic; (void)p_data; (void)len;
+
+    (*(int*)p_cookie)++;
+}
+
+/* "local_call" calls the handler without a connection, until the descriptor needs the socket */
+static void check_local(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test01_t arg = { .set_val = 1 };
+    uint32_t transport;
+    int32_t fd[2];
+    int sock, events = 0;
+    short poll_events;
+
+    // through the socket unless asked
+    vapi_core_sub_attr_init(&attr);
+    CHECK(attr.local_call == 0);
+    attr.local_call = 1;
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    fd[0] = vapi_core_open(sub.port);
+    fd[1] = vapi_core_open(sub.port);
+    CHECK(fd[0] >= 0  &&  fd[1] >= 0);
+    CHECK(vapi_core_invoke(fd[0], test_api_id_test03, &arg, sizeof(arg)) == 0  &&  arg.get_val == 2);
+    CHECK(vapi_core_invoke_oneway(fd[0], test_api_id_test03, &arg, sizeof(arg)) == 0);
+    CHECK(vapi_core_barrier(fd[0]) == 0);
+    CHECK(vapi_core_get_transport(fd[0], &transport) == 0  &&  transport == VAPI_CORE_TRANSPORT_LOCAL);
+    CHECK(sub.num == 2);
+    CHECK(check_conn_wait(&sub, 0, 1000) == 0);
+
+    // the events come over the socket, which the subscription moves to
+    CHECK(vapi_core_subscribe(fd[0], topic_test01, check_local_event, &events) == 0);
+    CHECK(vapi_core_get_transport(fd[0], &transport) == 0  &&  transport == VAPI_CORE_TRANSPORT_UNIX);
+    CHECK(vapi_core_invoke(fd[0], test_api_id_test01, &arg, sizeof(arg)) == 0  &&  arg.get_val == 1);
+    if( events == 0 ) vapi_core_dispatch_event(fd[0], 1000);
+    CHECK(events == 1);
+    CHECK(check_conn_wait(&sub, 1, 1000) == 0);
+
+    // and so does the descriptor polled by the caller
+    CHECK(vapi_core_get_pollfd(fd[1], &sock, &poll_events) == 0  &&  sock >= 0);
+    CHECK(vapi_core_get_transport(fd[1], &transport) == 0  &&  transport == VAPI_CORE_TRANSPORT_UNIX);
+    CHECK(vapi_core_invoke(fd[1], test_api_id_test03, &arg, sizeof(arg)) == 0  &&  arg.get_val == 2);
+    CHECK(check_conn_wait(&sub, 2, 1000) == 0);
+
+    CHECK(vapi_core_close(fd[0]) == 0);
+    CHECK(vapi_core_close(fd[1]) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+/* the hosts move to the unix socket of the sub, and stay on TCP without it */
+static void check_transport(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test03_t arg = { .set_val = 1 };
+    uint32_t transport;
+    int32_t fd;
+    int unix_socket;
+
+    for(unix_socket=1; unix_socket>=0; --unix_socket){
+        vapi_core_sub_attr_init(&attr);
+        attr.unix_socket = unix_socket;
+        if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+        fd = vapi_core_open(sub.port);
+        CHECK(fd >= 0);
+        CHECK(vapi_core_get_transport(fd, &transport) == 0  &&
+              transport == (unix_socket ? VAPI_CORE_TRANSPORT_UNIX : VAPI_CORE_TRANSPORT_TCP));
+        CHECK(vapi_core_invoke(fd, test_api_id_test03, &arg, sizeof(arg)) == 0  &&  arg.get_val == 2);
+
+        // the TCP connection is closed once moved
+        CHECK(check_conn_wait(&sub, 1, 1000) == 0);
+
+        CHECK(vapi_core_close(fd) == 0);
+        CHECK(vapi_core_sub_close(sub.fd) == 0);
+    }
+}
+
+/* the large arguments spliced to the unix socket reach the sub as they were
+   when called, though the caller overwrites them once the call returns */
+static void check_splice(void)
+{
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    const size_t len = 16*1024*1024;
+    uint8_t *p_buf;
+    uint32_t transport;
+    int32_t fd;
+    size_t i;
+    int k;
+
+    vapi_core_sub_attr_init(&attr);
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+    p_buf = malloc(len);
+    if( !p_buf ){ CHECK(0); vapi_core_sub_close(sub.fd); return; }
+
+    fd = vapi_core_open(sub.port);
+    CHECK(fd >= 0);
+    CHECK(vapi_core_get_transport(fd, &transport) == 0  &&  transport == VAPI_CORE_TRANSPORT_UNIX);
+
+    for(k=0; k<3; ++k){
+        for(i=0; i<len; ++i) p_buf[i] = (uint8_t)(i * 7 + k * 13 + (i >> 12));
+        sub.hash = 0;
+        CHECK(vapi_core_invoke(fd, test_api_id_test02, p_buf, len) == 0);
+        CHECK(sub.hash == check_hash(p_buf, len));
+    }
+
+    CHECK(vapi_core_close(fd) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+    free(p_buf);
+}
+
+/* the provider of check_provider(), which counts the memory given and given back */
+static volatile int g_provided, g_released;
+static useconds_t g_provider_delay;
+
+static void* check_provider_get(int32_t api_id, uint32_t arg_len, void *p_cookie)
+{
+    (void)api_id; (void)p_cookie;
+
+    if( g_provider_delay ) usleep(g_provider_delay);
+    __sync_add_and_fetch(&g_provided, 1);
+    return malloc(arg_len);
+}
+
+static void check_provider_put(int32_t api_id, void *p_arg, uint32_t arg_len, void *p_cookie)
+{
+    (void)api_id; (void)arg_len; (void)p_cookie;
+
+    free(p_arg);
+    __sync_add_and_fetch(&g_released, 1);
+}
+
+/* calls test02 with 16 MB of arguments over the descriptor, on a thread */
+static void* check_provider_thread(void *p_arg)
+{
+    int32_t fd = *(int32_t*)p_arg;
+    const size_t len = 16*1024*1024;
+    void *p_buf = calloc(1, len);
+    int32_t ret;
+
+    if( !p_buf ) return (void*)(intptr_t)-2;
+    ret = vapi_core_invoke(fd, test_api_id_test02, p_buf, len);
+    free(p_buf);
+
+    return (void*)(intptr_t)ret;
+}
+
+/* the arguments of the provided api_ids are received into the memory of the
+   provider, which is given back once replied, or once the peer is gone while
+   they are being received */
+static void check_provider(void)
+{
+    static const int32_t ids[] = { test_api_id_test02 };
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test03_t arg = { .set_val = 1 };
+    uint8_t buf[64];
+    pthread_t thrd;
+    void *p_ret;
+    uint64_t end;
+    int32_t fd, fd2;
+    int sock;
+    short events;
+    size_t i;
+
+    g_provided = g_released = 0;
+    g_provider_delay = 0;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.unix_socket = 0;
+    attr.provider = check_provider_get;
+    attr.provider_release = check_provider_put;
+    attr.p_provider_ids = ids;
+    attr.provider_num = sizeof(ids)/sizeof(ids[0]);
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    fd = vapi_core_open(sub.port);
+    CHECK(fd >= 0);
+
+    for(i=0; i<sizeof(buf); ++i) buf[i] = (uint8_t)(i * 3);
+    CHECK(vapi_core_invoke(fd, test_api_id_test02, buf, sizeof(buf)) == 0);
+    CHECK(sub.hash == check_hash(buf, sizeof(buf)));
+    for(end = check_mtime() + 1000; g_released == 0  &&  check_mtime() < end; ) usleep(1000);
+    CHECK(g_provided == 1  &&  g_released == 1);
+
+    // the others are received as usual
+    CHECK(vapi_core_invoke(fd, test_api_id_test03, &arg, sizeof(arg)) == 0  &&  arg.get_val == 2);
+    CHECK(g_provided == 1);
+
+    // the peer shuts down while the provider holds the arguments back
+    g_provider_delay = 200*1000;
+    fd2 = vapi_core_open(sub.port);
+    CHECK(fd2 >= 0);
+    CHECK(pthread_create(&thrd, NULL, check_provider_thread, &fd2) == 0);
+    usleep(50*1000);
+    CHECK(vapi_core_get_pollfd(fd2, &sock, &events) == 0  &&  shutdown(sock, SHUT_RDWR) == 0);
+    CHECK(pthread_join(thrd, &p_ret) == 0  &&  p_ret == (void*)(intptr_t)-1);
+    for(end = check_mtime() + 1000; g_released != 2  &&  check_mtime() < end; ) usleep(1000);
+    CHECK(g_provided == 2  &&  g_released == 2);
+
+    CHECK(vapi_core_close(fd2) == 0);
+    CHECK(vapi_core_close(fd) == 0);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+/* sends a request of "flags" over the raw socket, and receives its reply */
+static int check_flags_call(int sock, uint32_t flags, test_test03_t *p_arg, _vapi_core_hdr_t *p_hdr)
+{
+    memset(p_hdr, 0, sizeof(*p_hdr));
+    p_hdr->api_id = test_api_id_test03;
+    p_hdr->arg_len = sizeof(*p_arg);
+    p_hdr->req_id = 1;
+    p_hdr->flags = flags;
+    p_hdr->version = _VAPI_CORE_VERSION;
+    if( _vapi_core_send(sock, p_hdr, sizeof(*p_hdr), 0) != sizeof(*p_hdr)  ||
+        _vapi_core_send(sock, p_arg, sizeof(*p_arg), 0) != sizeof(*p_arg) ) return -1;
+
+    if( _vapi_core_recv(sock, p_hdr, sizeof(*p_hdr), 0) != sizeof(*p_hdr) ) return -1;
+    if( p_hdr->arg_len > sizeof(*p_arg) ) return -1;
+    if( p_hdr->arg_len  &&  _vapi_core_recv(sock, p_arg, p_hdr->arg_len, 0) != p_hdr->arg_len ) return -1;
+
+    return 0;
+}
+
+/* a socket peer cannot claim the direct calls, nor the flags the sub does not
+   know: they are rejected with EINVAL before the budgets, and the connection
+   goes on */
+static void check_flags(void)
+{
+    static const uint32_t flags[] = { _VAPI_CORE_HDR_LOCAL, 0x80000000 };
+    vapi_core_sub_attr_t attr;
+    check_sub_t sub;
+    test_test03_t arg;
+    _vapi_core_hdr_t hdr;
+    struct sockaddr_in addr;
+    int sock;
+    size_t i;
+
+    vapi_core_sub_attr_init(&attr);
+    attr.unix_socket = 0;
+    attr.max_buffered = 1;
+    if( check_sub_open(&sub, &attr) != 0 ){ CHECK(0); return; }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(sub.port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(sock >= 0  &&  connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+
+    for(i=0; i<sizeof(flags)/sizeof(flags[0]); ++i){
+        arg.set_val = 1;
+        CHECK(check_flags_call(sock, flags[i], &arg, &hdr) == 0);
+        CHECK(hdr.err_code == -1  &&  hdr.errsv == EINVAL);
+    }
+    CHECK(sub.num == 0);
+
+    // still in step: the budget of 1 byte rejects the valid one
+    CHECK(check_flags_call(sock, 0, &arg, &hdr) == 0);
+    CHECK(hdr.err_code == -1  &&  hdr.errsv == ENOBUFS);
+
+    if( sock >= 0 ) close(sock);
+    CHECK(vapi_core_sub_close(sub.fd) == 0);
+}
+
+static const check_t g_checks[] =
+{
+    { "reentry", check_reentry },
+    { "pool_down", check_pool_down },
+    { "pool_per_thread", check_pool_per_thread },
+    { "pool_reconnect", check_pool_reconnect },
+    { "pool_errors", check_pool_errors },
+    { "listeners", check_listeners },
+    { "shm", check_shm },
+    { "admission", check_admission },
+    { "local", check_local },
+    { "transport", check_transport },
+    { "splice", check_splice },
+    { "provider", check_provider },
+    { "flags", check_flags },
+};
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+/* runs the checks, or the one named by the argument, and exits with 1 if any failed */
+int main(int argc, char *argv[])
+{
+    size_t i;
+    int failed;
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    for(i=0; i<sizeof(g_checks)/sizeof(g_checks[0]); ++i){
+        if( argc > 1  &&  strcmp(argv[1], g_checks[i].p_name) != 0 ) continue;
+
+        failed = g_failed;
+        g_checks[i].func();
+        if( g_failed == failed ) LOG_MSG("%s is OK.\n", g_checks[i].p_name);
+        else ERR_MSG("%s is NG.\n", g_checks[i].p_name);
+    }
+
+    return g_failed ? 1 : 0;
+}
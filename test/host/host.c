@@ -38,6 +38,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
+#include <poll.h>
 
 
 //=============================================================================
@@ -54,6 +55,21 @@ typedef struct
     int mode;
 } vapi_test_thread_t;
 
+typedef struct
+{
+    int num;
+    uint32_t last_val;
+} vapi_test_event_t;
+
+#define VAPI_TEST_ASYNC_NUM (32)
+
+typedef struct
+{
+    int done;
+    int error;
+    test_test01_t arg[VAPI_TEST_ASYNC_NUM];  // test03 shares the layout
+} vapi_test_async_t;
+
 //=============================================================================
 // Local Function/Variable Implementations
 //=============================================================================
@@ -63,10 +79,10 @@ typedef struct
 //------------------------------------------------------------
 static int vapi_test01(int fd, uint32_t set_val /* in */, uint32_t *p_get_val /* out */)
 {
-    struct any_structure_01_t arg = { set_val, 0 };
+    test_test01_t arg = { set_val, 0 };
     int err_code;
 
-    err_code = vapi_core_invoke( fd, api_id_test01, &arg, sizeof(arg) );
+    err_code = test_test01( fd, &arg );
     if( err_code == 0 ) *p_get_val = arg.get_val;
     return err_code;
 }
@@ -74,10 +90,72 @@ static int vapi_test01(int fd, uint32_t set_val /* in */, uint32_t *p_get_val /*
 static int vapi_test02(int fd, uint8_t *p_buff /* in/out */, uint32_t len /* in */)
 {
     int err_code;
-    err_code = vapi_core_invoke( fd, api_id_test02, p_buff, len );
+    err_code = test_test02( fd, p_buff, len );
     return err_code;
 }
 
+static int vapi_test03(int fd, uint32_t set_val /* in */, uint32_t *p_get_val /* out */)
+{
+    test_test03_t arg = { set_val, 0 };
+    int err_code;
+
+    err_code = test_test03( fd, &arg );
+    if( err_code == 0 ) *p_get_val = arg.get_val;
+    return err_code;
+}
+
+static void vapi_test01_async_done(int32_t fd, int32_t err_code, void *p_arg, uint32_t arg_len, void *p_cookie)
+{
+    vapi_test_async_t *p_async = (vapi_test_async_t*)p_cookie;
+    test_test01_t *p_struct = (test_test01_t*)p_arg;
+
+    if( err_code != 0  ||  arg_len != sizeof(*p_struct)  ||  p_struct->set_val != p_struct->get_val ) p_async->error++;
+    p_async->done++;
+}
+
+/* issues the calls at once, and waits for them in a poll loop */
+static int vapi_test01_async(int fd, uint32_t set_val, uint32_t flags)
+{
+    vapi_test_async_t async;
+    struct pollfd pfd;
+    int i;
+
+    memset(&async, 0, sizeof(async));
+    for(i=0; i<VAPI_TEST_ASYNC_NUM; ++i){
+        async.arg[i].set_val = set_val + i;
+        if( flags ){
+            // may be handled concurrently by the workers of the sub, and completed in any order
+            if( vapi_core_invoke_async_flags( fd, (i & 1) ? test_api_id_test03 : test_api_id_test01, &async.arg[i],
+                                              sizeof(async.arg[i]), flags, vapi_test01_async_done, &async ) != 0 ) return -1;
+        } else if( i & 1 ){
+            if( test_test03_async( fd, (test_test03_t*)&async.arg[i], vapi_test01_async_done, &async ) != 0 ) return -1;
+        } else {
+            if( test_test01_async( fd, &async.arg[i], vapi_test01_async_done, &async ) != 0 ) return -1;
+        }
+    }
+
+    while( async.done < VAPI_TEST_ASYNC_NUM ){
+        if( vapi_core_get_pollfd(fd, &pfd.fd, &pfd.events) != 0 ) return -1;
+        if( poll(&pfd, 1, 1000) <= 0 ) return -1;
+        if( vapi_core_process(fd) < 0 ) return -1;
+    }
+
+    return async.error ? -1 : 0;
+}
+
+//------------------------------------------------------------
+// Event Handler Implementations
+//------------------------------------------------------------
+static void vapi_test01_event(int32_t topic, const void* p_data, uint32_t len, void *p_cookie)
+{
+    vapi_test_event_t *p_event = (vapi_test_event_t*)p_cookie;
+
+    if( len == sizeof(uint32_t) ){
+        p_event->last_val = *(const uint32_t*)p_data;
+        p_event->num++;
+    }
+}
+
 //------------------------------------------------------------
 // Test Function Implementations
 //------------------------------------------------------------
@@ -87,10 +165,16 @@ static void* vapi_test_thread(void* p_arg)
     vapi_test_thread_t *p_info = (vapi_test_thread_t*)p_arg;
     int cnt = 0;
     int fd = 0;
+    vapi_test_event_t event = { 0, 0 };
 
     fd = vapi_core_open(TEST_PORT);
     if( fd == -1 ){ line = __LINE__; goto _err_end_; }
 
+    if( p_info->mode & 0x04 ){
+        err_code = vapi_core_subscribe(fd, topic_test01, vapi_test01_event, &event);
+        if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+    }
+
     while( p_info->alive ){
 
         if( p_info->mode & 0x01 ){
@@ -100,6 +184,14 @@ static void* vapi_test_thread(void* p_arg)
             if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
             if( set_val != get_val ){ line = __LINE__; goto _err_end_; }
             LOG_MSG("[%5d] vapi_test01() is OK.\n", cnt);
+
+            if( p_info->mode & 0x04 ){
+                // the event may have been dispatched already by vapi_core_invoke()
+                while( event.num == 0  ||  event.last_val != set_val ){
+                    if( vapi_core_dispatch_event(fd, 1000) <= 0 ){ line = __LINE__; goto _err_end_; }
+                }
+                LOG_MSG("[%5d] topic_test01 event is OK.\n", cnt);
+            }
         }
 
         if( p_info->mode & 0x02 ){
@@ -119,6 +211,56 @@ static void* vapi_test_thread(void* p_arg)
             }
         }
         
+        if( p_info->mode & 0x08 ){
+            uint32_t set_val, get_val = 0;
+            set_val = cnt;
+            err_code = vapi_test03(fd, set_val, &get_val);
+            if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+            if( set_val != get_val ){ line = __LINE__; goto _err_end_; }
+            LOG_MSG("[%5d] vapi_test03() is OK.\n", cnt);
+        }
+
+        if( p_info->mode & 0x10 ){
+            err_code = vapi_test01_async(fd, cnt, 0);
+            if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+            LOG_MSG("[%5d] vapi_test01_async() is OK.\n", cnt);
+        }
+
+        if( p_info->mode & 0x20 ){
+            uint32_t len = 1024*1024*16;  // 16MB, passed by the shared memory
+            uint8_t *p_buff = vapi_core_alloc(fd, len);
+            int i;
+            if( !p_buff ){ line = __LINE__; goto _err_end_; }
+            memset(p_buff, 0, len);
+
+            err_code = vapi_test02(fd, p_buff, len);
+            if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+
+            for(i=0; i<len; ++i)
+              if( p_buff[i] != (uint8_t)i ){ line = __LINE__; goto _err_end_; }
+            vapi_core_free(fd, p_buff);
+            LOG_MSG("[%5d] vapi_test02() by vapi_core_alloc() is OK.\n", cnt);
+        }
+
+        if( p_info->mode & 0x40 ){
+            err_code = vapi_test01_async(fd, cnt, VAPI_CORE_INVOKE_UNORDERED);
+            if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+            LOG_MSG("[%5d] vapi_test01_async() unordered is OK.\n", cnt);
+        }
+
+        if( p_info->mode & 0x80 ){
+            test_test01_t arg = { cnt, 0 };
+            int i;
+            for(i=0; i<VAPI_TEST_ASYNC_NUM; ++i){
+                err_code = vapi_core_invoke_oneway(fd, test_api_id_test01, &arg, sizeof(arg));
+                if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+            }
+            // none of them has failed
+            err_code = vapi_core_barrier(fd);
+            if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+            LOG_MSG("[%5d] vapi_core_invoke_oneway() is OK.\n", cnt);
+        }
+
         //usleep(10*1000);
         cnt++;
     }
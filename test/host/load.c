@@ -0,0 +1,492 @@
+/*=============================================================================
+
+Copyright (c) 2013, Naoto Uegaki
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=============================================================================*/
+
+
+//=============================================================================
+// Includes
+//=============================================================================
+#include "common.h"
+#include "vapi_core.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+
+//=============================================================================
+// Local Macro/Type/Enumeration/Structure Definitions
+//=============================================================================
+#define DBG_MSG(fmt,args...)
+#define LOG_MSG(fmt,args...) fprintf(stderr, "[EX_LOAD][LOG][%s] " fmt, __FUNCTION__, ##args)
+#define ERR_MSG(fmt,args...) fprintf(stderr, "[EX_LOAD][ERR][%s] " fmt, __FUNCTION__, ##args)
+#define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
+
+#define LOAD_MIX_MAX       (16)
+#define LOAD_CONN_MAX      (1024)
+
+/* log-linear histogram in the HdrHistogram layout: each power of 2 is split
+   into 64 buckets, which resolve a value to 1/64 (1.6%) or less than 2
+   significant digits, from 1ns to 2^40ns (about 18 minutes) */
+#define HIST_SUB_MAGNITUDE (7)
+#define HIST_SUB_COUNT     (1 << HIST_SUB_MAGNITUDE)
+#define HIST_SUB_HALF      (HIST_SUB_COUNT / 2)
+#define HIST_MAX_MAGNITUDE (40)
+#define HIST_COUNTS_LEN    ((HIST_MAX_MAGNITUDE - HIST_SUB_MAGNITUDE + 2) * HIST_SUB_HALF)
+
+typedef struct
+{
+    uint64_t counts[HIST_COUNTS_LEN];
+    uint64_t total;
+    uint64_t max;
+} load_hist_t;
+
+typedef struct
+{
+    int32_t api_id;
+    uint32_t size;
+    uint32_t weight;
+} load_mix_t;
+
+typedef struct
+{
+    uint16_t port;
+    int conn_num;
+    int exponential;
+    double duration;   // [s]
+    double warmup;     // [s]
+    load_mix_t mix[LOAD_MIX_MAX];
+    int mix_num;
+    uint32_t weight_sum;
+} load_conf_t;
+
+typedef struct
+{
+    const load_conf_t *p_conf;
+    int idx;
+    int fd;
+    double rate;       // [req/s] of this connection
+    uint64_t t0_ns;
+    uint64_t end_ns;   // no request is scheduled from then
+    uint64_t drain_ns; // the backlog still unsent then is given up
+    uint64_t rec_ns;   // recording starts after the warm-up
+    uint64_t done;
+    uint64_t errors;
+    load_hist_t latency;  // from the intended send time
+    load_hist_t service;  // from the actual send time
+} load_thread_t;
+
+
+//=============================================================================
+// Local Function/Variable Implementations
+//=============================================================================
+
+//------------------------------------------------------------
+// Histogram Implementations
+//------------------------------------------------------------
+static void hist_record(load_hist_t *p_hist, uint64_t value)
+{
+    int bucket, sub, idx;
+
+    if( value >= ((uint64_t)1 << HIST_MAX_MAGNITUDE) ) value = ((uint64_t)1 << HIST_MAX_MAGNITUDE) - 1;
+
+    bucket = 64 - __builtin_clzll(value | (HIST_SUB_COUNT - 1)) - HIST_SUB_MAGNITUDE;
+    sub = (int)(value >> bucket);
+    idx = ((bucket + 1) << (HIST_SUB_MAGNITUDE - 1)) + sub - HIST_SUB_HALF;
+
+    p_hist->counts[idx]++;
+    p_hist->total++;
+    if( value > p_hist->max ) p_hist->max = value;
+}
+
+/* the highest value which is equivalent to the index */
+static uint64_t hist_value(int idx)
+{
+    int bucket, sub;
+
+    if( idx < HIST_SUB_COUNT ) return idx;
+
+    bucket = (idx >> (HIST_SUB_MAGNITUDE - 1)) - 1;
+    sub = (idx & (HIST_SUB_HALF - 1)) + HIST_SUB_HALF;
+    return (((uint64_t)sub) << bucket) + ((uint64_t)1 << bucket) - 1;
+}
+
+static uint64_t hist_percentile(const load_hist_t *p_hist, double percentile)
+{
+    uint64_t target, sum = 0;
+    int i;
+
+    if( p_hist->total == 0 ) return 0;
+
+    target = (uint64_t)ceil(percentile / 100.0 * p_hist->total);
+    if( target == 0 ) target = 1;
+
+    for(i=0; i<HIST_COUNTS_LEN; ++i){
+        sum += p_hist->counts[i];
+        if( sum >= target ) return hist_value(i) < p_hist->max ? hist_value(i) : p_hist->max;
+    }
+    return p_hist->max;
+}
+
+static void hist_add(load_hist_t *p_dst, const load_hist_t *p_src)
+{
+    int i;
+
+    for(i=0; i<HIST_COUNTS_LEN; ++i)
+      p_dst->counts[i] += p_src->counts[i];
+    p_dst->total += p_src->total;
+    if( p_src->max > p_dst->max ) p_dst->max = p_src->max;
+}
+
+/* prints the percentile distribution in the ".hgrm" format of HdrHistogram,
+   which can be plotted by the HdrHistogram plotter */
+static void hist_print(FILE *p_file, const load_hist_t *p_hist)
+{
+    uint64_t sum = 0;
+    double percentile;
+    int i;
+
+    fprintf(p_file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for(i=0; i<HIST_COUNTS_LEN; ++i){
+        if( p_hist->counts[i] == 0 ) continue;
+        sum += p_hist->counts[i];
+        percentile = (double)sum / p_hist->total;
+        if( sum < p_hist->total ){
+            fprintf(p_file, "%12.3f %2.12f %10llu %14.2f\n",
+                    hist_value(i) / 1000.0, percentile, (unsigned long long)sum, 1.0 / (1.0 - percentile));
+        } else {
+            fprintf(p_file, "%12.3f %2.12f %10llu\n",
+                    p_hist->max / 1000.0, percentile, (unsigned long long)sum);
+        }
+    }
+    fprintf(p_file, "#[Max = %12.3f, Total count = %12llu]\n", p_hist->max / 1000.0, (unsigned long long)p_hist->total);
+}
+
+//------------------------------------------------------------
+// Load Generator Implementations
+//------------------------------------------------------------
+static uint64_t load_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void load_sleep_until(uint64_t t_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t_ns / 1000000000ULL;
+    ts.tv_nsec = t_ns % 1000000000ULL;
+    while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR );
+}
+
+static uint32_t load_random(uint32_t *p_state)
+{
+    // xorshift32
+    uint32_t x = *p_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *p_state = x;
+}
+
+/* the intended send time of the request following the one at "intended" */
+static uint64_t load_next(const load_conf_t *p_conf, uint32_t *p_state, uint64_t intended, uint64_t interval)
+{
+    double u;
+
+    if( !p_conf->exponential ) return intended + interval;
+
+    u = (load_random(p_state) + 1.0) / 4294967297.0;
+    return intended + (uint64_t)(-log(u) * interval);
+}
+
+static void* load_thread(void *p_arg)
+{
+    int err_code = 0, line = 0;
+    load_thread_t *p_info = (load_thread_t*)p_arg;
+    const load_conf_t *p_conf = p_info->p_conf;
+    uint8_t *p_buff[LOAD_MIX_MAX];
+    uint32_t state = 2463534242U + p_info->idx * 7919;
+    uint64_t intended, start, end, interval;
+    uint32_t pick;
+    int fd = p_info->fd, i, m;
+
+    memset(p_buff, 0, sizeof(p_buff));
+    for(i=0; i<p_conf->mix_num; ++i){
+        p_buff[i] = calloc(1, p_conf->mix[i].size ? p_conf->mix[i].size : 1);
+        if( !p_buff[i] ){ line = __LINE__; goto _err_end_; }
+    }
+
+    interval = (uint64_t)(1e9 / p_info->rate);
+    // spreads the connections evenly over an interval
+    intended = p_info->t0_ns + interval * p_info->idx / p_conf->conn_num;
+
+    // the requests scheduled before end_ns are sent even if late, as those
+    // left behind by a stalled sub are the slowest
+    end = 0;
+    while( intended < p_info->end_ns ){
+
+        if( end >= p_info->drain_ns ){
+            // too late to send, recorded with a lower bound of their latency
+            if( intended >= p_info->rec_ns ){
+                hist_record(&p_info->latency, end - intended);
+                p_info->done++;
+                p_info->errors++;
+            }
+            intended = load_next(p_conf, &state, intended, interval);
+            continue;
+        }
+
+        load_sleep_until(intended);
+
+        pick = load_random(&state) % p_conf->weight_sum;
+        for(m=0; m<p_conf->mix_num-1; ++m){
+            if( pick < p_conf->mix[m].weight ) break;
+            pick -= p_conf->mix[m].weight;
+        }
+
+        start = load_now_ns();
+        err_code = vapi_core_invoke(fd, p_conf->mix[m].api_id, p_buff[m], p_conf->mix[m].size);
+        end = load_now_ns();
+
+        if( intended >= p_info->rec_ns ){
+            // the latency is measured from the time the request should have
+            // been sent, so that a stalled sub does not hide its own backlog
+            hist_record(&p_info->latency, end - intended);
+            hist_record(&p_info->service, end - start);
+            p_info->done++;
+            if( err_code != 0 ) p_info->errors++;
+        }
+
+        intended = load_next(p_conf, &state, intended, interval);
+    }
+
+    for(i=0; i<p_conf->mix_num; ++i) free(p_buff[i]);
+
+    return NULL;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+
+    for(i=0; i<p_conf->mix_num; ++i) free(p_buff[i]);
+
+    return NULL;
+}
+
+static int load_run(const load_conf_t *p_conf, double rate, int verbose)
+{
+    int err_code = 0, line = 0;
+    load_thread_t *p_info = NULL;
+    pthread_t *p_thrd = NULL;
+    load_hist_t *p_latency = NULL, *p_service = NULL;
+    uint64_t done = 0, errors = 0, t0;
+    int i, thrd_num = 0, conn_num = 0;
+
+    p_info = calloc(p_conf->conn_num, sizeof(load_thread_t));
+    p_thrd = calloc(p_conf->conn_num, sizeof(pthread_t));
+    p_latency = calloc(1, sizeof(load_hist_t));
+    p_service = calloc(1, sizeof(load_hist_t));
+    if( !p_info  ||  !p_thrd  ||  !p_latency  ||  !p_service ){ line = __LINE__; goto _err_end_; }
+
+    // the connections are established up front, so that the connection
+    // setup is not included in the schedule
+    for(i=0; i<p_conf->conn_num; ++i){
+        p_info[i].fd = vapi_core_open(p_conf->port);
+        if( p_info[i].fd == -1 ){ line = __LINE__; goto _err_end_; }
+        conn_num++;
+    }
+
+    t0 = load_now_ns() + 10*1000*1000;
+
+    for(i=0; i<p_conf->conn_num; ++i){
+        p_info[i].p_conf = p_conf;
+        p_info[i].idx = i;
+        p_info[i].rate = rate / p_conf->conn_num;
+        p_info[i].t0_ns = t0;
+        p_info[i].rec_ns = t0 + (uint64_t)(p_conf->warmup * 1e9);
+        p_info[i].end_ns = p_info[i].rec_ns + (uint64_t)(p_conf->duration * 1e9);
+        p_info[i].drain_ns = p_info[i].end_ns + (uint64_t)(p_conf->duration * 1e9);
+
+        err_code = pthread_create(&p_thrd[i], NULL, load_thread, &p_info[i]);
+        if( err_code != 0 ){ line = __LINE__; goto _err_end_; }
+        thrd_num++;
+    }
+
+    for(i=0; i<thrd_num; ++i){
+        pthread_join(p_thrd[i], NULL);
+        hist_add(p_latency, &p_info[i].latency);
+        hist_add(p_service, &p_info[i].service);
+        done += p_info[i].done;
+        errors += p_info[i].errors;
+    }
+    thrd_num = 0;
+
+    for(i=0; i<conn_num; ++i) vapi_core_close(p_info[i].fd);
+
+    printf("%12.0f %12.1f %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           rate, done / p_conf->duration, (unsigned long long)errors,
+           hist_percentile(p_latency, 50.0) / 1000.0,
+           hist_percentile(p_latency, 90.0) / 1000.0,
+           hist_percentile(p_latency, 99.0) / 1000.0,
+           hist_percentile(p_latency, 99.9) / 1000.0,
+           hist_percentile(p_latency, 99.99) / 1000.0,
+           p_latency->max / 1000.0,
+           hist_percentile(p_service, 50.0) / 1000.0,
+           hist_percentile(p_service, 99.0) / 1000.0);
+    fflush(stdout);
+
+    if( verbose ){
+        printf("\n# latency distribution at %.0f req/s [us]\n", rate);
+        hist_print(stdout, p_latency);
+        printf("\n");
+    }
+
+    free(p_service);
+    free(p_latency);
+    free(p_thrd);
+    free(p_info);
+
+    return 0;
+
+  _err_end_:
+    if( line ) ERR_MSG("line=%d\n", line);
+    if( err_code ) ERR_MSG("err_code=%d\n", err_code);
+
+    for(i=0; i<thrd_num; ++i) pthread_join(p_thrd[i], NULL);
+    for(i=0; i<conn_num; ++i) vapi_core_close(p_info[i].fd);
+
+    free(p_service);
+    free(p_latency);
+    free(p_thrd);
+    free(p_info);
+
+    return -1;
+}
+
+/* parses "api_id:size[:weight],..." */
+static int load_parse_mix(load_conf_t *p_conf, char *p_str)
+{
+    char *p_save = NULL, *p_tok;
+    unsigned long api_id, size, weight;
+
+    p_conf->mix_num = 0;
+    p_conf->weight_sum = 0;
+
+    for(p_tok=strtok_r(p_str, ",", &p_save); p_tok; p_tok=strtok_r(NULL, ",", &p_save)){
+        weight = 1;
+        if( sscanf(p_tok, "%lu:%lu:%lu", &api_id, &size, &weight) < 2 ) return -1;
+        if( p_conf->mix_num == LOAD_MIX_MAX  ||  api_id > INT32_MAX  ||  weight == 0 ) return -1;
+
+        p_conf->mix[p_conf->mix_num].api_id = (int32_t)api_id;
+        p_conf->mix[p_conf->mix_num].size = (uint32_t)size;
+        p_conf->mix[p_conf->mix_num].weight = (uint32_t)weight;
+        p_conf->weight_sum += weight;
+        p_conf->mix_num++;
+    }
+    return p_conf->mix_num ? 0 : -1;
+}
+
+static void load_usage(const char *p_name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p port        sub port (default %d)\n"
+            "  -c conns       number of connections (default 16)\n"
+            "  -r rate        request rate [req/s] (default 1000)\n"
+            "  -R rate -s step\n"
+            "                 sweeps the rate from -r up to -R by step\n"
+            "  -d seconds     measured duration of a rate (default 10), after which\n"
+            "                 the late requests are still sent for as long again\n"
+            "  -w seconds     warm-up not to be measured (default 1)\n"
+            "  -m mix         api_id:size[:weight],... (default %d:%d:1)\n"
+            "  -e             exponential (Poisson) inter-arrival times\n"
+            "  -v             prints the full latency distribution\n",
+            p_name, TEST_PORT, test_api_id_test01, (int)sizeof(test_test01_t));
+}
+
+
+//=============================================================================
+// Global Function/Variable Implementations
+//=============================================================================
+int main(int argc, char *argv[])
+{
+    load_conf_t conf;
+    char mix_default[32];
+    double rate = 1000, rate_max = 0, step = 0;
+    int opt, verbose = 0;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.port = TEST_PORT;
+    conf.conn_num = 16;
+    conf.duration = 10;
+    conf.warmup = 1;
+
+    snprintf(mix_default, sizeof(mix_default), "%d:%d", test_api_id_test01, (int)sizeof(test_test01_t));
+    load_parse_mix(&conf, mix_default);
+
+    while( (opt = getopt(argc, argv, "p:c:r:R:s:d:w:m:evh")) != -1 ){
+        switch( opt ){
+          case 'p': conf.port = atoi(optarg); break;
+          case 'c': conf.conn_num = atoi(optarg); break;
+          case 'r': rate = atof(optarg); break;
+          case 'R': rate_max = atof(optarg); break;
+          case 's': step = atof(optarg); break;
+          case 'd': conf.duration = atof(optarg); break;
+          case 'w': conf.warmup = atof(optarg); break;
+          case 'm':
+            if( load_parse_mix(&conf, optarg) != 0 ){ ERR_MSG("invalid mix: %s\n", optarg); return -1; }
+            break;
+          case 'e': conf.exponential = 1; break;
+          case 'v': verbose = 1; break;
+          default: load_usage(argv[0]); return -1;
+        }
+    }
+
+    if( conf.conn_num <= 0  ||  conf.conn_num > LOAD_CONN_MAX  ||  rate <= 0  ||  conf.duration <= 0  ||  conf.warmup < 0 ){
+        load_usage(argv[0]);
+        return -1;
+    }
+    if( rate_max < rate  ||  step <= 0 ) rate_max = rate, step = 1;
+
+    LOG_MSG("port=%d, conns=%d, duration=%.1fs, warmup=%.1fs, arrival=%s\n",
+            conf.port, conf.conn_num, conf.duration, conf.warmup, conf.exponential ? "poisson" : "constant");
+
+    printf("# latency is measured from the intended send time, service time from the actual one [us]\n");
+    printf("#%11s %12s %8s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+           "rate", "throughput", "errors", "p50", "p90", "p99", "p99.9", "p99.99", "max", "svc_p50", "svc_p99");
+
+    for(; rate <= rate_max; rate += step)
+      if( load_run(&conf, rate, verbose) != 0 ) return -1;
+
+    return 0;
+}
@@ -36,6 +36,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 
 //=============================================================================
@@ -46,7 +47,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define ERR_MSG(fmt,args...) fprintf(stderr, "[EX_SUB][ERR][%s] " fmt, __FUNCTION__, ##args)
 #define NOT_IMPLEMENTED ERR_MSG("Not Implemented: %s:%04d\n", __FILE__, __LINE__);
 
-typedef int (*api_handler_t)(void* p_arg, uint32_t arg_len);
+typedef struct
+{
+    int32_t token;
+    test_test03_t arg;
+} test03_job_t;
+
+static int32_t sub_fd = -1;
 
 
 //=============================================================================
@@ -59,77 +66,109 @@ typedef int (*api_handler_t)(void* p_arg, uint32_t arg_len);
 static int test01(uint32_t set_val, uint32_t *p_get_val)
 {
     *p_get_val = set_val;
+    vapi_core_sub_publish(sub_fd, topic_test01, &set_val, sizeof(set_val));
     return 0;
 }
 
 static int test02(uint8_t *p_buff, uint32_t len)
 {
-    int i;
+    uint32_t i;
     for(i=0; i<len; ++i)
       p_buff[i] = (uint8_t)i;
     return 0;
 }
 
+static void* test03_thread(void *p_arg)
+{
+    test03_job_t *p_job = (test03_job_t*)p_arg;
+
+    usleep(1000);  // long-running work off the connection thread
+    p_job->arg.get_val = p_job->arg.set_val;
+    vapi_core_sub_complete(p_job->token, 0, &p_job->arg, sizeof(p_job->arg));
+    free(p_job);
+
+    return NULL;
+}
+
 //------------------------------------------------------------
 // API Handler Implementations
 //------------------------------------------------------------
-static api_handler_t api_id_test01_handler(void* p_arg, uint32_t arg_len)
+int test_test01_handler(test_test01_t *p_arg, void *p_cookie)
+{
+    return test01( p_arg->set_val, &p_arg->get_val );
+}
+
+int test_test02_handler(void *p_arg, uint32_t arg_len, void *p_cookie)
+{
+    return test02( (uint8_t*)p_arg, arg_len );
+}
+
+int test_test03_handler(test_test03_t *p_arg, void *p_cookie)
 {
     int err_code = 0, line = 0;
-    struct any_structure_01_t *p_struct;
+    test03_job_t *p_job = NULL;
+    pthread_t thrd;
+
+    p_job = malloc(sizeof(test03_job_t));
+    if( !p_job ){ line = __LINE__; goto _err_end_; }
+    p_job->arg = *p_arg;
+
+    p_job->token = vapi_core_sub_defer();
+    if( p_job->token == -1 ){ line = __LINE__; goto _err_end_; }
 
-    if( arg_len != sizeof(struct any_structure_01_t) ){ line = __LINE__; goto _err_end_; }
+    err_code = pthread_create(&thrd, NULL, test03_thread, p_job);
+    if( err_code != 0 ){
+        vapi_core_sub_complete(p_job->token, -1, NULL, 0);
+        line = __LINE__;
+        goto _err_end_;
+    }
+    pthread_detach(thrd);
 
-    p_struct = (struct any_structure_01_t*)p_arg;
-    err_code = test01( p_struct->set_val, &p_struct->get_val);
-    return (api_handler_t)err_code;
+    return VAPI_CORE_SUB_PENDING;
 
 
   _err_end_:
     if( line ) ERR_MSG("line=%d\n", line);
     if( err_code ) ERR_MSG("err_code=%d\n", err_code);
 
-    return (api_handler_t)-1;
-}
+    if( p_job ) free(p_job);
 
-static api_handler_t api_id_test02_handler(void* p_arg, uint32_t arg_len)
-{
-    int err_code = 0;
-    err_code = test02( (uint8_t*)p_arg, arg_len );
-    return (api_handler_t)err_code;
+    return -1;
 }
 
 //------------------------------------------------------------
 // Root Handler Implementations
 //------------------------------------------------------------
-static api_handler_t api_handler_table[api_id_max] = {
-    NULL,
-    (api_handler_t)api_id_test01_handler,
-    (api_handler_t)api_id_test02_handler,
-};
-
-static vapi_core_sub_handler_t root_handler(int32_t api_id, void* p_arg, uint32_t arg_len, void *p_cookie)
+static int root_handler(int32_t api_id, void* p_arg, uint32_t arg_len, void *p_cookie)
 {
     DBG_MSG("api_id=%d\n", api_id);
 
-    if( api_id > api_id_min  &&  api_id < api_id_max  &&  api_handler_table[api_id] ){
-        api_handler_table[api_id](p_arg, arg_len);
-        return (vapi_core_sub_handler_t)0;
-    } else {
-        return (vapi_core_sub_handler_t)-1;
-    }
+    return test_dispatch( api_id, p_arg, arg_len, p_cookie );
 }
 
 //------------------------------------------------------------
 // Test Function Implementations
 //------------------------------------------------------------
-static int vapi_sub_test_start(void)
+static int vapi_sub_test_start(const char *p_capture)
 {
     int err_code = 0, line = 0;
     int fd;
+    vapi_core_sub_attr_t attr;
 
-    fd = vapi_core_sub_open(TEST_PORT, (vapi_core_sub_handler_t)root_handler, NULL);
+    vapi_core_sub_attr_init(&attr);
+    attr.port = TEST_PORT;
+    attr.worker_num = 4;  // for the unordered requests
+    attr.metrics_port = TEST_PORT + 1;  // curl http://127.0.0.1:60001/metrics
+
+    fd = vapi_core_sub_open_attr(&attr, root_handler, NULL);
     if( fd == -1 ){ line = __LINE__; goto _err_end_; }
+    sub_fd = fd;
+
+    // the traffic can be replayed by vapi_core_replay
+    if( p_capture ){
+        err_code = vapi_core_sub_capture_start(fd, p_capture, VAPI_CORE_SUB_CAPTURE_PAYLOAD);
+        if( err_code == -1 ){ line = __LINE__; goto _err_end_; }
+    }
 
     LOG_MSG("Please type 'x' to exit.\n");
     while( getchar() != 'x' );
@@ -154,6 +193,6 @@ static int vapi_sub_test_start(void)
 //=============================================================================
 int main(int argc, char *argv[])
 {
-    return vapi_sub_test_start();
+    return vapi_sub_test_start( argc == 2 ? argv[1] : NULL );
 }
 